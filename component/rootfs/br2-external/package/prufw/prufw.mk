@@ -13,6 +13,10 @@ ifeq ($(BR2_PACKAGE_PRUFW_LED_DIAG),y)
 PRUFW_CFLAGS += -DLED_DIAG_ENABLED
 endif
 
+ifeq ($(BR2_PACKAGE_PRUFW_TRACE_FRM_EDGES),y)
+PRUFW_CFLAGS += -DTRACE_FRM_EDGES_ENABLED
+endif
+
 define PRUFW_BUILD_CMDS
 	$(TARGET_MAKE_ENV) $(MAKE) PRU_CGT=$(TI_CGT_PRU_INSTALLDIR) -C $(@D) \
 		CFLAGS="$(PRUFW_CFLAGS)"
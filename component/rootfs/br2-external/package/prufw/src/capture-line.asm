@@ -0,0 +1,90 @@
+;
+; Camera line capture engine for PRU0.
+;
+; Samples the D0-D7 data lines on each PCLK rising edge, as long as HREF is
+; high, and stores the resulting bytes in the provided line buffer. Since the
+; line bytes are processed as they arrive, the loop is hand-scheduled to keep
+; the number of cycles spent between two consecutive PCLK edges bounded:
+;
+;   - PCLK high: up to 10 cycles (50 ns) to sample, pack and store the byte
+;   - PCLK low:  2 cycles (10 ns) per poll to detect the line end and the edge
+;
+; which allows for PCLK frequencies up to ~8 MHz at 50% duty cycle.
+;
+; The PRU0 R31 bits are mapped as follows:
+;   D0-D2 -> 0-2, D3 -> 14, D4-D7 -> 4-7, PCLK -> 15, HREF -> 16
+;
+; Note function input arguments are stored in R14..R29, while the return value
+; is stored in R14. For more details, refer to "PRU Optimizing C/C+ Compiler
+; User's Guide" document, section "Function Structure and Calling Conventions".
+;
+; Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+;
+
+PIN_D3		.set	14
+PIN_PCLK	.set	15
+PIN_HREF	.set	16
+
+; See CAP_LINE_F_LATE in main-pru0.c
+CAP_LINE_F_LATE	.set	16
+
+;
+; uint32_t capture_line(volatile uint32_t *buf, uint32_t len, uint32_t tmout);
+;
+	.sect	".text:capture_line"
+	.clink
+	.global	||capture_line||
+
+||capture_line||:
+	; arg1 (buf) is in R14, arg2 (len) is in R15, arg3 (tmout) is in R16
+	zero	&r17, 4
+
+	; HREF must be low, otherwise we have exceeded the line cycle budget
+	qbbc	$2, r31, PIN_HREF
+
+	; Skip the partial line and report it
+$1:
+	sub		r16, r16, 1
+	qbeq	$3, r16, 0
+	qbbs	$1, r31, PIN_HREF
+$3:
+	zero	&r14, 4
+	set		r14, r14, CAP_LINE_F_LATE
+	jmp		r3.w2
+
+	; Wait for HREF to go high, 3 cycles per iteration
+$2:
+	qbbs	$4, r31, PIN_HREF
+	sub		r16, r16, 1
+	qbne	$2, r16, 0
+
+	; Timeout, no line started
+	zero	&r14, 4
+	jmp		r3.w2
+
+	; Wait for PCLK to go low
+$4:
+	qbbs	$4, r31, PIN_PCLK
+
+	; Wait for PCLK rising edge, stop as soon as HREF goes low
+$5:
+	qbbc	$7, r31, PIN_HREF
+	qbbc	$5, r31, PIN_PCLK
+
+	; Sample data lines and move D3 from bit 14 to bit 3
+	mov		r18, r31
+	and		r19.b0, r18.b0, 0xf7
+	qbbc	$6, r18, PIN_D3
+	set		r19.b0, r19.b0, 3
+$6:
+	; Count but don't store the bytes exceeding len
+	qble	$8, r17, r15
+	sbbo	&r19.b0, r14, r17, 1
+$8:
+	add		r17, r17, 1
+	jmp		$4
+
+	; Return the no. of bytes in the line
+$7:
+	mov		r14, r17
+	jmp		r3.w2
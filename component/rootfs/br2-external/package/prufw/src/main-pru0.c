@@ -1,9 +1,9 @@
 /*
  * BeagleCam firmware for PRU0.
  *
- * Reads raw data from the camera module and transfered it to PRU1 via the 3
- * scratch pad banks. The data is in RGB565 format, which means that 16 bits
- * (2 bytes) are used per pixel.
+ * Reads raw data from the camera module and transfers it to PRU1 via a double
+ * buffer of image lines in the shared RAM. The data is in RGB565 format, which
+ * means that 16 bits (2 bytes) are used per pixel.
  *
  * The start of each frame is signalled by VSYNC going low while the first line
  * of data appears when HREF goes high. Since from PRU0 we can only access data
@@ -18,8 +18,30 @@
  *
  * PRU0 starts waiting for a command in the shared memory buffer to be set by
  * PRU1 indicating that PRU0 should proceed reading data from the camera module.
- * To ensure a reliable data transfer, PRU0 maintains a sequence counter that
- * is incremented before each data transfer.
+ * Once started, PRU0 streams the lines continuously, across frame boundaries,
+ * until PRU1 requests to stop the capture.
+ * To ensure a reliable data transfer, PRU0 maintains a line sequence counter
+ * that is incremented for each captured line. Once a line buffer is filled,
+ * its descriptor is XFER-ed to PRU1 via a scratch pad bank. If PRU1 has not
+ * yet released the line buffer to be filled next, the line is dropped and
+ * PRU1 detects the gap in the sequence numbers.
+ *
+ * In test mode, PRU0 also simulates the VSYNC timing and flags the first line
+ * of each frame, since there is no VSYNC signal to be checked by PRU1.
+ *
+ * Otherwise the lines are read by the capture engine in capture-line.asm,
+ * which samples D0-D7 on each PCLK rising edge while HREF is high. PRU0 has
+ * to complete the processing of a line within the HREF low period, i.e. the
+ * line cycle budget. When this is exceeded, the partial line is skipped and
+ * CAP_DATA_F_OVERRUN is reported to PRU1 via the next line descriptor. Lines
+ * not matching the configured size are reported via CAP_DATA_F_LINE_ERR.
+ *
+ * When a region of interest and/or a horizontal decimation is configured,
+ * PRU0 keeps only the selected pixels, compacting the line buffer in place
+ * before handing it over to PRU1. This is done within the line cycle budget,
+ * hence it doesn't apply to the lines reported with errors. The same pass
+ * optionally reduces the pixels to 8 bits, i.e. keeps the luma of the YUV422
+ * camera output or packs the RGB565 one to RGB332, see enum bcam_pix_fmt.
  *
  * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
  */
@@ -27,6 +49,7 @@
 #include <stdint.h>
 #include <pru_intc.h>
 
+#include "bcam-rpmsg-api.h"
 #include "pru-comm.h"
 #include "resource_table_0.h"
 
@@ -34,11 +57,33 @@
 
 volatile register uint32_t __R31;
 
+/*
+ * Timeout waiting for HREF to go high, allows checking for PRU1 commands
+ * during the vertical blanking.
+ */
+#define HREF_TMOUT_USEC			1000
+
+/* The capture engine polls HREF every 3 cycles */
+#define HREF_TMOUT_LOOPS		(HREF_TMOUT_USEC * PRU_CYCLES_PER_USEC / 3)
+
+/* The line capture started after HREF went high */
+#define CAP_LINE_F_LATE			((uint32_t)1 << 16)
+
+/* Line size mask of the capture_line() return value */
+#define CAP_LINE_LEN_MASK		0xffff
+
+/*
+ * Captures a line from the camera module into buf, storing at most len bytes.
+ * Returns the no. of bytes in the line, 0 if HREF didn't go high within tmout
+ * polling loops or CAP_LINE_F_LATE if HREF was already high on entry.
+ */
+extern uint32_t capture_line(volatile uint32_t *buf, uint32_t len, uint32_t tmout);
+
 /* Global data */
 static struct cap_data frm_data;
 static uint8_t capture_started;
-static uint8_t crt_bank;
-static uint16_t test_pclk_cycles;
+static uint16_t frm_line;
+static uint32_t test_pclk_cycles;
 
 /*
  * Checks for commands from PRU1.
@@ -58,17 +103,18 @@ static uint8_t check_pru1_cmd() {
 	switch (id) {
 	case PRU_CMD_CAP_START:
 		capture_started = 1;
-		crt_bank = 0;
 
-		/* Invalidate content of scratch pad banks */
+		/* Invalidate content of scratch pad bank */
 		frm_data.seq = 0;
 		frm_data.len = 0;
-		STORE_DATA(0, frm_data);
-		STORE_DATA(1, frm_data);
-		STORE_DATA(2, frm_data);
+		frm_data.buf_idx = 0;
+		frm_data.flags = 0;
+		STORE_DATA(CAP_DATA_BANK, frm_data);
+
+		frm_line = 0;
 
 		if (SMEM.cap_config.test_mode != 0)
-			test_pclk_cycles = sizeof(frm_data.data) *
+			test_pclk_cycles = (uint32_t)SMEM.cap_config.line_sz *
 					   PRU_CYCLES_PER_USEC / SMEM.cap_config.test_pclk_mhz;
 		break;
 
@@ -87,33 +133,92 @@ static uint8_t check_pru1_cmd() {
 }
 
 /*
- * Generates test RGB565 pixels stored in BGR (little endian) format.
+ * Generates a line of test RGB565 pixels stored in BGR (little endian) format.
+ * Note each 32-bit word contains 2 pixels.
  */
-static void generate_test_data(struct cap_data *buf)
+static void generate_test_data(volatile uint32_t *line, uint16_t line_no)
 {
-	uint32_t img_part_size = SMEM.cap_config.img_sz / 3;
-	uint32_t img_part_off = buf->seq * sizeof(buf->data);
-	uint8_t iter = 0;
-
-	while (iter < sizeof(buf->data)) {
-		if (img_part_off < img_part_size) {
-			/* RED */
-			buf->data[iter++] = 0x00;
-			buf->data[iter++] = 0xf8;
-		} else if (img_part_off < 2 * img_part_size) {
-			/* GREEN */
-			buf->data[iter++] = 0xe0;
-			buf->data[iter++] = 0x07;
-		} else {
-			/* BLUE */
-			buf->data[iter++] = 0x1f;
-			buf->data[iter++] = 0x00;
-		}
+	uint32_t img_part_size = (uint32_t)SMEM.cap_config.line_sz * SMEM.cap_config.yres / 3;
+	uint32_t img_part_off = (uint32_t)line_no * SMEM.cap_config.line_sz;
+	uint16_t words = (SMEM.cap_config.line_sz + 3) / 4;
+	uint16_t iter;
 
-		img_part_off += 2;
+	for (iter = 0; iter < words; iter++) {
+		if (img_part_off < img_part_size)
+			line[iter] = 0xf800f800;	/* RED */
+		else if (img_part_off < 2 * img_part_size)
+			line[iter] = 0x07e007e0;	/* GREEN */
+		else
+			line[iter] = 0x001f001f;	/* BLUE */
+
+		img_part_off += 4;
 	}
+}
 
-	buf->len = iter;
+/*
+ * Keeps only the ROI pixels of a line, converting them to the output pixel
+ * format and moving them to the start of the line buffer. Since the output
+ * pixels are never larger than the camera ones and are moved towards the
+ * buffer start, the copy can be done in place.
+ *
+ * This runs while HREF is low, i.e. 144 of the 784 tp of a VGA line, with
+ * tp = 2 PCLK. The VGA PCLK runs at 8 MHz, i.e. 4 times the QQVGA one, since
+ * its PCLK divider is bypassed, hence 36 usec or 7200 PRU cycles. The per-pixel
+ * loops take about 10 cycles per output pixel, i.e. up to 6400 cycles for a
+ * full VGA line, hence the ROI lines without decimation and pixel format
+ * conversion are moved one word (2 pixels) at a time, in about 2900 cycles.
+ * The decimated lines have at most 320 output pixels.
+ */
+static void pack_line(volatile uint32_t *line)
+{
+	volatile uint8_t *dst = (volatile uint8_t *)line;
+	volatile uint8_t *src = dst + SMEM.cap_config.roi_off;
+	volatile uint8_t *end = dst + SMEM.cap_config.out_line_sz;
+	uint16_t step = SMEM.cap_config.roi_step;
+	volatile uint32_t *wsrc;
+	uint16_t pix, words;
+
+	switch (SMEM.cap_config.pix_fmt) {
+	case BCAM_PIX_FMT_Y8:
+		/* YUYV, i.e. the Y byte comes first in each camera pixel */
+		while (dst < end) {
+			*dst++ = *src;
+			src += step;
+		}
+		break;
+
+	case BCAM_PIX_FMT_RGB332:
+		/* Keep the most significant bits of each RGB565 channel */
+		while (dst < end) {
+			pix = *(volatile uint16_t *)src;
+			*dst++ = ((pix >> 8) & 0xe0) | ((pix >> 6) & 0x1c) | ((pix >> 3) & 0x03);
+			src += step;
+		}
+		break;
+
+	default:
+		if (step == SMEM.cap_config.bpp / 8 && (SMEM.cap_config.roi_off & 3) == 0) {
+			/* Contiguous pixels, the tail bytes are copied below */
+			wsrc = (volatile uint32_t *)src;
+			for (words = SMEM.cap_config.out_line_sz / 4; words > 0; words--)
+				*line++ = *wsrc++;
+			dst = (volatile uint8_t *)line;
+			src = (volatile uint8_t *)wsrc;
+			while (dst < end)
+				*dst++ = *src++;
+		} else if (SMEM.cap_config.bpp == 16) {
+			while (dst < end) {
+				*(volatile uint16_t *)dst = *(volatile uint16_t *)src;
+				dst += 2;
+				src += step;
+			}
+		} else {
+			while (dst < end) {
+				*dst++ = *src;
+				src += step;
+			}
+		}
+	}
 }
 
 /*
@@ -121,12 +226,16 @@ static void generate_test_data(struct cap_data *buf)
  */
 void main(void)
 {
+	uint32_t ret;
+	uint16_t seq;
+	uint8_t buf_idx, overrun;
+
 	/* Clear the status of all interrupts */
 	CT_INTC.SECR0 = 0xFFFFFFFF;
 	CT_INTC.SECR1 = 0xFFFFFFFF;
 
 	/* Init data */
-	frm_data.pad = 0;
+	frm_data.pad[0] = frm_data.pad[1] = 0;
 	capture_started = 0;
 
 	while (1) {
@@ -137,8 +246,26 @@ check_status:
 		if (capture_started == 0)
 			continue;
 
+		seq = frm_data.seq + 1;
+		buf_idx = LINE_BUF_IDX(seq);
+
+		/* Check if PRU1 released the line buffer to be filled */
+		overrun = (uint16_t)(seq - SMEM.line_ack_seq) > LINE_BUF_CNT;
+
 		if (SMEM.cap_config.test_mode != 0) {
-			generate_test_data(&frm_data);
+			if (frm_line == 0) {
+				/*
+				 * Simulate VSYNC according to the OV7670 specs:
+				 * (VSYNC - HREF) delay = 20 * HREF duration
+				 */
+				delay_cycles_var(20 * test_pclk_cycles);
+
+				if (check_pru1_cmd() != PRU_CMD_NONE)
+					goto check_status;
+			}
+
+			if (!overrun)
+				generate_test_data(SMEM.line_buf[buf_idx], frm_line);
 
 			/* Simulate PCLK */
 			delay_cycles_var(test_pclk_cycles);
@@ -146,30 +273,51 @@ check_status:
 			if (check_pru1_cmd() != PRU_CMD_NONE)
 				goto check_status;
 
+			frm_data.flags = (frm_line == 0 ? CAP_DATA_F_FRM_START : 0);
+
+			if (++frm_line == SMEM.cap_config.yres)
+				frm_line = 0;
 		} else {
-			//TODO: get data from camera module
+			/* Count the line bytes even when there is no buffer to fill */
+			ret = capture_line(SMEM.line_buf[buf_idx],
+					   overrun ? 0 : SMEM.cap_config.line_sz,
+					   HREF_TMOUT_LOOPS);
+
+			/* No line yet, e.g. vertical blanking */
+			if (ret == 0)
+				continue;
+
+			/* Line budget exceeded, PRU1 detects the gap in seq */
+			if (ret & CAP_LINE_F_LATE) {
+				frm_data.flags |= CAP_DATA_F_OVERRUN;
+				frm_data.seq = seq;
+				continue;
+			}
+
+			if ((ret & CAP_LINE_LEN_MASK) != SMEM.cap_config.line_sz)
+				frm_data.flags |= CAP_DATA_F_LINE_ERR;
 		}
 
-		frm_data.seq++;
+		frm_data.seq = seq;
+
+		/* Line dropped, PRU1 is notified via the next descriptor */
+		if (overrun)
+			continue;
 
 		/*
-		 * Store captured data in the current scratch pad bank.
-		 * Note using the switch statement as workaround for:
-		 * "error #664: expected an integer constant"
+		 * Avoid compacting when the full line is captured in the camera
+		 * pixel format, the 8-bit formats always halve the line size.
 		 */
-		switch (crt_bank) {
-		case 0:
-			STORE_DATA(0, frm_data);
-			break;
-		case 1:
-			STORE_DATA(1, frm_data);
-			break;
-		case 2:
-			STORE_DATA(2, frm_data);
-			break;
-		}
+		if (SMEM.cap_config.out_line_sz != SMEM.cap_config.line_sz &&
+		    (frm_data.flags & CAP_DATA_F_LINE_ERR) == 0)
+			pack_line(SMEM.line_buf[buf_idx]);
+
+		/* Store line descriptor in the scratch pad bank */
+		frm_data.len = SMEM.cap_config.out_line_sz;
+		frm_data.buf_idx = buf_idx;
+		STORE_DATA(CAP_DATA_BANK, frm_data);
 
-		/* Move to next scratch bank */
-		NEXT_BANK(crt_bank);
+		/* The error flags are reported only once */
+		frm_data.flags = 0;
 	}
 }
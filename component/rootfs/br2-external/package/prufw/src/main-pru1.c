@@ -3,9 +3,16 @@
  *
  * Writes the data captured by PRU0 to ARM host via the RPMsg infrastructure.
  *
- * Once PRU1 is initialized, it starts monitoring the VSYNC signal to detect
- * the start of a new frame and it notifies PRU0 to read the raw data from the
- * camera module and transfer it to PRU1 via the scratch pad banks.
+ * Once the capture is started, PRU1 notifies PRU0 to continuously read the raw
+ * data from the camera module and transfer it to PRU1 line by line via the
+ * shared RAM. The start of a new frame is detected by monitoring the VSYNC
+ * signal or, in test mode, by the frame start flag set by PRU0. The frame end
+ * is determined by counting the received data. Frames are discarded when PRU0
+ * reports a line capture error, such as a line cycle budget overrun.
+ *
+ * When a region of interest and/or a vertical decimation is configured, only
+ * the selected lines are sent to ARM, while the pixels outside the ROI have
+ * already been dropped by PRU0.
  *
  * Note the maximum RPMSG message size is 512 bytes, but only 496 bytes can be
  * used for actual data since 16 bytes are reserved for the message header (see
@@ -14,13 +21,29 @@
 
  * To allow validation of the incoming data on the ARM  side, PRU1 adds a 1-byte
  * frame section ID and a 2-byte sequence number, followed by pixel data. The
- * sequence number is reset when the frame section changes.
+ * sequence number is reset at the start of each frame. Each message is filled
+ * with as much pixel data as possible, regardless of the line boundaries.
+ * The frame end section is completed by a trailer providing the checksum of
+ * the frame data, the no. of frames discarded by PRU1 in the meantime and
+ * the time spent since the frame start, measured via the IEP timer, since the
+ * PRU1 cycle counter is reset for each line.
+ *
+ * Alternatively, when requested via the BCAM_ARM_MSG_CAP_SETUP command, PRU1
+ * writes the frames directly to the DDR frame ring allocated by the host for
+ * the resource table carveout and sends just a BCAM_PRU_MSG_FRM_RDY message
+ * for each completed frame. Frames are skipped while all ring slots are busy.
  *
  * The host can manage the frame aquisition by sending dedicated RPMsg commands
  * to PRU1. Additionally, frame aquisition is automatically stopped in case
  * unexpected errors occured. Those errors are sent to the host via dedicated
  * log messages.
  *
+ * The recoverable capture errors, e.g. lost lines, are instead recorded as
+ * binary events in the trace ring kept in the shared RAM, without using the
+ * RPMsg link. The host gets them on request, via the BCAM_ARM_MSG_GET_TRACE
+ * command. The frame edges are recorded only when TRACE_FRM_EDGES_ENABLED is
+ * defined, since they would quickly overwrite the errors.
+ *
  * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
  */
 
@@ -28,6 +51,7 @@
 
 #include <pru_cfg.h>
 #include <pru_ctrl.h>
+#include <pru_iep.h>
 #include <pru_intc.h>
 #include <pru_rpmsg.h>
 
@@ -61,12 +85,22 @@ volatile register uint32_t __R31;
 /* Timeout waiting for ACKs from PRU0 */
 #define PRU0_ACK_TMOUT_USEC		1000
 
-/* Timeout waiting for cap_data messages from PRU0 */
-#define PRU0_CAP_TMOUT_USEC		5000
+/*
+ * Timeout waiting for cap_data descriptors from PRU0, must exceed the
+ * vertical blanking time, i.e. 20 VGA lines at 1 MHz PCLK.
+ */
+#define PRU0_CAP_TMOUT_USEC		100000
+
+/* Camera VSYNC signal */
+#define PIN_VSYNC			12 /* P8_21 */
 
 /* Diagnosis via LED blinking */
 #define PIN_LED				13 /* P8_20 */
 
+/* Frame reception states */
+#define FRM_WAIT_START			0 /* Waiting for the first line of a frame */
+#define FRM_RECEIVING			1 /* Receiving the lines of a frame */
+
 /*
  * Standard structure copied from pru_rpmsg.c.
  * Currently used to implement rpmsg_send_cap().
@@ -87,6 +121,35 @@ static uint8_t arm_recv_buf[RPMSG_MESSAGE_SIZE];
 static uint8_t arm_send_buf[RPMSG_MESSAGE_SIZE];
 static enum bcam_cap_status run_state = BCAM_CAP_STOPPED;
 
+/* DDR frame ring, NULL if not available */
+static volatile struct bcam_frm_ring_hdr *frm_ring;
+static int8_t frm_slot = -1;
+static uint8_t frm_slot_next;
+static uint16_t frm_seq;
+
+/* Frame trailer data, see struct bcam_frm_trailer */
+static uint32_t frm_csum;
+static uint16_t frm_dropped;
+static uint32_t frm_start_time;
+
+/* Trace events overwritten before being sent to ARM */
+static uint16_t trace_lost;
+
+/*
+ * The frame edges would fill the trace ring in ~2 seconds at 30 fps, hence
+ * they are recorded on request only.
+ */
+#ifndef TRACE_FRM_EDGES_ENABLED
+#define trace_frm_edge(id, arg0, arg1)	((void)0)
+#else
+#define trace_frm_edge(id, arg0, arg1)	trace_evt(id, arg0, arg1)
+#endif
+
+/* Max no. of trace events in a BCAM_PRU_MSG_TRACE message */
+#define TRACE_MSG_EVT_CNT	((RPMSG_MESSAGE_SIZE - sizeof(uint8_t) - \
+				  sizeof(((struct bcam_pru_msg *)0)->trace_hdr)) / \
+				 sizeof(struct bcam_trace_evt))
+
 /*
  * Disables PRU1 cycle counter in CTRL register.
  */
@@ -123,6 +186,33 @@ static int timer_expired(uint32_t tmout_usec)
 	return 1;
 }
 
+/*
+ * Starts the IEP timer as a free running counter, incremented on each
+ * PRU cycle, i.e. BCAM_PRU_TICKS_PER_USEC. Note the IEP is not used by PRU0.
+ */
+static void init_iep_timer()
+{
+	CT_IEP.TMR_GLB_CFG_bit.CNT_EN = 0;
+	CT_IEP.TMR_CNT = 0xFFFFFFFF;	/* Write 1 to clear */
+	CT_IEP.TMR_GLB_CFG_bit.DEFAULT_INC = 1;
+	CT_IEP.TMR_GLB_CFG_bit.CNT_EN = 1;
+}
+
+/*
+ * Records an event in the trace ring, overwriting the oldest one if full.
+ */
+static void trace_evt(uint8_t id, uint16_t arg0, uint32_t arg1)
+{
+	volatile struct bcam_trace_evt *evt = &SMEM.trace[SMEM.trace_head & (TRACE_RING_SIZE - 1)];
+
+	evt->ts = CT_IEP.TMR_CNT;
+	evt->id = id;
+	evt->arg0 = arg0;
+	evt->arg1 = arg1;
+
+	SMEM.trace_head++;
+}
+
 /*
  * Utility to start/stop data capture on PRU0.
  * Returns 0 on success or -1 on failure.
@@ -131,6 +221,7 @@ static int16_t start_stop_capture(uint8_t start)
 {
 	/* Prepare command for PRU0 */
 	SMEM.pru1_cmd.id = PRU_CMD_NONE;
+	SMEM.line_ack_seq = 0;
 	SMEM.pru0_cmd.id = start ? PRU_CMD_CAP_START : PRU_CMD_CAP_STOP;
 
 	/* Reset timer */
@@ -172,12 +263,25 @@ static void init_pru_core()
 	CT_INTC.SECR0 = 0xFFFFFFFF;
 	CT_INTC.SECR1 = 0xFFFFFFFF;
 
+	/* Timestamp the frames and the trace events */
+	init_iep_timer();
+	SMEM.trace_head = 0;
+	SMEM.trace_tail = 0;
+
 	/* Set default frame acquisition configuration */
 	SMEM.cap_config.xres = 160;
 	SMEM.cap_config.yres = 120;
 	SMEM.cap_config.bpp = 16;
+	SMEM.cap_config.pix_fmt = BCAM_PIX_FMT_RGB565;
 	SMEM.cap_config.img_sz = SMEM.cap_config.xres * SMEM.cap_config.yres * SMEM.cap_config.bpp / 8;
+	SMEM.cap_config.line_sz = SMEM.cap_config.xres * SMEM.cap_config.bpp / 8;
+	SMEM.cap_config.out_line_sz = SMEM.cap_config.line_sz;
+	SMEM.cap_config.roi_off = 0;
+	SMEM.cap_config.roi_step = SMEM.cap_config.bpp / 8;
+	SMEM.cap_config.roi_y = 0;
+	SMEM.cap_config.dec_y = 1;
 	SMEM.cap_config.test_mode = 1;
+	SMEM.cap_config.xfer_mode = BCAM_XFER_RPMSG;
 
 	/* 3 Hz LED blink for 2 seconds */
 	for (blinks = 0; blinks < 6; blinks++) {
@@ -275,95 +379,324 @@ static int16_t rpmsg_send_log(struct pru_rpmsg_transport *transport, uint32_t sr
 			      (uint32_t)data_buf - (uint32_t)arm_send_buf);
 }
 
+/*
+ * Sends the oldest trace events to ARM, as many as fit in a message, as
+ * requested via BCAM_ARM_MSG_GET_TRACE. The message is sent even when no
+ * events are pending.
+ */
+static int16_t rpmsg_send_trace(struct pru_rpmsg_transport *transport,
+				uint32_t src, uint32_t dst)
+{
+	struct bcam_pru_msg *msg = (struct bcam_pru_msg *)arm_send_buf;
+	struct bcam_trace_evt *evts = (struct bcam_trace_evt *)msg->trace_hdr.data;
+	uint16_t pending, cnt, i;
+
+	pending = SMEM.trace_head - SMEM.trace_tail;
+	if (pending > TRACE_RING_SIZE) {
+		trace_lost += pending - TRACE_RING_SIZE;
+		SMEM.trace_tail = SMEM.trace_head - TRACE_RING_SIZE;
+		pending = TRACE_RING_SIZE;
+	}
+
+	cnt = (pending > TRACE_MSG_EVT_CNT ? TRACE_MSG_EVT_CNT : pending);
+	for (i = 0; i < cnt; i++)
+		evts[i] = SMEM.trace[(SMEM.trace_tail + i) & (TRACE_RING_SIZE - 1)];
+	SMEM.trace_tail += cnt;
+
+	msg->type = BCAM_PRU_MSG_TRACE;
+	msg->trace_hdr.lost = trace_lost;
+	msg->trace_hdr.pending = pending - cnt;
+	trace_lost = 0;
+
+	return pru_rpmsg_send(transport, src, dst, arm_send_buf,
+			      (uint32_t)&evts[cnt] - (uint32_t)arm_send_buf);
+}
+
 /*
  * Re-implementation of pru_rpmsg_send() to optimize capture data transfer
- * by caching the data blocks until the total size of the data exceeds
- * RPMSG_MESSAGE_SIZE bytes.
+ * by filling each transmission queue buffer with RPMSG_MESSAGE_SIZE bytes,
+ * i.e. the given data is split across as many messages as necessary, while
+ * the remaining data is cached to be sent along with the subsequent data.
+ *
+ * Whenever a message is complete, the ARM host is kicked to process it and
+ * a new transmission queue buffer will be used to store subsequent data.
  *
- * When that happens, the ARM host is kicked to process the current transmission
- * queue buffer and a new one will be used to store subsequent messages.
+ * The 'frm' argument indicates the frame section the data belongs to:
+ * BCAM_FRM_START resets the message sequence for a new frame, BCAM_FRM_END
+ * forces sending the cached data marked as frame end, while BCAM_FRM_INVALID
+ * forces sending the cached data, if any, marked as invalid.
  *
- * To explicitly flush the cache, call the function with 'flush' argument set
- * to 1, which forces the data transfer.
+ * The BCAM_FRM_END data, i.e. the frame trailer, is never split across
+ * messages: if it doesn't fit in the cached message, the latter is sent as
+ * is and the trailer is stored in a new message.
  */
 static int16_t rpmsg_send_cap(struct pru_rpmsg_transport *transport,
-			      uint32_t src, uint32_t dst,
-			      struct cap_data *cap, uint8_t flush)
+			      uint32_t src, uint32_t dst, uint8_t frm,
+			      const uint8_t *data, uint16_t len)
 {
 	/* Standard RPMsg infrastructure data */
 	static struct pru_rpmsg_hdr	*msg;
 	static uint32_t			msg_len;
 	static int16_t			head;
-	static struct pru_virtqueue	*virtqueue;
+	struct pru_virtqueue		*virtqueue = &transport->virtqueue0;
 
 	/* Transfer optimization data */
 	static uint16_t			cached_len = 0;
 	static uint16_t			bseq = 0;
 	struct bcam_pru_msg		*bmsg;
+	uint16_t			chunk_len;
+	uint8_t				flush;
 	int16_t				ret;
 
-	if (cap != NULL) {
+	if (frm == BCAM_FRM_START) {
+		/* Discard data left from an incomplete frame */
 		if (cached_len > 0) {
-			bmsg = (struct bcam_pru_msg *)msg->data;
-
-			/*
-			 * Force transferring cached frame if its section
-			 * changed or there is no room to append new content.
-			 * Note cap->seq provides frame section type (see main loop).
-			 */
-			if (cap->seq != bmsg->cap_hdr.frm ||
-					cached_len + cap->len > RPMSG_MESSAGE_SIZE) {
-				ret = rpmsg_send_cap(transport, src, dst, NULL, 1);
-				if (ret != PRU_RPMSG_SUCCESS)
-					return ret;
-			}
+			ret = rpmsg_send_cap(transport, src, dst, BCAM_FRM_INVALID, NULL, 0);
+			if (ret != PRU_RPMSG_SUCCESS)
+				return ret;
 		}
 
+		bseq = 0; /* Reset frame part seq for each new frame */
+	}
+
+	flush = (frm == BCAM_FRM_END || frm == BCAM_FRM_INVALID);
+	if (len == 0 && flush == 0)
+		return PRU_RPMSG_NO_KICK;
+
+	do {
 		if (cached_len == 0) {
 			/* Cache empty, get new pru queue buffer */
-			virtqueue = &transport->virtqueue0;
 			head = pru_virtqueue_get_avail_buf(virtqueue, (void **)&msg, &msg_len);
-			if (head < 0)
+			if (head < 0) {
+				trace_evt(BCAM_TRACE_VRING_BUSY, bseq, 0);
 				return PRU_RPMSG_NO_BUF_AVAILABLE;
+			}
 
 			/* Setup new bmsg header */
 			bmsg = (struct bcam_pru_msg *)msg->data;
 			bmsg->type = BCAM_PRU_MSG_CAP;
-			bmsg->cap_hdr.frm = cap->seq;
-
-			if (cap->seq == BCAM_FRM_START)
-				bseq = 0; /* Reset frame part seq for each new frame */
+			bmsg->cap_hdr.frm = (bseq == 0 ? BCAM_FRM_START : BCAM_FRM_BODY);
 			bmsg->cap_hdr.seq = bseq++;
 
 			cached_len = sizeof(bmsg->type) + sizeof(bmsg->cap_hdr);
 		}
 
-		/* Append current frame data */
-		memcpy(msg->data + cached_len, cap->data, cap->len);
-		cached_len += cap->len;
-	}
+		/* Append as much frame data as possible */
+		chunk_len = RPMSG_MESSAGE_SIZE - cached_len;
+		if (chunk_len > len)
+			chunk_len = len;
+		else if (frm == BCAM_FRM_END && chunk_len < len)
+			chunk_len = 0;
+
+		/*
+		 * Keep the start section of a frame fitting in a single message,
+		 * i.e. send the frame end in a separate message.
+		 */
+		if (frm == BCAM_FRM_END && bseq == 1)
+			chunk_len = 0;
+
+		memcpy(msg->data + cached_len, data, chunk_len);
+		cached_len += chunk_len;
+		data += chunk_len;
+		len -= chunk_len;
+
+		/* Send the message when full or when flushing the last one */
+		if (cached_len < RPMSG_MESSAGE_SIZE && flush == 0)
+			continue;
+
+		if (len == 0 && flush == 1) {
+			bmsg = (struct bcam_pru_msg *)msg->data;
+			bmsg->cap_hdr.frm = frm;
+		}
 
-	if (flush == 1 && cached_len > 0) {
 		msg->len = cached_len;
 		msg->dst = dst;
 		msg->src = src;
 		msg->flags = 0;
 		msg->reserved = 0;
+		cached_len = 0;
 
 		/* Add the used buffer */
-		if (pru_virtqueue_add_used_buf(virtqueue, head, msg_len) < 0) {
-			cached_len = 0;
+		if (pru_virtqueue_add_used_buf(virtqueue, head, msg_len) < 0)
 			return PRU_RPMSG_INVALID_HEAD;
-		}
 
 		/* Kick the ARM host */
 		pru_virtqueue_kick(virtqueue);
+	} while (len > 0);
 
-		cached_len = 0;
+	if (flush == 0)
+		return PRU_RPMSG_NO_KICK;
+
+	return PRU_RPMSG_SUCCESS;
+}
+
+/*
+ * Gets the DDR frame ring allocated by the host for the carveout.
+ */
+static void init_frm_ring()
+{
+	uint32_t pa = resourceTable.frm_ring.pa;
+
+	if (pa == 0 || pa == FW_RSC_ADDR_ANY)
+		frm_ring = NULL;
+	else
+		frm_ring = (volatile struct bcam_frm_ring_hdr *)pa;
+}
+
+/*
+ * Selects the DDR frame ring slot to store the next frame, in a round-robin
+ * fashion to preserve the order of the frames.
+ *
+ * Returns 0 on success or -1 if all slots are busy.
+ */
+static int16_t frm_ring_get_slot()
+{
+	uint32_t slot_cnt = frm_ring->slot_cnt;
+	uint8_t i, slot;
+
+	/* Ring disabled or not properly configured by ARM */
+	if (slot_cnt > BCAM_FRM_RING_SLOTS_MAX ||
+	    frm_ring->slot_size < SMEM.cap_config.img_sz)
+		return -1;
+
+	for (i = 0; i < slot_cnt; i++) {
+		slot = (frm_slot_next + i) % slot_cnt;
+
+		if (frm_ring->slot_busy[slot] == 0) {
+			frm_slot = slot;
+			frm_slot_next = slot + 1;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Alternative to rpmsg_send_cap() storing the frame data in the current
+ * DDR frame ring slot. On frame end, the slot is marked busy and the
+ * BCAM_PRU_MSG_FRM_RDY message is sent to ARM.
+ */
+static int16_t frm_ring_send_cap(struct pru_rpmsg_transport *transport,
+				 uint32_t src, uint32_t dst, uint8_t frm,
+				 const uint8_t *data, uint16_t len, uint32_t off)
+{
+	struct bcam_pru_msg *msg = (struct bcam_pru_msg *)arm_send_buf;
+
+	if (frm_slot < 0)
+		return PRU_RPMSG_NO_BUF_AVAILABLE;
+
+	if (frm == BCAM_FRM_INVALID) {
+		frm_slot = -1;
 		return PRU_RPMSG_SUCCESS;
 	}
 
-	return PRU_RPMSG_NO_KICK;
+	memcpy((uint8_t *)frm_ring + BCAM_FRM_RING_HDR_SIZE +
+	       frm_slot * frm_ring->slot_size + off, data, len);
+
+	if (frm != BCAM_FRM_END)
+		return PRU_RPMSG_NO_KICK;
+
+	frm_ring->slot_busy[frm_slot] = 1;
+
+	msg->type = BCAM_PRU_MSG_FRM_RDY;
+	msg->frm_hdr.slot = frm_slot;
+	msg->frm_hdr.seq = frm_seq++;
+	msg->frm_hdr.len = off + len;
+	frm_slot = -1;
+
+	return pru_rpmsg_send(transport, src, dst, arm_send_buf,
+			      sizeof(msg->type) + sizeof(msg->frm_hdr));
+}
+
+/*
+ * Sends frame data to ARM according to the configured transfer mode.
+ * The 'off' argument provides the offset of the data in the frame.
+ *
+ * For the RPMsg transfers, the frame data checksum is updated as the data
+ * is being sent, while the frame end section is completed by the trailer.
+ */
+static int16_t send_cap_data(struct pru_rpmsg_transport *transport,
+			     uint32_t src, uint32_t dst, uint8_t frm,
+			     const uint8_t *data, uint16_t len, uint32_t off)
+{
+	struct bcam_frm_trailer trailer;
+	int16_t ret;
+
+	if (SMEM.cap_config.xfer_mode == BCAM_XFER_DDR)
+		return frm_ring_send_cap(transport, src, dst, frm, data, len, off);
+
+	if (frm == BCAM_FRM_INVALID) {
+		frm_dropped++;
+		return rpmsg_send_cap(transport, src, dst, frm, data, len);
+	}
+
+	if (off == 0)
+		frm_csum = 0;
+	frm_csum = bcam_frm_csum(frm_csum, data, len);
+
+	if (frm != BCAM_FRM_END)
+		return rpmsg_send_cap(transport, src, dst, frm, data, len);
+
+	ret = rpmsg_send_cap(transport, src, dst,
+			     off == 0 ? BCAM_FRM_START : BCAM_FRM_BODY, data, len);
+	if (ret != PRU_RPMSG_NO_KICK)
+		return ret;
+
+	trailer.csum = frm_csum;
+	trailer.frm_seq = frm_seq++;
+	trailer.frm_dropped = frm_dropped;
+	trailer.cap_time = CT_IEP.TMR_CNT - frm_start_time;
+	frm_dropped = 0;
+
+	return rpmsg_send_cap(transport, src, dst, BCAM_FRM_END,
+			      (const uint8_t *)&trailer, sizeof(trailer));
+}
+
+/*
+ * Stores the capture configuration received from ARM in the shared RAM,
+ * precomputing the ROI parameters used while capturing.
+ * Returns 0 on success or -1 if the ROI doesn't fit the image or the pixel
+ * format is not supported.
+ */
+static int16_t set_cap_config(const struct bcam_cap_config *cfg)
+{
+	uint16_t roi_w = (cfg->roi_w != 0 ? cfg->roi_w : cfg->xres);
+	uint16_t roi_h = (cfg->roi_h != 0 ? cfg->roi_h : cfg->yres);
+	uint8_t dec_x = (cfg->dec_x > 1 ? cfg->dec_x : 1);
+	uint8_t dec_y = (cfg->dec_y > 1 ? cfg->dec_y : 1);
+	uint8_t pixel_sz = cfg->bpp / 8;
+	uint8_t out_pixel_sz = BCAM_PIX_FMT_BPP(cfg->pix_fmt) / 8;
+	uint16_t out_w, out_h;
+
+	if ((uint32_t)cfg->roi_x + roi_w > cfg->xres ||
+	    (uint32_t)cfg->roi_y + roi_h > cfg->yres)
+		return -1;
+
+	/* The 8-bit formats are obtained from 16-bit camera pixels */
+	if (cfg->pix_fmt > BCAM_PIX_FMT_RGB332 ||
+	    (cfg->pix_fmt != BCAM_PIX_FMT_RGB565 && cfg->bpp != 16))
+		return -1;
+
+	out_w = BCAM_DEC_LEN(roi_w, dec_x);
+	out_h = BCAM_DEC_LEN(roi_h, dec_y);
+
+	SMEM.cap_config.xres = cfg->xres;
+	SMEM.cap_config.yres = cfg->yres;
+	SMEM.cap_config.bpp = cfg->bpp;
+	SMEM.cap_config.pix_fmt = cfg->pix_fmt;
+	SMEM.cap_config.line_sz = cfg->xres * pixel_sz;
+	SMEM.cap_config.out_line_sz = out_w * out_pixel_sz;
+	SMEM.cap_config.img_sz = (uint32_t)SMEM.cap_config.out_line_sz * out_h;
+	SMEM.cap_config.roi_off = cfg->roi_x * pixel_sz;
+	SMEM.cap_config.roi_step = dec_x * pixel_sz;
+	SMEM.cap_config.roi_y = cfg->roi_y;
+	SMEM.cap_config.dec_y = dec_y;
+	SMEM.cap_config.test_mode = cfg->test_mode;
+	SMEM.cap_config.test_pclk_mhz = cfg->test_pclk_mhz;
+	SMEM.cap_config.xfer_mode = cfg->xfer_mode;
+
+	return 0;
 }
 
 /*
@@ -377,14 +710,16 @@ void main(void)
 	struct bcam_arm_msg *arm_cmd = (struct bcam_arm_msg *)arm_recv_buf;
 	uint16_t arm_cmd_len;
 
+	struct bcam_cap_config *cap_cfg = (struct bcam_cap_config *)arm_cmd->data;
 	struct cap_data capture_buf;
 	uint32_t crt_frame_data_len;
-	uint16_t exp_cap_seq, send_ret;
-	uint8_t crt_bank;
+	uint16_t exp_cap_seq, send_ret, line_len, frm_line, roi_line;
+	uint8_t frm, frm_state, vsync_seen;
 
 	/* Initialization */
 	init_pru_core();
 	init_rpmsg(&transport, 0);
+	init_frm_ring();
 
 	/* Main loop */
 	while (1) {
@@ -409,13 +744,38 @@ void main(void)
 					rpmsg_send_info(&transport, rpmsg_dst, rpmsg_src, arm_cmd);
 					break;
 
+				case BCAM_ARM_MSG_GET_TRACE:
+					rpmsg_send_trace(&transport, rpmsg_dst, rpmsg_src);
+					break;
+
 				case BCAM_ARM_MSG_CAP_SETUP:
-					SMEM.cap_config.xres = ((struct bcam_cap_config *)arm_cmd->data)->xres;
-					SMEM.cap_config.yres = ((struct bcam_cap_config *)arm_cmd->data)->yres;
-					SMEM.cap_config.bpp = ((struct bcam_cap_config *)arm_cmd->data)->bpp;
-					SMEM.cap_config.img_sz = SMEM.cap_config.xres * SMEM.cap_config.yres * SMEM.cap_config.bpp / 8;
-					SMEM.cap_config.test_mode = ((struct bcam_cap_config *)arm_cmd->data)->test_mode;
-					SMEM.cap_config.test_pclk_mhz = ((struct bcam_cap_config *)arm_cmd->data)->test_pclk_mhz;
+					/* PRU0 reads the config while capturing */
+					if (run_state != BCAM_CAP_STOPPED) {
+						rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
+							       BCAM_PRU_LOG_ERROR, "Capture not stopped");
+						break;
+					}
+
+					if (cap_cfg->xres * cap_cfg->bpp / 8 > LINE_BUF_SIZE) {
+						rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
+							       BCAM_PRU_LOG_ERROR, "Unsupported line size");
+						break;
+					}
+
+					if (cap_cfg->xfer_mode == BCAM_XFER_DDR && frm_ring == NULL) {
+						rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
+							       BCAM_PRU_LOG_ERROR, "DDR frame ring not available");
+						break;
+					}
+
+					if (set_cap_config(cap_cfg) != 0) {
+						rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
+							       BCAM_PRU_LOG_ERROR, "Invalid ROI or pixel format");
+						break;
+					}
+
+					frm_seq = 0;
+					frm_dropped = 0;
 
 					rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
 						       BCAM_PRU_LOG_INFO, "Capture configured");
@@ -446,20 +806,7 @@ void main(void)
 		}
 
 		if (run_state == BCAM_CAP_PAUSED) {
-			if (SMEM.cap_config.test_mode == 0) {
-				/* TODO: check VSYNC line */
-				/* VSYNC not yet LOW, process pending ARM commands */
-				continue;
-			} else {
-				/*
-				 * Simulate VSYNC wait according to the OV7670 specs:
-				 * (VSYNC - HREF) delay = 20 * HREF duration
-				 */
-				delay_cycles_var(20 * SMEM.cap_config.xres * (SMEM.cap_config.bpp / 8) *
-						 PRU_CYCLES_PER_USEC / SMEM.cap_config.test_pclk_mhz);
-			}
-
-			/* Resume frame acquisition */
+			/* Start streaming, the frame edges are detected while capturing */
 			if (start_stop_capture(1) != 0) {
 				run_state = BCAM_CAP_STOPPED;
 				rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
@@ -467,114 +814,166 @@ void main(void)
 				continue;
 			}
 
-			crt_frame_data_len = 0;
+			frm_state = FRM_WAIT_START;
+			vsync_seen = 0;
 			exp_cap_seq = 1;
-			crt_bank = 0;
+			frm_line = 0;
+			roi_line = 0;
 		}
 
 		while (run_state == BCAM_CAP_STARTED) {
 			if (timer_expired(PRU0_CAP_TMOUT_USEC) != 0) {
+				trace_evt(BCAM_TRACE_PRU0_TMOUT, exp_cap_seq, 0);
 				start_stop_capture(0);
 
 				/* Discard any cached frame data */
-				capture_buf.seq = BCAM_FRM_INVALID;
-				capture_buf.len = 0;
-				rpmsg_send_cap(&transport, rpmsg_dst, rpmsg_src, &capture_buf, 1);
+				if (frm_state == FRM_RECEIVING)
+					send_cap_data(&transport, rpmsg_dst, rpmsg_src,
+						      BCAM_FRM_INVALID, NULL, 0, 0);
 
 				rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
 					       BCAM_PRU_LOG_ERROR, "Timeout receiving data from PRU0");
 				break;
 			}
 
+			/* Load the line descriptor stored by PRU0 */
+			LOAD_DATA(CAP_DATA_BANK, capture_buf);
+
 			/*
-			 * Load data stored by PRU0 in the current scratch pad bank.
-			 * Note using the switch statement as workaround for:
-			 * "error #664: expected an integer constant"
+			 * Continue to read the scratch pad bank until the expected
+			 * seq. no. is detected or timeout occurs. Meanwhile, keep
+			 * track of VSYNC and process the pending ARM commands.
 			 */
-			switch (crt_bank) {
-			case 0:
-				LOAD_DATA(0, capture_buf);
-				break;
-			case 1:
-				LOAD_DATA(1, capture_buf);
-				break;
-			case 2:
-				LOAD_DATA(2, capture_buf);
-				break;
+			if ((int16_t)(capture_buf.seq - exp_cap_seq) < 0) {
+				if (SMEM.cap_config.test_mode == 0 && READ_PIN(PIN_VSYNC))
+					vsync_seen = 1;
+
+				if (__R31 & HOST_INT)
+					break;
+
+				continue;
 			}
 
 			/*
-			 * Continue to read the current scratch pad bank until
-			 * the expected seq. no. is detected or timeout occurs.
+			 * We missed some previous lines, inform ARM host to discard
+			 * current frame by marking it invalid and resync on the
+			 * next frame start.
 			 */
-			if (capture_buf.seq < exp_cap_seq)
-				continue;
+			if (capture_buf.seq != exp_cap_seq) {
+				trace_evt(BCAM_TRACE_SEQ_GAP, exp_cap_seq, capture_buf.seq);
+
+				if (frm_state == FRM_RECEIVING)
+					send_cap_data(&transport, rpmsg_dst, rpmsg_src,
+						      BCAM_FRM_INVALID, NULL, 0, 0);
+
+				frm_state = FRM_WAIT_START;
+				exp_cap_seq = capture_buf.seq;
+			}
 
 			/*
-			 * We missed some previous frame data, inform ARM host
-			 * to discard current frame by marking it invalid.
+			 * PRU0 failed to capture some lines from the camera module,
+			 * discard current frame and resync on the next frame start.
 			 */
-			if (capture_buf.seq > exp_cap_seq) {
-				start_stop_capture(0);
+			if (capture_buf.flags & (CAP_DATA_F_OVERRUN | CAP_DATA_F_LINE_ERR)) {
+				if (frm_state == FRM_RECEIVING)
+					send_cap_data(&transport, rpmsg_dst, rpmsg_src,
+						      BCAM_FRM_INVALID, NULL, 0, 0);
 
-				/* Discard any cached frame data */
-				capture_buf.seq = BCAM_FRM_INVALID;
-				rpmsg_send_cap(&transport, rpmsg_dst, rpmsg_src, &capture_buf, 1);
+				if (capture_buf.flags & CAP_DATA_F_OVERRUN)
+					trace_evt(BCAM_TRACE_LINE_OVERRUN, capture_buf.seq, 0);
+				else
+					trace_evt(BCAM_TRACE_LINE_ERR, capture_buf.seq, capture_buf.len);
 
-				rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src, BCAM_PRU_LOG_ERROR,
-					       "Unexpected seq from PRU0, discarding frame");
+				frm_state = FRM_WAIT_START;
+			}
 
-				/* Get next frame */
-				run_state = BCAM_CAP_PAUSED;
-				break;
+			/* Prepare for receiving next line */
+			exp_cap_seq++;
+			/* Reset timer */
+			enable_timer();
+
+			/* Drop the line, it cannot be part of a valid frame */
+			if (capture_buf.flags & CAP_DATA_F_LINE_ERR) {
+				vsync_seen = 0;
+				SMEM.line_ack_seq = capture_buf.seq;
+				continue;
 			}
 
-			crt_frame_data_len += capture_buf.len;
+			if ((capture_buf.flags & CAP_DATA_F_FRM_START) || vsync_seen) {
+				vsync_seen = 0;
 
-			if (crt_frame_data_len >= SMEM.cap_config.img_sz) {
-				/* Received enough frame data, mark the FRM_END section */
-				capture_buf.seq = BCAM_FRM_END;
+				if (frm_state == FRM_RECEIVING) {
+					send_cap_data(&transport, rpmsg_dst, rpmsg_src,
+						      BCAM_FRM_INVALID, NULL, 0, 0);
 
-				/* Discard any extra captured data */
-				capture_buf.len -= crt_frame_data_len - SMEM.cap_config.img_sz;
+					trace_evt(BCAM_TRACE_FRM_INCOMPLETE, capture_buf.seq,
+						  crt_frame_data_len);
+				}
 
-				/* Force sending completed frame */
-				if (rpmsg_send_cap(&transport, rpmsg_dst, rpmsg_src, &capture_buf, 1) != PRU_RPMSG_SUCCESS)
-					rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
-						       BCAM_PRU_LOG_ERROR, "Failed to send cap data");
+				crt_frame_data_len = 0;
+				frm_start_time = CT_IEP.TMR_CNT;
+				frm_state = FRM_RECEIVING;
+				frm_line = 0;
+				roi_line = SMEM.cap_config.roi_y;
+
+				/* Skip frame while all DDR frame ring slots are busy */
+				if (SMEM.cap_config.xfer_mode == BCAM_XFER_DDR && frm_ring_get_slot() != 0) {
+					trace_evt(BCAM_TRACE_SLOTS_BUSY, frm_seq, 0);
+					frm_state = FRM_WAIT_START;
+				} else {
+					trace_frm_edge(BCAM_TRACE_FRM_START, frm_seq, 0);
+				}
+			}
 
-				/* Temporarily pause frame acquisition */
-				if (start_stop_capture(0) != 0)
-					rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
-						       BCAM_PRU_LOG_ERROR, "Failed to pause capture");
+			/* Skip the lines outside the ROI or dropped by decimation */
+			if (frm_state == FRM_RECEIVING && frm_line++ != roi_line) {
+				SMEM.line_ack_seq = capture_buf.seq;
+				continue;
+			}
 
-				run_state = BCAM_CAP_PAUSED;
+			if (frm_state != FRM_RECEIVING) {
+				/* Release the line buffer */
+				SMEM.line_ack_seq = capture_buf.seq;
+				continue;
+			}
 
-				if (SMEM.cap_config.test_mode == 0) {
-					/* TODO: Wait for VSYNC turning HIGH */
-					USLEEP(1);
-				}
+			roi_line += SMEM.cap_config.dec_y;
 
-				break;
+			line_len = capture_buf.len;
+			crt_frame_data_len += line_len;
+
+			if (crt_frame_data_len >= SMEM.cap_config.img_sz) {
+				/* Discard any extra captured data */
+				line_len -= crt_frame_data_len - SMEM.cap_config.img_sz;
+				frm = BCAM_FRM_END;
+			} else {
+				frm = (crt_frame_data_len > line_len ? BCAM_FRM_BODY : BCAM_FRM_START);
 			}
 
-			/* Append new frame data to the transmission cache */
-			capture_buf.seq = (exp_cap_seq > 1 ? BCAM_FRM_BODY : BCAM_FRM_START);
-			send_ret = rpmsg_send_cap(&transport, rpmsg_dst, rpmsg_src, &capture_buf, 0);
+			send_ret = send_cap_data(&transport, rpmsg_dst, rpmsg_src, frm,
+						 (const uint8_t *)SMEM.line_buf[capture_buf.buf_idx],
+						 line_len, crt_frame_data_len - capture_buf.len);
+
+			/* Release the line buffer */
+			SMEM.line_ack_seq = capture_buf.seq;
+
+			if (frm == BCAM_FRM_END) {
+				trace_frm_edge(BCAM_TRACE_FRM_END, send_ret, crt_frame_data_len);
+				if (send_ret != PRU_RPMSG_SUCCESS)
+					trace_evt(BCAM_TRACE_SEND_ERR, frm, send_ret);
+
+				/* Wait for the next frame, processing ARM commands meanwhile */
+				frm_state = FRM_WAIT_START;
+				break;
+			}
 
 			if (send_ret != PRU_RPMSG_NO_KICK && send_ret != PRU_RPMSG_SUCCESS) {
+				trace_evt(BCAM_TRACE_SEND_ERR, frm, send_ret);
 				start_stop_capture(0);
 				rpmsg_send_log(&transport, rpmsg_dst, rpmsg_src,
 					       BCAM_PRU_LOG_ERROR, "Failed to send cap data");
 				break;
 			}
-
-			/* Prepare for receiving next data sequence */
-			exp_cap_seq++;
-			/* Move to next scratch bank */
-			NEXT_BANK(crt_bank);
-			/* Reset timer */
-			enable_timer();
 		}
 	}
 }
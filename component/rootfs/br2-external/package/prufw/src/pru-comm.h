@@ -7,8 +7,10 @@
 #ifndef _PRU_COMM_H
 #define _PRU_COMM_H
 
+#include "bcam-rpmsg-api.h"
+
 /* Track firmware changes */
-#define PRU_FW_VERSION			"0.0.7"
+#define PRU_FW_VERSION			"0.6.0"
 
 /* Local address of the PRU shared RAM */
 #define SHARED_MEM_ADDR			0x10000
@@ -31,37 +33,91 @@ enum pru_cmd_id {
 	PRU_CMD_CAP_STOP,		/* PRU0 to stop frame aquisition */
 };
 
+/*
+ * Max size of a line of image data, i.e. VGA RGB565.
+ * Must be a multiple of 4, the line buffers are copied using 32-bit words.
+ */
+#define LINE_BUF_SIZE			(640 * 2)
+
+/* No. of line buffers in the shared RAM */
+#define LINE_BUF_CNT			2
+
+/* No. of events in the trace ring, must be a power of 2 */
+#define TRACE_RING_SIZE			128
+
 /*
  * Layout of the 12 KB PRU shared RAM.
- * Currently used only for sending commands from PRU1 to PRU0.
+ *
+ * Besides the inter-PRU commands, it contains a double buffer of image lines:
+ * PRU0 fills one line buffer while PRU1 sends the content of the other one
+ * to ARM host. PRU1 releases a line buffer by updating line_ack_seq, and PRU0
+ * drops the lines for which no buffer has been released in time.
+ *
+ * The trace ring is written by PRU1 only, the oldest events being overwritten
+ * when full. Keeping it in the shared RAM also allows inspecting the recent
+ * events from ARM via /dev/mem, e.g. after PRU1 got stuck.
  */
 struct shared_mem {
 	volatile struct pru_cmd pru0_cmd; /* Command sent from PRU1 to PRU0 */
 	volatile struct pru_cmd pru1_cmd; /* Command sent from PRU0 to PRU1 */
 
+	/*
+	 * The captured image is the ROI after decimation: PRU0 drops the
+	 * pixels outside the ROI and compacts the line buffer in place,
+	 * converting them to the output pixel format, while PRU1 drops the
+	 * lines.
+	 */
 	volatile struct {
 		uint16_t xres;		/* Image X resolution */
 		uint16_t yres;		/* Image Y resolution */
-		uint8_t bpp;		/* Bits per pixel */
-		uint32_t img_sz;	/* Image size in bytes */
+		uint8_t bpp;		/* Camera bits per pixel */
+		uint8_t pix_fmt;	/* Member of enum bcam_pix_fmt */
+		uint32_t img_sz;	/* Captured image size in bytes */
+		uint16_t line_sz;	/* Camera line size in bytes */
+		uint16_t out_line_sz;	/* Captured line size in bytes */
+		uint16_t roi_off;	/* Offset of the first ROI pixel in the line (bytes) */
+		uint16_t roi_step;	/* Offset between two captured camera pixels (bytes) */
+		uint16_t roi_y;		/* First ROI line */
+		uint8_t dec_y;		/* Vertical decimation, i.e. line step */
 		uint8_t test_mode;	/* Enable test image generation */
 		uint8_t test_pclk_mhz;	/* Test image pixel clock freq (MHz) */
+		uint8_t xfer_mode;	/* Member of enum bcam_xfer_mode */
 	} cap_config;
+
+	volatile uint16_t line_ack_seq;	/* Seq no. of the last line sent by PRU1 */
+
+	/* Image lines captured by PRU0, 32-bit aligned */
+	volatile uint32_t line_buf[LINE_BUF_CNT][LINE_BUF_SIZE / 4];
+
+	volatile uint16_t trace_head;	/* No. of events recorded, wrapping */
+	volatile uint16_t trace_tail;	/* Next event to be sent to ARM */
+	volatile struct bcam_trace_evt trace[TRACE_RING_SIZE];
 };
 
 /* Helper to access PRU shared RAM */
 #define SMEM	(*((volatile struct shared_mem *)SHARED_MEM_ADDR))
 
 /*
- * Data captured from camera module by PRU0 and XFER-ed to PRU1.
+ * Descriptor of a line captured by PRU0 in the shared RAM, XFER-ed to PRU1.
  */
 struct cap_data {
-	uint16_t seq;			/* Sequence no. for error detection */
-	uint8_t len;			/* Data size */
-	uint8_t pad;			/* Padding */
-	uint8_t data[32];		/* Raw image data */
+	uint16_t seq;			/* Line sequence no. for error detection */
+	uint16_t len;			/* Line data size */
+	uint8_t buf_idx;		/* Index of the line buffer in shared RAM */
+	uint8_t flags;			/* CAP_DATA_F_* flags */
+	uint8_t pad[2];			/* Padding */
 };
 
+/* First line of a frame, i.e. following VSYNC */
+#define CAP_DATA_F_FRM_START		(1 << 0)
+/* Line size doesn't match the configured one, e.g. missed PCLK edges */
+#define CAP_DATA_F_LINE_ERR		(1 << 1)
+/* PRU0 exceeded the line cycle budget, at least one line was skipped */
+#define CAP_DATA_F_OVERRUN		(1 << 2)
+
+/* Line buffer used for the given line sequence no. */
+#define LINE_BUF_IDX(seq)		((seq) % LINE_BUF_CNT)
+
 /*
  * Converts scratch pad bank zero-based indexes to device IDs (10 - 12).
  * There are 3 banks, each having 30 x 32-bit registers (R29:0), but only
@@ -80,8 +136,8 @@ struct cap_data {
 #define LOAD_DATA(bank_no, dst_buf)				\
 	__xin(SCRATCH_PAD_BANK_DEV(bank_no), XFER_START_REG_NO, 0, dst_buf)
 
-/* Sets bank_no to next scratch bank */
-#define NEXT_BANK(bank_no)		(bank_no) = (bank_no) == 2 ? 0 : (bank_no) + 1
+/* Scratch pad bank used to XFER the cap_data descriptors */
+#define CAP_DATA_BANK			0
 
 /*
  * PRU sleep helpers.
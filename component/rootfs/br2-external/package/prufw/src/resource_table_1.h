@@ -37,6 +37,7 @@
 #include <stddef.h>
 #include <rsc_types.h>
 #include "pru_virtio_ids.h"
+#include "bcam-rpmsg-api.h"
 
 /*
  * Sizes of the virtqueues (expressed in number of buffers supported,
@@ -59,23 +60,27 @@
 struct my_resource_table {
 	struct resource_table base;
 
-	uint32_t offset[1]; /* Should match 'num' in actual definition */
+	uint32_t offset[2]; /* Should match 'num' in actual definition */
 
 	/* rpmsg vdev entry */
 	struct fw_rsc_vdev rpmsg_vdev;
 	struct fw_rsc_vdev_vring rpmsg_vring0;
 	struct fw_rsc_vdev_vring rpmsg_vring1;
+
+	/* DDR frame ring entry */
+	struct fw_rsc_carveout frm_ring;
 };
 
 #pragma DATA_SECTION(resourceTable, ".resource_table")
 #pragma RETAIN(resourceTable)
 struct my_resource_table resourceTable = {
 	1,	/* Resource table version: only version 1 is supported by the current driver */
-	1,	/* number of entries in the table */
+	2,	/* number of entries in the table */
 	0, 0,	/* reserved, must be zero */
 	/* offsets to entries */
 	{
 		offsetof(struct my_resource_table, rpmsg_vdev),
+		offsetof(struct my_resource_table, frm_ring),
 	},
 
 	/* rpmsg vdev entry */
@@ -106,6 +111,16 @@ struct my_resource_table resourceTable = {
 		0,                      //notifyid, will be populated, can't pass right now
 		0                       //reserved
 	},
+	/* the DDR frame ring */
+	{
+		(uint32_t)TYPE_CARVEOUT,        //type
+		FW_RSC_ADDR_ANY,                //da, will be populated by host
+		FW_RSC_ADDR_ANY,                //pa, will be populated by host
+		BCAM_FRM_RING_SIZE,             //len
+		0,                              //flags
+		0,                              //reserved
+		BCAM_FRM_RING_NAME,             //name
+	},
 };
 
 #endif /* _RSC_TABLE_PRU_H_ */
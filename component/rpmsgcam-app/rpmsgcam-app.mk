@@ -2,11 +2,12 @@ RPMSGCAM_APP_SITE = $(RPMSGCAM_APP_PKGDIR)/src
 RPMSGCAM_APP_SITE_METHOD = local
 
 define RPMSGCAM_APP_BUILD_CMDS
-	$(TARGET_MAKE_ENV) $(MAKE) $(TARGET_CONFIGURE_OPTS) -C $(@D)
+	$(TARGET_MAKE_ENV) $(MAKE) $(TARGET_CONFIGURE_OPTS) HOSTCC="$(HOSTCC)" -C $(@D)
 endef
 
 define RPMSGCAM_APP_INSTALL_CMDS
 	$(INSTALL) -m 0755 -D $(@D)/rpmsgcam-app $(BINARIES_DIR)/usr/bin/rpmsgcam-app
+	$(INSTALL) -m 0755 -D $(@D)/rpmsgcam-bench $(BINARIES_DIR)/usr/bin/rpmsgcam-bench
 endef
 
 $(eval $(generic-component))
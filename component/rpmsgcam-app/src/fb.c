@@ -1,5 +1,5 @@
 /*
- * Utility to display RGB565 image content via Frame Buffer.
+ * Utility to display RGB565 or 8-bit image content via Frame Buffer.
  *
  * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
  */
@@ -7,23 +7,247 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/fb.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include "fb.h"
 #include "log.h"
 
+/* Distance (bytes) to prefetch the source ahead of the NEON copy */
+#define FB_PREFETCH_DIST	256
+
+/*
+ * Image scaler state, built once for the expected source resolution.
+ *
+ * Each destination column (row) is mapped to a pair of adjacent source
+ * columns (rows) and the 8-bit fixed-point weight of the second one.
+ * For nearest neighbour scaling just the closest source column (row) is
+ * stored in the first lookup table.
+ */
+struct fb_scaler {
+	enum fb_scale_mode mode;
+	int src_xres, src_yres;
+	int dst_xres, dst_yres;
+	int dst_xoff, dst_yoff;
+	uint16_t *col_lut[2];
+	uint8_t *col_w;
+	uint16_t *row_lut[2];
+	uint8_t *row_w;
+	uint16_t *vrow;		/* Vertically interpolated source row */
+	uint16_t *drow;		/* Scaled row, copied to the frame buffer */
+	uint16_t *img;		/* Source image expanded to RGB565, if 8-bit */
+};
+
 static struct fb_var_screeninfo vinfo;
+static struct fb_var_screeninfo orig_vinfo;
+static struct fb_fix_screeninfo finfo;
+static struct fb_scaler scaler;
+static enum fb_scale_mode scale_mode;
+static enum fb_pix_fmt pix_fmt;
+static uint16_t pix_lut[256];	/* 8-bit to RGB565 pixel conversion */
 static uint32_t screen_size;
 static int fbfd = -1;
 static char *fbp = 0;
 
 /*
- * Initialize frame buffer.
+ * Page flipping state: the screen buffers are stacked vertically in the
+ * virtual screen and the images are rendered into the back buffer, which
+ * is panned into view once complete.
+ */
+static int buf_cnt = 1;
+static int back_buf;
+static int wait_vsync;
+
+/* Returns the address of the buffer to render into */
+static inline uint8_t *fb_back_buf()
+{
+	return (uint8_t *)fbp + back_buf * screen_size;
+}
+
+/*
+ * Builds the lookup table expanding the 8-bit pixel formats to RGB565,
+ * replicating the most significant bits of each channel.
+ */
+static void fb_build_pix_lut(enum fb_pix_fmt fmt)
+{
+	uint32_t i, r, g, b;
+
+	for (i = 0; i < 256; i++) {
+		if (fmt == FB_PIX_FMT_GRAY8) {
+			r = b = i >> 3;
+			g = i >> 2;
+		} else {
+			r = i >> 5;
+			g = (i >> 2) & 0x07;
+			b = i & 0x03;
+
+			r = (r << 2) | (r >> 1);
+			g = (g << 3) | g;
+			b = (b << 3) | (b << 1) | (b >> 1);
+		}
+
+		pix_lut[i] = (r << 11) | (g << 5) | b;
+	}
+}
+
+/*
+ * Expands a row of len 8-bit pixels to RGB565.
+ */
+static inline void fb_expand_row(uint16_t *dst, const uint8_t *src, int len)
+{
+	int x;
+
+	for (x = 0; x < len; x++)
+		dst[x] = pix_lut[src[x]];
+}
+
+/*
+ * Maps dst_len destination positions to src_len source positions, aligning
+ * the pixel centers.
+ */
+static void fb_build_lut(uint16_t *lut0, uint16_t *lut1, uint8_t *w,
+						 int src_len, int dst_len, enum fb_scale_mode mode)
+{
+	int i, pos, idx;
+
+	for (i = 0; i < dst_len; i++) {
+		/* 8.8 fixed-point: (i + 0.5) * src_len / dst_len - 0.5 */
+		pos = (2 * i + 1) * src_len * 128 / dst_len - 128;
+		if (pos < 0)
+			pos = 0;
+
+		idx = pos >> 8;
+		if (idx >= src_len - 1) {
+			idx = src_len - 1;
+			pos = idx << 8;
+		}
+
+		lut0[i] = idx;
+		lut1[i] = idx + (idx < src_len - 1);
+		w[i] = pos & 0xff;
+
+		if (mode == FB_SCALE_NEAREST && w[i] >= 128)
+			lut0[i] = lut1[i];
+	}
+}
+
+/*
+ * Frees the scaler resources.
+ */
+static void fb_scaler_release()
+{
+	free(scaler.col_lut[0]);
+	free(scaler.col_lut[1]);
+	free(scaler.col_w);
+	free(scaler.row_lut[0]);
+	free(scaler.row_lut[1]);
+	free(scaler.row_w);
+	free(scaler.vrow);
+	free(scaler.drow);
+	free(scaler.img);
+
+	memset(&scaler, 0, sizeof(scaler));
+}
+
+/*
+ * Computes the letterboxed destination area preserving the aspect ratio
+ * and builds the lookup tables for scaling xres x yres images.
+ */
+static int fb_scaler_init(int xres, int yres, enum fb_scale_mode mode)
+{
+	if (mode == FB_SCALE_NONE || xres <= 0 || yres <= 0)
+		return 0;
+
+	scaler.mode = mode;
+	scaler.src_xres = xres;
+	scaler.src_yres = yres;
+
+	if ((uint64_t)vinfo.xres * yres <= (uint64_t)vinfo.yres * xres) {
+		scaler.dst_xres = vinfo.xres;
+		scaler.dst_yres = (uint64_t)yres * vinfo.xres / xres;
+	} else {
+		scaler.dst_xres = (uint64_t)xres * vinfo.yres / yres;
+		scaler.dst_yres = vinfo.yres;
+	}
+
+	scaler.dst_xoff = (vinfo.xres - scaler.dst_xres) / 2;
+	scaler.dst_yoff = (vinfo.yres - scaler.dst_yres) / 2;
+
+	scaler.col_lut[0] = malloc(scaler.dst_xres * sizeof(uint16_t));
+	scaler.col_lut[1] = malloc(scaler.dst_xres * sizeof(uint16_t));
+	scaler.col_w = malloc(scaler.dst_xres);
+	scaler.row_lut[0] = malloc(scaler.dst_yres * sizeof(uint16_t));
+	scaler.row_lut[1] = malloc(scaler.dst_yres * sizeof(uint16_t));
+	scaler.row_w = malloc(scaler.dst_yres);
+	scaler.vrow = malloc(xres * sizeof(uint16_t));
+	scaler.drow = malloc(scaler.dst_xres * sizeof(uint16_t));
+
+	if (pix_fmt != FB_PIX_FMT_RGB565)
+		scaler.img = malloc(xres * yres * sizeof(uint16_t));
+
+	if (scaler.col_lut[0] == NULL || scaler.col_lut[1] == NULL ||
+		scaler.col_w == NULL || scaler.row_lut[0] == NULL ||
+		scaler.row_lut[1] == NULL || scaler.row_w == NULL ||
+		scaler.vrow == NULL || scaler.drow == NULL ||
+		(pix_fmt != FB_PIX_FMT_RGB565 && scaler.img == NULL)) {
+		log_error("Not enough memory for the image scaler");
+		fb_scaler_release();
+		return -1;
+	}
+
+	fb_build_lut(scaler.col_lut[0], scaler.col_lut[1], scaler.col_w,
+				 xres, scaler.dst_xres, mode);
+	fb_build_lut(scaler.row_lut[0], scaler.row_lut[1], scaler.row_w,
+				 yres, scaler.dst_yres, mode);
+
+	log_info("FB scaling %dx%d to %dx%d (%s)", xres, yres,
+			 scaler.dst_xres, scaler.dst_yres,
+			 mode == FB_SCALE_NEAREST ? "nearest" : "bilinear");
+
+	return 0;
+}
+
+/*
+ * Extends the virtual screen to hold cnt screen buffers.
+ * Returns the no. of available screen buffers.
+ */
+static int fb_setup_bufs(int cnt)
+{
+	struct fb_var_screeninfo var = vinfo;
+
+	if (cnt <= 1)
+		return 1;
+
+	var.yres_virtual = vinfo.yres * cnt;
+	var.xoffset = 0;
+	var.yoffset = 0;
+
+	if (ioctl(fbfd, FBIOPUT_VSCREENINFO, &var) < 0 ||
+		ioctl(fbfd, FBIOGET_VSCREENINFO, &var) < 0 ||
+		ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo) < 0 ||
+		var.yres_virtual < vinfo.yres * cnt) {
+		log_warn("FB page flipping with %d buffers not supported", cnt);
+		ioctl(fbfd, FBIOPUT_VSCREENINFO, &orig_vinfo);
+		ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo);
+		return 1;
+	}
+
+	vinfo = var;
+	return cnt;
+}
+
+/*
+ * Initialize frame buffer, including page flipping, and the scaler
+ * for the configured image resolution.
  */
-int fb_init(const char *dev_path)
+int fb_init(const char *dev_path, const struct fb_config *cfg)
 {
 	int ret;
 
@@ -40,50 +264,271 @@ int fb_init(const char *dev_path)
 		goto fail;
 	}
 
-	log_info("FB screen info: %dx%d, %dbpp, xoff=%d, yoff=%d",
+	orig_vinfo = vinfo;
+
+	/* Get fixed screen information, providing the line stride */
+	ret = ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo);
+	if (ret < 0) {
+		log_error("Failed reading fixed FB info: %s", strerror(errno));
+		goto fail;
+	}
+
+	log_info("FB screen info: %dx%d, %dbpp, xoff=%d, yoff=%d, stride=%d",
 			 vinfo.xres, vinfo.yres, vinfo.bits_per_pixel,
-			 vinfo.xoffset, vinfo.yoffset);
+			 vinfo.xoffset, vinfo.yoffset, finfo.line_length);
 
 	if (vinfo.bits_per_pixel != 16) {
-		log_error("Expected 16 bpp, but found: %s", vinfo.bits_per_pixel);
+		log_error("Expected 16 bpp, but found: %d", vinfo.bits_per_pixel);
+		ret = -1;
+		goto fail;
+	}
+
+	if (finfo.line_length < vinfo.xres * 2) {
+		log_error("Invalid FB line length: %d", finfo.line_length);
 		ret = -1;
 		goto fail;
 	}
 
-	/* Compute the screen size (bytes) */
-	screen_size = vinfo.xres * vinfo.yres * vinfo.bits_per_pixel / 8;
+	buf_cnt = fb_setup_bufs(cfg->buf_cnt > FB_BUF_CNT_MAX ? FB_BUF_CNT_MAX : cfg->buf_cnt);
+	back_buf = (buf_cnt > 1 ? 1 : 0);
+	wait_vsync = cfg->wait_vsync;
 
-	/* Map device to memory */
-	fbp = (char *)mmap(0, screen_size, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
+	/* Compute the screen size (bytes), lines might be padded */
+	screen_size = finfo.line_length * vinfo.yres;
+
+	/* Map device to memory, including all screen buffers */
+	fbp = (char *)mmap(0, screen_size * buf_cnt, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
+	if (fbp == MAP_FAILED && buf_cnt > 1) {
+		/* The driver might not allow mapping the extended virtual screen */
+		log_warn("Failed to map %d FB screen buffers: %s", buf_cnt, strerror(errno));
+		ioctl(fbfd, FBIOPUT_VSCREENINFO, &orig_vinfo);
+		ioctl(fbfd, FBIOGET_FSCREENINFO, &finfo);
+		vinfo = orig_vinfo;
+		buf_cnt = 1;
+		back_buf = 0;
+		screen_size = finfo.line_length * vinfo.yres;
+
+		fbp = (char *)mmap(0, screen_size, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, 0);
+	}
 	if (fbp == MAP_FAILED) {
 		log_error("Failed to map FB device to memory: %s", strerror(errno));
 		ret = -1;
-		goto fail;
+		goto fail_restore;
+	}
+
+	log_info("FB using %d screen buffer(s), vsync wait %s",
+			 buf_cnt, wait_vsync ? "enabled" : "disabled");
+
+	pix_fmt = cfg->pix_fmt;
+	if (pix_fmt != FB_PIX_FMT_RGB565)
+		fb_build_pix_lut(pix_fmt);
+
+	scale_mode = cfg->scale_mode;
+	ret = fb_scaler_init(cfg->xres, cfg->yres, scale_mode);
+	if (ret != 0) {
+		munmap(fbp, screen_size * buf_cnt);
+		goto fail_restore;
 	}
 
 	return 0;
 
+fail_restore:
+	if (buf_cnt > 1)
+		ioctl(fbfd, FBIOPUT_VSCREENINFO, &orig_vinfo);
+	buf_cnt = 1;
+
 fail:
 	close(fbfd);
 	fbfd = -1;
 	return ret;
 }
 
+/*
+ * Copies a row of pixels into the frame buffer memory.
+ *
+ * Note ARMv7 provides no non-temporal store hints, but the frame buffer is
+ * usually mapped write-combined, hence the NEON path relies on sequential
+ * 64-byte stores, while prefetching the source to hide the DDR latency.
+ */
+static inline void fb_copy_row(uint8_t *dst, const uint8_t *src, size_t len)
+{
+#ifdef __ARM_NEON
+	uint8x16x4_t data;
+
+	for (; len >= 64; len -= 64) {
+		__builtin_prefetch(src + FB_PREFETCH_DIST);
+		data = vld4q_u8(src);
+		vst4q_u8(dst, data);
+		src += 64;
+		dst += 64;
+	}
+#endif
+
+	memcpy(dst, src, len);
+}
+
+/*
+ * Interpolates the RGB565 channels of two pixels, w is the 8-bit
+ * fixed-point weight of p1.
+ */
+static inline uint16_t fb_lerp565(uint16_t p0, uint16_t p1, uint32_t w)
+{
+	uint32_t r, g, b;
+
+	r = ((p0 >> 11) * (256 - w) + (p1 >> 11) * w) >> 8;
+	g = (((p0 >> 5) & 0x3f) * (256 - w) + ((p1 >> 5) & 0x3f) * w) >> 8;
+	b = ((p0 & 0x1f) * (256 - w) + (p1 & 0x1f) * w) >> 8;
+
+	return (r << 11) | (g << 5) | b;
+}
+
+/*
+ * Interpolates two source rows of len pixels into dst.
+ */
+static void fb_lerp_rows(uint16_t *dst, const uint16_t *r0, const uint16_t *r1,
+						 uint32_t w, int len)
+{
+	int x = 0;
+
+#ifdef __ARM_NEON
+	const uint16x8_t m6 = vdupq_n_u16(0x3f), m5 = vdupq_n_u16(0x1f);
+	const uint16_t w0 = 256 - w, w1 = w;
+	uint16x8_t p0, p1, r, g, b;
+
+	for (; x + 8 <= len; x += 8) {
+		p0 = vld1q_u16(r0 + x);
+		p1 = vld1q_u16(r1 + x);
+
+		/* Max channel value 63, hence 63 * 256 fits in 16 bits */
+		r = vmlaq_n_u16(vmulq_n_u16(vshrq_n_u16(p0, 11), w0), vshrq_n_u16(p1, 11), w1);
+		g = vmlaq_n_u16(vmulq_n_u16(vandq_u16(vshrq_n_u16(p0, 5), m6), w0),
+						vandq_u16(vshrq_n_u16(p1, 5), m6), w1);
+		b = vmlaq_n_u16(vmulq_n_u16(vandq_u16(p0, m5), w0), vandq_u16(p1, m5), w1);
+
+		r = vshlq_n_u16(vshrq_n_u16(r, 8), 11);
+		g = vshlq_n_u16(vshrq_n_u16(g, 8), 5);
+		b = vshrq_n_u16(b, 8);
+
+		vst1q_u16(dst + x, vorrq_u16(vorrq_u16(r, g), b));
+	}
+#endif
+
+	for (; x < len; x++)
+		dst[x] = fb_lerp565(r0[x], r1[x], w);
+}
+
+/*
+ * Scales a source row horizontally into the destination row.
+ */
+static void fb_scale_cols(uint16_t *dst, const uint16_t *src)
+{
+	int x;
+
+	if (scaler.mode == FB_SCALE_NEAREST) {
+		for (x = 0; x < scaler.dst_xres; x++)
+			dst[x] = src[scaler.col_lut[0][x]];
+		return;
+	}
+
+	for (x = 0; x < scaler.dst_xres; x++)
+		dst[x] = fb_lerp565(src[scaler.col_lut[0][x]], src[scaler.col_lut[1][x]],
+							scaler.col_w[x]);
+}
+
+/*
+ * Writes a scaled image into the letterboxed frame buffer area. The scaled
+ * rows are built in RAM and reused while consecutive destination rows map
+ * to the same source rows, i.e. when upscaling.
+ */
+static void fb_write_scaled(const uint16_t *rgb565)
+{
+	const uint16_t *src;
+	int y, y0, w, prev_y0 = -1, prev_w = -1;
+	uint8_t *dst;
+
+	dst = fb_back_buf() + scaler.dst_yoff * finfo.line_length + scaler.dst_xoff * 2;
+
+	for (y = 0; y < scaler.dst_yres; y++) {
+		y0 = scaler.row_lut[0][y];
+		w = (scaler.mode == FB_SCALE_NEAREST ? 0 : scaler.row_w[y]);
+
+		if (y0 != prev_y0 || w != prev_w) {
+			src = rgb565 + y0 * scaler.src_xres;
+
+			if (w != 0) {
+				fb_lerp_rows(scaler.vrow, src,
+							 rgb565 + scaler.row_lut[1][y] * scaler.src_xres,
+							 w, scaler.src_xres);
+				src = scaler.vrow;
+			}
+
+			fb_scale_cols(scaler.drow, src);
+			prev_y0 = y0;
+			prev_w = w;
+		}
+
+		fb_copy_row(dst, (const uint8_t *)scaler.drow, scaler.dst_xres * 2);
+		dst += finfo.line_length;
+	}
+}
+
+/*
+ * Makes the back buffer visible and moves on to the next one, optionally
+ * waiting for the VSYNC to pace the rendering with the LCD refresh.
+ */
+static void fb_flip()
+{
+	uint32_t crtc = 0;
+
+	if (buf_cnt > 1) {
+		vinfo.yoffset = back_buf * vinfo.yres;
+		if (ioctl(fbfd, FBIOPAN_DISPLAY, &vinfo) < 0)
+			log_debug("Failed to pan FB display: %s", strerror(errno));
+
+		back_buf = (back_buf + 1) % buf_cnt;
+	}
+
+	if (wait_vsync != 0 && ioctl(fbfd, FBIO_WAITFORVSYNC, &crtc) < 0)
+		log_debug("Failed to wait for FB vsync: %s", strerror(errno));
+}
+
 /**
- * Write RGB565 pixel data into the frame buffer.
+ * Write pixel data into the frame buffer.
+ * With page flipping enabled, the image is rendered into the back buffer
+ * and displayed once complete.
+ * The image is scaled if its resolution matches the one provided to
+ * fb_init(), otherwise it is just center cropped or padded.
+ * The 8-bit pixel formats are expanded to RGB565 on the fly, or before
+ * scaling the whole image.
  *
- * @rgb565: RGB565 pixel data in BGR (little endian) format
+ * @pixels: Pixel data in the format provided to fb_init(), RGB565 is in
+ *          BGR (little endian) format
  * @xres: Pixel data X resolution
  * @yres: Pixel data Y resolution
  */
-void fb_write(uint16_t *rgb565, int xres, int yres)
+void fb_write(const void *pixels, int xres, int yres)
 {
+	const uint16_t *rgb565 = pixels;
+	const uint8_t *pix8 = pixels;
 	int fb_xoff, fb_yoff, fb_xres, fb_yres;
-	int x, y;
+	uint8_t *dst;
+	int y;
 
 	if (fbfd < 0)
 		return;
 
+	if (scaler.mode != FB_SCALE_NONE && xres == scaler.src_xres &&
+		yres == scaler.src_yres) {
+		if (pix_fmt != FB_PIX_FMT_RGB565) {
+			fb_expand_row(scaler.img, pix8, xres * yres);
+			rgb565 = scaler.img;
+		}
+
+		fb_write_scaled(rgb565);
+		fb_flip();
+		return;
+	}
+
 	fb_xoff = ((int)vinfo.xres - xres) / 2;
 	if (fb_xoff < 0) {
 		fb_xoff = 0;
@@ -100,18 +545,84 @@ void fb_write(uint16_t *rgb565, int xres, int yres)
 		fb_yres = yres;
 	}
 
-	for (y = 0; y < fb_yres; y++)
-		for (x = 0; x < fb_xres; x++)
-			((uint16_t *)(fbp))[(y + fb_yoff) * vinfo.xres
-								+ x + fb_xoff] = rgb565[y * xres + x];
+	dst = fb_back_buf() + fb_yoff * finfo.line_length + fb_xoff * 2;
+
+	for (y = 0; y < fb_yres; y++) {
+		if (pix_fmt != FB_PIX_FMT_RGB565)
+			fb_expand_row((uint16_t *)dst, pix8 + y * xres, fb_xres);
+		else
+			fb_copy_row(dst, (const uint8_t *)(rgb565 + y * xres), fb_xres * 2);
+		dst += finfo.line_length;
+	}
+
+	fb_flip();
+}
+
+/*
+ * Provides the back buffer area where a xres x yres image would be displayed
+ * by fb_write(), allowing the image to be rendered directly, without copying.
+ * Once rendered, the image must be displayed via fb_present().
+ *
+ * Returns the area start address, or NULL if the image requires scaling,
+ * pixel format conversion or doesn't fit the screen.
+ */
+uint8_t *fb_get_target(int xres, int yres, uint32_t *stride)
+{
+	if (fbfd < 0 || xres > (int)vinfo.xres || yres > (int)vinfo.yres ||
+		pix_fmt != FB_PIX_FMT_RGB565)
+		return NULL;
+
+	if (scaler.mode != FB_SCALE_NONE &&
+		(scaler.dst_xres != xres || scaler.dst_yres != yres))
+		return NULL;
+
+	*stride = finfo.line_length;
+
+	return fb_back_buf() + ((vinfo.yres - yres) / 2) * finfo.line_length +
+		   ((vinfo.xres - xres) / 2) * 2;
 }
 
 /*
- * Writes a black frame.
+ * Displays the image rendered in the area provided by fb_get_target().
+ */
+void fb_present()
+{
+	if (fbfd < 0)
+		return;
+
+	fb_flip();
+}
+
+/*
+ * Changes the expected image resolution, i.e. rebuilds the scaler for the
+ * new image size and clears the screen buffers.
+ *
+ * Returns 0 on success or -1 on error, in which case the images are no
+ * longer scaled.
+ */
+int fb_set_src_res(int xres, int yres)
+{
+	int ret;
+
+	if (fbfd < 0)
+		return 0;
+
+	fb_scaler_release();
+	ret = fb_scaler_init(xres, yres, scale_mode);
+	fb_clear();
+
+	return ret;
+}
+
+/*
+ * Writes a black frame in all screen buffers.
  */
 void fb_clear()
 {
-	memset(fbp, 0, screen_size);
+	if (fbfd < 0)
+		return;
+
+	memset(fbp, 0, screen_size * buf_cnt);
 }
 
 /*
@@ -122,7 +633,14 @@ void fb_release()
 	if (fbfd < 0)
 		return;
 
-	munmap(fbp, screen_size);
+	fb_scaler_release();
+	munmap(fbp, screen_size * buf_cnt);
+
+	/* Restore the original virtual screen */
+	if (buf_cnt > 1)
+		ioctl(fbfd, FBIOPUT_VSCREENINFO, &orig_vinfo);
+	buf_cnt = 1;
+
 	close(fbfd);
 	fbfd = -1;
 }
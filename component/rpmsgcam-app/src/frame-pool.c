@@ -0,0 +1,345 @@
+/*
+ * Pool of frames shared by the frame acquisition and its consumers.
+ *
+ * The frames are passed from a single producer (writer) to any number of
+ * subscribers (readers), e.g. the display and the streaming sink, without
+ * copying their content. The latest published frame always replaces the one
+ * not yet taken by a subscriber, hence each subscriber drops frames
+ * independently and a slow one never stalls the writer or the others.
+ *
+ * Each subscriber has its own ready slot, and the writer publishes a frame
+ * by atomically exchanging its index in every slot. The frames are reference
+ * counted, i.e. a published frame is referenced by each subscriber until
+ * either consumed or replaced in its slot, and the writer recycles only the
+ * frames no longer referenced. A subscriber holds at most one frame and may
+ * have another one ready, hence 2 frames per subscriber plus the one being
+ * received are always enough. When the frames are provided by the driver
+ * frame ring, it needs a slot more than the pool frames, since the ring
+ * slots are given back only once the frames are not referenced anymore.
+ *
+ * The frames are given back to the driver only by the writer, once they are
+ * not referenced anymore, which keeps all rpmsg_cam calls on the acquisition
+ * thread.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "frame-pool.h"
+#include "lat-stats.h"
+#include "log.h"
+
+/* Frames needed for the max no. of subscribers */
+#define FRAME_POOL_SIZE_MAX		(1 + 2 * FRAME_POOL_SUBS_MAX)
+
+/* Marks the ready slot frame as not yet taken by the subscriber */
+#define FRAME_POOL_NEW			0x100
+
+/* Time to wait for the subscribers to give back their frames */
+#define FRAME_POOL_DRAIN_USEC	1000
+#define FRAME_POOL_DRAIN_WARN	1000
+#define FRAME_POOL_DRAIN_MAX	5000
+
+struct frame_pool {
+	/* Frames sized according to the negotiated image size */
+	struct rpmsg_cam_frame *buf[FRAME_POOL_SIZE_MAX];
+	int cnt;
+
+	/* No. of subscribers referencing each frame */
+	_Atomic int refs[FRAME_POOL_SIZE_MAX];
+
+	/* Monotonic time (usec) when each frame was published */
+	unsigned long long publish_time[FRAME_POOL_SIZE_MAX];
+
+	/* Image format of the frames */
+	uint32_t xres;
+	uint32_t yres;
+	uint32_t bpp;
+
+	struct frame_pool_sub subs[FRAME_POOL_SUBS_MAX];
+	int sub_cnt;
+};
+
+/*
+ * The pool storing frames received from the camera module.
+ */
+static struct frame_pool frame_pool;
+
+/*
+ * Adds a frame consumer, notified via the eventfd in rdy_fd. Must be called
+ * before frame_pool_alloc().
+ *
+ * Returns the subscriber or NULL on error.
+ */
+struct frame_pool_sub *frame_pool_subscribe(const char *name, unsigned int flags)
+{
+	struct frame_pool_sub *sub;
+
+	if (frame_pool.sub_cnt == FRAME_POOL_SUBS_MAX) {
+		log_error("Too many frame pool subscribers");
+		return NULL;
+	}
+
+	sub = &frame_pool.subs[frame_pool.sub_cnt];
+	memset(sub, 0, sizeof(*sub));
+	sub->name = name;
+	sub->flags = flags;
+	sub->held = -1;
+
+	/*
+	 * Unlike a condition variable, no wakeup is lost, since the counter
+	 * is only cleared by the subscriber before checking its ready slot.
+	 */
+	sub->rdy_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (sub->rdy_fd < 0) {
+		log_error("Failed to create frame ready eventfd: %s", strerror(errno));
+		return NULL;
+	}
+
+	frame_pool.sub_cnt++;
+	return sub;
+}
+
+/*
+ * Allocates the pool frames, sized according to the negotiated image size,
+ * for the current subscribers.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int frame_pool_alloc(rpmsg_cam_handle_t handle, int local_buf, uint32_t xres,
+					 uint32_t yres, uint32_t bpp)
+{
+	int i, slots;
+
+	frame_pool.cnt = 1 + 2 * frame_pool.sub_cnt;
+
+	/* Otherwise the writer might wait forever for a free frame ring slot */
+	slots = rpmsg_cam_get_ring_slots(handle);
+	if (slots > 0 && slots <= frame_pool.cnt) {
+		log_error("Frame ring slots not enough for %d subscribers: %d", frame_pool.sub_cnt, slots);
+		frame_pool.cnt = 0;
+		return -1;
+	}
+
+	frame_pool.xres = xres;
+	frame_pool.yres = yres;
+	frame_pool.bpp = bpp;
+
+	for (i = 0; i < frame_pool.cnt; i++) {
+		frame_pool.buf[i] = rpmsg_cam_alloc_frame(handle, local_buf);
+		if (frame_pool.buf[i] == NULL) {
+			log_fatal("Not enough memory");
+			return -1;
+		}
+
+		/* Prefault the local buffer, avoiding the page faults on the first frames */
+		memset(frame_pool.buf[i]->buf, 0, frame_pool.buf[i]->buf_len);
+		atomic_store(&frame_pool.refs[i], 0);
+	}
+
+	for (i = 0; i < frame_pool.sub_cnt; i++)
+		atomic_store(&frame_pool.subs[i].ready, 0);
+
+	return 0;
+}
+
+/*
+ * Frees the pool frames, while the writer is stopped. Waits for the
+ * subscribers still running to give back the frames being consumed.
+ *
+ * Returns 0 on success or -1 if the frames are still in use after
+ * FRAME_POOL_DRAIN_MAX waits, in which case they are not freed.
+ */
+int frame_pool_free()
+{
+	struct frame_pool_sub *sub;
+	eventfd_t rdy_cnt;
+	int i, idx, busy, waits = 0;
+
+	/* Drop the frames not yet taken */
+	for (i = 0; i < frame_pool.sub_cnt; i++) {
+		sub = &frame_pool.subs[i];
+
+		idx = atomic_exchange(&sub->ready, 0);
+		if (idx & FRAME_POOL_NEW)
+			atomic_fetch_sub(&frame_pool.refs[idx & ~FRAME_POOL_NEW], 1);
+
+		eventfd_read(sub->rdy_fd, &rdy_cnt);
+	}
+
+	do {
+		for (busy = 0, i = 0; i < frame_pool.cnt; i++)
+			busy += atomic_load(&frame_pool.refs[i]) != 0;
+
+		if (busy == 0)
+			break;
+
+		if (++waits == FRAME_POOL_DRAIN_MAX) {
+			log_error("Timeout waiting for %d frames to be consumed", busy);
+			return -1;
+		}
+
+		if (waits == FRAME_POOL_DRAIN_WARN)
+			log_warn("Waiting for %d frames to be consumed", busy);
+		usleep(FRAME_POOL_DRAIN_USEC);
+	} while (1);
+
+	for (i = 0; i < frame_pool.cnt; i++) {
+		rpmsg_cam_free_frame(frame_pool.buf[i]);
+		frame_pool.buf[i] = NULL;
+	}
+
+	frame_pool.cnt = 0;
+	return 0;
+}
+
+/*
+ * Releases the subscribers, once they are stopped.
+ */
+void frame_pool_release()
+{
+	for (int i = 0; i < frame_pool.sub_cnt; i++)
+		close(frame_pool.subs[i].rdy_fd);
+
+	frame_pool.sub_cnt = 0;
+}
+
+/*
+ * Logs the frames consumed and skipped by each subscriber.
+ */
+void frame_pool_log_stats()
+{
+	const struct frame_pool_sub *sub;
+
+	for (int i = 0; i < frame_pool.sub_cnt; i++) {
+		sub = &frame_pool.subs[i];
+		log_info("Frame pool %s stats: taken=%u, dropped=%u",
+				 sub->name, sub->taken, sub->dropped);
+	}
+}
+
+/*
+ * Provides a frame to be filled by the writer, not referenced by any
+ * subscriber, while giving back to the driver all unreferenced frames.
+ *
+ * Returns the frame index, there is always one available.
+ */
+int frame_pool_acquire()
+{
+	int idx = -1;
+
+	for (int i = 0; i < frame_pool.cnt; i++) {
+		/* Subscribers finish consuming data before dropping the reference */
+		if (atomic_load_explicit(&frame_pool.refs[i], memory_order_acquire) != 0)
+			continue;
+
+		rpmsg_cam_put_frame(frame_pool.buf[i]);
+		if (idx < 0)
+			idx = i;
+	}
+
+	return idx;
+}
+
+/*
+ * Publishes a frame filled by the writer to all subscribers, replacing the
+ * ones they have not yet taken, and notifies them.
+ *
+ * Returns the no. of frames not displayed, see FRAME_POOL_SUB_DISPLAY.
+ */
+int frame_pool_publish(int idx)
+{
+	struct frame_pool_sub *sub;
+	int i, old, lost = 0;
+
+	frame_pool.publish_time[idx] = lat_get_time_usec();
+	atomic_store_explicit(&frame_pool.refs[idx], frame_pool.sub_cnt, memory_order_relaxed);
+
+	for (i = 0; i < frame_pool.sub_cnt; i++) {
+		sub = &frame_pool.subs[i];
+
+		/* Finish writing data before publishing the frame */
+		old = atomic_exchange_explicit(&sub->ready, idx | FRAME_POOL_NEW,
+									   memory_order_acq_rel);
+		if ((old & FRAME_POOL_NEW) == 0)
+			continue;
+
+		/* Latest frame wins, drop the reference of the one not taken */
+		old &= ~FRAME_POOL_NEW;
+		atomic_fetch_sub_explicit(&frame_pool.refs[old], 1, memory_order_relaxed);
+		sub->dropped++;
+
+		if ((sub->flags & FRAME_POOL_SUB_DISPLAY) != 0 && !FRAME_IN_FB(frame_pool.buf[old]))
+			lost++;
+	}
+
+	/* Notify the subscribers, once all references are in place */
+	for (i = 0; i < frame_pool.sub_cnt; i++) {
+		if (eventfd_write(frame_pool.subs[i].rdy_fd, 1) != 0)
+			log_debug("Failed to notify frame ready: %s", strerror(errno));
+	}
+
+	return lost;
+}
+
+/*
+ * Takes the latest frame published to the subscriber, which must give it
+ * back via frame_pool_put() once consumed. The subscriber eventfd counter
+ * should be cleared before.
+ *
+ * Returns the frame index or -1 if there is no new frame.
+ */
+int frame_pool_take(struct frame_pool_sub *sub)
+{
+	int idx;
+
+	if ((atomic_load_explicit(&sub->ready, memory_order_relaxed) & FRAME_POOL_NEW) == 0)
+		return -1;
+
+	idx = atomic_exchange_explicit(&sub->ready, 0, memory_order_acq_rel);
+	if ((idx & FRAME_POOL_NEW) == 0)
+		return -1;
+
+	sub->held = idx & ~FRAME_POOL_NEW;
+	sub->taken++;
+
+	return sub->held;
+}
+
+/*
+ * Gives back the frame held by the subscriber, if any.
+ */
+void frame_pool_put(struct frame_pool_sub *sub)
+{
+	if (sub->held < 0)
+		return;
+
+	/* Finish consuming data before giving back the frame */
+	atomic_fetch_sub_explicit(&frame_pool.refs[sub->held], 1, memory_order_release);
+	sub->held = -1;
+}
+
+struct rpmsg_cam_frame *frame_pool_get(int idx)
+{
+	return frame_pool.buf[idx];
+}
+
+unsigned long long frame_pool_get_publish_time(int idx)
+{
+	return frame_pool.publish_time[idx];
+}
+
+/*
+ * Provides the image format of the frames, for the subscribers not having
+ * access to the capture configuration.
+ */
+void frame_pool_get_format(uint32_t *xres, uint32_t *yres, uint32_t *bpp)
+{
+	*xres = frame_pool.xres;
+	*yres = frame_pool.yres;
+	*bpp = frame_pool.bpp;
+}
@@ -0,0 +1,370 @@
+/*
+ * Continuous recording of the captured frames to storage.
+ *
+ * The recorder is a frame pool subscriber, hence the frames are written by a
+ * dedicated thread, while the storage write latency, e.g. of an SD card, only
+ * causes frames to be skipped by the recorder, without feeding back into the
+ * frame acquisition or the display.
+ *
+ * The frames are appended to a preallocated file, in a simple indexed
+ * container, see struct frame_rec_file_hdr. They are copied in a batch buffer
+ * at aligned offsets, which is written at once via O_DIRECT, bypassing the
+ * page cache. The index table and the header are written when the recording
+ * is stopped.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#define _GNU_SOURCE		/* O_DIRECT, fallocate() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "frame-pool.h"
+#include "frame-rec.h"
+#include "lat-stats.h"
+#include "log.h"
+#include "thread-util.h"
+
+/* Min amount of frame data written at once */
+#define FRAME_REC_BATCH_LEN		(1024 * 1024)
+
+/* Max time the recorder thread waits for frames, before checking for stop */
+#define FRAME_REC_POLL_MSEC		100
+
+#define FRAME_REC_ALIGN_UP(len) \
+	(((len) + FRAME_REC_ALIGN - 1) & ~(FRAME_REC_ALIGN - 1))
+
+static struct {
+	int fd;
+	int active;
+	pthread_t thread;
+	_Atomic int stop;
+	struct frame_pool_sub *sub;
+	uint8_t *hdr_buf;					/* Header followed by the index table */
+	uint32_t hdr_len;
+	struct frame_rec_index *index;
+	uint8_t *batch;						/* Frames to be written at once */
+	uint32_t batch_len;
+	uint32_t batch_size;
+	uint32_t batch_frames;
+	uint32_t max_frames;
+	uint32_t max_len;
+	uint32_t frame_cnt;
+	uint64_t file_off;					/* Offset of the batch in the file */
+	int preallocated;
+	unsigned int batches;
+	unsigned long long write_time_max;	/* usec */
+	unsigned int errors;
+} rec = {
+	.fd = -1,
+};
+
+/*
+ * Preallocates the file for all frames, sized as the first one, to avoid
+ * the block allocation overhead and fragmentation while recording.
+ */
+static void frame_rec_preallocate(uint32_t frame_len)
+{
+	off_t len = rec.hdr_len + (off_t)rec.max_frames * FRAME_REC_ALIGN_UP(frame_len);
+
+	rec.preallocated = 1;
+
+	if (fallocate(rec.fd, 0, 0, len) != 0)
+		log_warn("Failed to preallocate frame recording: %s", strerror(errno));
+}
+
+/*
+ * Writes an aligned buffer at the given file offset.
+ * Returns 0 on success or -1 on error.
+ */
+static int frame_rec_write(const uint8_t *buf, uint32_t len, uint64_t off)
+{
+	uint32_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pwrite(rec.fd, buf + done, len - done, off + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		done += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the frames in the batch buffer.
+ * Returns 0 on success or -1 on error.
+ */
+static int frame_rec_flush()
+{
+	unsigned long long start_time, t;
+	int ret;
+
+	if (rec.batch_len == 0)
+		return 0;
+
+	start_time = lat_get_time_usec();
+	ret = frame_rec_write(rec.batch, rec.batch_len, rec.file_off);
+	t = lat_get_time_usec() - start_time;
+
+	if (ret != 0) {
+		rec.errors++;
+		log_error("Failed to write frame recording: %s", strerror(errno));
+
+		/* Drop the frames not written from the index */
+		rec.frame_cnt -= rec.batch_frames;
+		rec.batch_frames = 0;
+		rec.batch_len = 0;
+		return -1;
+	}
+
+	if (t > rec.write_time_max)
+		rec.write_time_max = t;
+
+	rec.batches++;
+	rec.file_off += rec.batch_len;
+	rec.batch_frames = 0;
+	rec.batch_len = 0;
+
+	return 0;
+}
+
+/*
+ * Copies a frame in the batch buffer, with the lines packed, and adds
+ * it to the index table.
+ * Returns the frame size or 0 if the frame does not fit the recorder.
+ */
+static uint32_t frame_rec_add(const struct rpmsg_cam_frame *frame)
+{
+	struct frame_rec_index *e = &rec.index[rec.frame_cnt];
+	uint32_t xres, yres, bpp, line_sz, len, y;
+	uint8_t *dst = rec.batch + rec.batch_len;
+
+	frame_pool_get_format(&xres, &yres, &bpp);
+	line_sz = xres * bpp / 8;
+	len = line_sz * yres;
+
+	if (len > rec.max_len)
+		return 0;
+
+	if (frame->stride == line_sz) {
+		memcpy(dst, frame->pixels, len);
+	} else {
+		for (y = 0; y < yres; y++)
+			memcpy(dst + y * line_sz, frame->pixels + y * frame->stride, line_sz);
+	}
+
+	/* O_DIRECT requires the writes to be aligned */
+	memset(dst + len, 0, FRAME_REC_ALIGN_UP(len) - len);
+
+	e->off = rec.file_off + rec.batch_len;
+	e->ts = frame->recv_end;
+	e->seq = frame->seq;
+	e->len = len;
+	e->xres = xres;
+	e->yres = yres;
+	e->bpp = bpp;
+	e->reserved = 0;
+
+	rec.batch_len += FRAME_REC_ALIGN_UP(len);
+	rec.batch_frames++;
+	rec.frame_cnt++;
+
+	return len;
+}
+
+/*
+ * Recorder thread, appending the latest frame published in the frame pool.
+ */
+static void *frame_rec_run(void *arg)
+{
+	struct pollfd pfd;
+	eventfd_t cnt;
+	uint32_t len;
+	int idx, ret;
+
+	threadutil_apply_sched("rec");
+
+	pfd.fd = rec.sub->rdy_fd;
+	pfd.events = POLLIN;
+
+	while (atomic_load(&rec.stop) == 0) {
+		ret = poll(&pfd, 1, FRAME_REC_POLL_MSEC);
+		if (ret < 0 && errno != EINTR) {
+			log_error("Frame recorder poll error: %s", strerror(errno));
+			break;
+		}
+
+		/* Clear the counter before checking the ready frame */
+		if (ret > 0)
+			eventfd_read(rec.sub->rdy_fd, &cnt);
+
+		idx = frame_pool_take(rec.sub);
+		if (idx < 0)
+			continue;
+
+		len = frame_rec_add(frame_pool_get(idx));
+
+		/* Finish copying data before giving back the frame */
+		frame_pool_put(rec.sub);
+
+		if (len == 0) {
+			log_warn("Frame too large for recording, stopping");
+			break;
+		}
+
+		if (rec.preallocated == 0)
+			frame_rec_preallocate(len);
+
+		/* Make room for another frame, unless the recording is full */
+		if ((rec.batch_len >= FRAME_REC_BATCH_LEN || rec.frame_cnt == rec.max_frames) &&
+			frame_rec_flush() != 0)
+			break;
+
+		if (rec.frame_cnt == rec.max_frames) {
+			log_info("Recorded max allowed no. of frames: %u", rec.max_frames);
+			break;
+		}
+	}
+
+	frame_rec_flush();
+	return NULL;
+}
+
+/*
+ * Opens the recording file, preferably for O_DIRECT writes.
+ * Returns 0 on success or -1 on error.
+ */
+static int frame_rec_open(const char *path)
+{
+	rec.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+	if (rec.fd < 0 && errno == EINVAL) {
+		/* The file system doesn't support O_DIRECT, e.g. tmpfs */
+		log_warn("Direct I/O not available for %s, using the page cache", path);
+		rec.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+
+	if (rec.fd < 0) {
+		log_error("Failed to open frame recording %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Starts recording up to max_frames frames published in the frame pool to
+ * the given file. Must be called before allocating the frame pool.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int frame_rec_init(const char *path, uint32_t max_frames, uint32_t max_frame_len)
+{
+	struct frame_rec_file_hdr *hdr;
+	sigset_t mask, old_mask;
+	int ret;
+
+	rec.max_frames = max_frames;
+	rec.max_len = max_frame_len;
+	rec.hdr_len = FRAME_REC_ALIGN +
+		FRAME_REC_ALIGN_UP(max_frames * sizeof(struct frame_rec_index));
+	rec.batch_size = FRAME_REC_BATCH_LEN + FRAME_REC_ALIGN_UP(max_frame_len);
+	atomic_store(&rec.stop, 0);
+
+	if (posix_memalign((void **)&rec.hdr_buf, FRAME_REC_ALIGN, rec.hdr_len) != 0 ||
+		posix_memalign((void **)&rec.batch, FRAME_REC_ALIGN, rec.batch_size) != 0) {
+		log_error("Not enough memory for the frame recorder");
+		goto err_release;
+	}
+
+	memset(rec.hdr_buf, 0, rec.hdr_len);
+	rec.index = (struct frame_rec_index *)(rec.hdr_buf + FRAME_REC_ALIGN);
+
+	hdr = (struct frame_rec_file_hdr *)rec.hdr_buf;
+	hdr->magic = FRAME_REC_MAGIC;
+	hdr->max_frames = max_frames;
+	hdr->data_off = rec.hdr_len;
+	hdr->start_time = lat_get_time_usec();
+
+	if (frame_rec_open(path) != 0)
+		goto err_release;
+
+	rec.file_off = rec.hdr_len;
+
+	rec.sub = frame_pool_subscribe("recorder", 0);
+	if (rec.sub == NULL)
+		goto err_release;
+
+	/* The recorder must not handle any signals, see the signalfd usage */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	ret = pthread_create(&rec.thread, NULL, frame_rec_run, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0) {
+		log_error("Failed to create frame recorder thread: %s", strerror(ret));
+		goto err_release;
+	}
+
+	log_info("Recording frames to: %s", path);
+
+	rec.active = 1;
+	return 0;
+
+err_release:
+	frame_rec_release();
+	return -1;
+}
+
+/*
+ * Stops the recorder thread, once the pending frames are written, and
+ * completes the recording file with the index table and the header.
+ */
+void frame_rec_release()
+{
+	struct frame_rec_file_hdr *hdr = (struct frame_rec_file_hdr *)rec.hdr_buf;
+
+	if (rec.active != 0) {
+		rec.active = 0;
+		atomic_store(&rec.stop, 1);
+		eventfd_write(rec.sub->rdy_fd, 1);
+		pthread_join(rec.thread, NULL);
+
+		hdr->frame_cnt = rec.frame_cnt;
+		if (frame_rec_write(rec.hdr_buf, rec.hdr_len, 0) != 0) {
+			rec.errors++;
+			log_error("Failed to write frame recording index: %s", strerror(errno));
+		}
+
+		/* Drop the preallocated space not used */
+		if (ftruncate(rec.fd, rec.file_off) != 0)
+			log_warn("Failed to truncate frame recording: %s", strerror(errno));
+
+		log_info("Frame recorder stats: frames=%u, batches=%u, write_max=%lluus, "
+				 "errors=%u", rec.frame_cnt, rec.batches, rec.write_time_max,
+				 rec.errors);
+	}
+
+	if (rec.fd >= 0)
+		close(rec.fd);
+	rec.fd = -1;
+
+	free(rec.hdr_buf);
+	rec.hdr_buf = NULL;
+	free(rec.batch);
+	rec.batch = NULL;
+}
@@ -169,3 +169,47 @@ int i2c_write_read(int fd, unsigned char addr,
 
 	return 0;
 }
+
+/**
+ * Writes a sequence of 8-bit registers of an I2C device.
+ *
+ * Each register write is sent as a separate 2 bytes message, while up to
+ * I2C_RDWR_IOCTL_MAX_MSGS messages are batched in a single I2C_RDWR ioctl,
+ * i.e. the writes are separated by repeated START conditions.
+ *
+ * @fd: I2C file descriptor
+ * @addr: I2C slave address
+ * @regvals: (register address, value) pairs
+ * @cnt: the no. of pairs in @regvals
+ *
+ * Return: 0 on success or -errno on failure
+ */
+int i2c_write_regs8(int fd, unsigned char addr,
+					const unsigned char *regvals, unsigned int cnt)
+{
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	struct i2c_rdwr_ioctl_data msgset = {
+		.msgs = msgs,
+	};
+	unsigned int i;
+
+	while (cnt > 0) {
+		msgset.nmsgs = cnt < I2C_RDWR_IOCTL_MAX_MSGS ? cnt : I2C_RDWR_IOCTL_MAX_MSGS;
+
+		for (i = 0; i < msgset.nmsgs; i++, regvals += 2) {
+			msgs[i].addr = addr;
+			msgs[i].flags = 0;
+			msgs[i].len = 2;
+			msgs[i].buf = (unsigned char *)regvals;
+		}
+
+		if (ioctl(fd, I2C_RDWR, (unsigned long)&msgset) < 0) {
+			log_error("I2C_RDWR ioctl failed: %s", strerror(errno));
+			return -errno;
+		}
+
+		cnt -= msgset.nmsgs;
+	}
+
+	return 0;
+}
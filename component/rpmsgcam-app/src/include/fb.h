@@ -1,5 +1,5 @@
 /*
- * Utility to display RGB565 image content via Frame Buffer.
+ * Utility to display RGB565 or 8-bit image content via Frame Buffer.
  *
  * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
  */
@@ -9,8 +9,44 @@
 
 #include <stdint.h>
 
-int fb_init(const char *dev_path);
-void fb_write(uint16_t *rgb565, int xres, int yres);
+/*
+ * Scaling of the images not matching the screen resolution.
+ */
+enum fb_scale_mode {
+	FB_SCALE_NONE = 0,		/* Center crop or pad */
+	FB_SCALE_NEAREST,		/* Nearest neighbour, letterboxed */
+	FB_SCALE_BILINEAR,		/* Bilinear interpolation, letterboxed */
+};
+
+/*
+ * Source image pixel formats, the 8-bit ones are expanded to RGB565.
+ */
+enum fb_pix_fmt {
+	FB_PIX_FMT_RGB565 = 0,			/* 16-bit RGB565, little endian */
+	FB_PIX_FMT_GRAY8,				/* 8-bit luma */
+	FB_PIX_FMT_RGB332,				/* 8-bit RRRGGGBB */
+};
+
+/* Max no. of screen buffers, i.e. triple buffering */
+#define FB_BUF_CNT_MAX		3
+
+/*
+ * Frame buffer configuration, see fb_init().
+ */
+struct fb_config {
+	int xres;						/* Expected image X resolution */
+	int yres;						/* Expected image Y resolution */
+	enum fb_pix_fmt pix_fmt;		/* Image pixel format */
+	enum fb_scale_mode scale_mode;	/* Image scaling */
+	int buf_cnt;					/* No. of screen buffers (1 - FB_BUF_CNT_MAX) */
+	int wait_vsync;					/* Wait for VSYNC after each page flip */
+};
+
+int fb_init(const char *dev_path, const struct fb_config *cfg);
+void fb_write(const void *pixels, int xres, int yres);
+uint8_t *fb_get_target(int xres, int yres, uint32_t *stride);
+void fb_present();
+int fb_set_src_res(int xres, int yres);
 void fb_clear();
 void fb_release();
 
@@ -0,0 +1,58 @@
+/*
+ * Pool of frames shared by the frame acquisition and its consumers.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#ifndef _FRAME_POOL_H
+#define _FRAME_POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "rpmsg-cam.h"
+
+/* Checks if the frame content has been received directly into the FB */
+#define FRAME_IN_FB(frame) \
+	((frame)->target != NULL && (frame)->pixels == (frame)->target)
+
+/* Max no. of frame consumers */
+#define FRAME_POOL_SUBS_MAX		4
+
+/*
+ * The frames skipped by the subscriber are reported as not displayed by
+ * frame_pool_publish(), unless already rendered in the FB by the writer.
+ */
+#define FRAME_POOL_SUB_DISPLAY	(1 << 0)
+
+/*
+ * Frame consumer, getting the latest published frame via its own
+ * ready slot, independently of the other consumers.
+ */
+struct frame_pool_sub {
+	const char *name;
+	unsigned int flags;					/* FRAME_POOL_SUB_* flags */
+	_Atomic int ready;					/* Ready frame index | FRAME_POOL_NEW */
+	int held;							/* Frame being consumed or -1 */
+	int rdy_fd;							/* Eventfd signalling new frames */
+	unsigned int taken;					/* Frames consumed */
+	unsigned int dropped;				/* Frames skipped, updated by the writer */
+};
+
+struct frame_pool_sub *frame_pool_subscribe(const char *name, unsigned int flags);
+int frame_pool_alloc(rpmsg_cam_handle_t handle, int local_buf, uint32_t xres,
+					 uint32_t yres, uint32_t bpp);
+int frame_pool_free();
+void frame_pool_release();
+void frame_pool_log_stats();
+
+int frame_pool_acquire();
+int frame_pool_publish(int idx);
+int frame_pool_take(struct frame_pool_sub *sub);
+void frame_pool_put(struct frame_pool_sub *sub);
+
+struct rpmsg_cam_frame *frame_pool_get(int idx);
+unsigned long long frame_pool_get_publish_time(int idx);
+void frame_pool_get_format(uint32_t *xres, uint32_t *yres, uint32_t *bpp);
+
+#endif /* _FRAME_POOL_H */
@@ -0,0 +1,45 @@
+/*
+ * Continuous recording of the captured frames to storage.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#ifndef _FRAME_REC_H
+#define _FRAME_REC_H
+
+#include <stdint.h>
+
+#define FRAME_REC_MAGIC		0x31524642	/* "BFR1" */
+
+/* Alignment of the file sections and of the frames, as required by O_DIRECT */
+#define FRAME_REC_ALIGN		4096
+
+/*
+ * File header, padded to FRAME_REC_ALIGN and followed by the frame index
+ * table, sized for max_frames entries, also padded to FRAME_REC_ALIGN.
+ * The frames follow at data_off, each one at an aligned offset.
+ */
+struct frame_rec_file_hdr {
+	uint32_t magic;
+	uint32_t max_frames;				/* Index table size (entries) */
+	uint32_t frame_cnt;					/* Recorded frames */
+	uint32_t data_off;					/* Offset of the first frame */
+	uint64_t start_time;				/* Monotonic time (usec) of the recording start */
+} __attribute__((packed));
+
+/* Frame index table entry */
+struct frame_rec_index {
+	uint64_t off;						/* Frame data offset */
+	uint64_t ts;						/* Monotonic time (usec) of the frame reception */
+	uint32_t seq;						/* Frame sequence */
+	uint32_t len;						/* Frame size (bytes) */
+	uint16_t xres;						/* Image X resolution */
+	uint16_t yres;						/* Image Y resolution */
+	uint16_t bpp;						/* Bits per pixel */
+	uint16_t reserved;
+} __attribute__((packed));
+
+int frame_rec_init(const char *path, uint32_t max_frames, uint32_t max_frame_len);
+void frame_rec_release();
+
+#endif /* _FRAME_REC_H */
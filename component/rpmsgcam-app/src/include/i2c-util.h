@@ -17,4 +17,7 @@ int i2c_write_read(int fd, unsigned char addr,
 				   unsigned char *buf_w, unsigned int len_w,
 				   unsigned char *buf_r, unsigned int len_r);
 
+int i2c_write_regs8(int fd, unsigned char addr,
+					const unsigned char *regvals, unsigned int cnt);
+
 #endif /* _I2C_UTIL_H */
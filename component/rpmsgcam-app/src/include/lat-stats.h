@@ -0,0 +1,34 @@
+/*
+ * Frame pipeline latency statistics.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#ifndef _LAT_STATS_H
+#define _LAT_STATS_H
+
+#include <stdio.h>
+
+/*
+ * Frame pipeline stages, each one accounted in a separate histogram.
+ */
+enum lat_stage {
+	LAT_STAGE_PRU = 0,					/* PRU1 frame start to trailer sent */
+	LAT_STAGE_RECV,						/* First to last frame section received */
+	LAT_STAGE_ENQUEUE,					/* Last section to frame pool publish */
+	LAT_STAGE_WAKEUP,					/* Frame pool publish to display start */
+	LAT_STAGE_RENDER,					/* Display start to FB write done */
+	LAT_STAGE_TOTAL,					/* First section to FB write done */
+	LAT_STAGE_INTERVAL,					/* Between consecutive frames received */
+	LAT_STAGE_MAX,
+};
+
+int lat_stats_init(const char *shm_name);
+void lat_stats_add(enum lat_stage stage, unsigned long long usec);
+void lat_stats_log();
+void lat_stats_write_json(FILE *f);
+int lat_stats_print(const char *shm_name);
+void lat_stats_release();
+unsigned long long lat_get_time_usec();
+
+#endif /* _LAT_STATS_H */
@@ -11,16 +11,34 @@
 
 enum { LOG_FATAL = 0, LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_TRACE };
 
-#define log_fatal(...) log_write(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_write(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_write(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_write(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_write(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_trace(...) log_write(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
+/*
+ * Max log level compiled in, i.e. the call sites of the higher levels are
+ * elided, including the evaluation of their arguments.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL	LOG_TRACE
+#endif
+
+#define LOG_ENABLED(level)	((level) <= LOG_MAX_LEVEL)
+
+#define log_at(level, ...) \
+	do { \
+		if (LOG_ENABLED(level)) \
+			log_write(level, __FILE__, __LINE__, __VA_ARGS__); \
+	} while (0)
+
+#define log_fatal(...) log_at(LOG_FATAL, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN,  __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO,  __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
 
 void log_set_level(int level);
 void log_write(int level, const char *file, int line, const char *fmt, ...);
 int log_hexdump(void const *data, int datalen, int linelen, int chunklen);
 unsigned long long log_get_time_usec();
+int log_start_async();
+void log_stop_async();
 
 #endif /* _LOG_H */
@@ -7,6 +7,16 @@
 #ifndef _OV7670_I2C_H
 #define _OV7670_I2C_H
 
-int ov7670_i2c_setup(const char *dev_path);
+/*
+ * Camera output formats, i.e. 16 bits per pixel.
+ */
+enum ov7670_out_fmt {
+	OV7670_OUT_RGB565 = 0,
+	OV7670_OUT_YUV422,				/* YUYV byte order */
+};
+
+int ov7670_i2c_setup(const char *dev_path, enum ov7670_out_fmt fmt);
+int ov7670_i2c_set_size(const char *dev_path, int xres, int yres,
+						enum ov7670_out_fmt fmt);
 
 #endif /* _OV7670_I2C_H */
@@ -49,6 +49,7 @@
 #define	  COM7_YUV	  0x00	  /* YUV */
 #define	  COM7_BAYER	  0x01	  /* Bayer format */
 #define	  COM7_PBAYER	  0x05	  /* "Processed bayer" */
+#define	  COM7_OUT_MASK	  0x05	  /* Output format bits */
 #define REG_COM8	0x13	/* Control 8 */
 #define   COM8_FASTAEC	  0x80	  /* Enable fast AGC/AEC */
 #define   COM8_AECSTEP	  0x40	  /* Unlimited AEC step size */
@@ -174,6 +175,10 @@ enum ov7670_reglist_ids {
 	OV7670_REGS_FMT_RGB565,
 	OV7670_REGS_FMT_RGB444,
 	OV7670_REGS_FMT_RAW,
+	OV7670_REGS_BCAM_QVGA,
+	OV7670_REGS_SIZE_VGA,
+	OV7670_REGS_SIZE_QVGA,
+	OV7670_REGS_SIZE_QQVGA,
 	OV7670_REGS_MAX,
 };
 
@@ -13,20 +13,95 @@
 
 typedef void *rpmsg_cam_handle_t;
 
+/*
+ * Captured image pixel formats. The 8-bit formats are obtained by PRU from
+ * the 16-bit camera output, i.e. RPMSG_CAM_PIX_FMT_GRAY8 requires the camera
+ * module to be configured for YUV422 output, while the others for RGB565.
+ */
+enum rpmsg_cam_pix_fmt {
+	RPMSG_CAM_PIX_FMT_RGB565 = 0,		/* 16-bit RGB565, little endian */
+	RPMSG_CAM_PIX_FMT_GRAY8,			/* 8-bit luma */
+	RPMSG_CAM_PIX_FMT_RGB332,			/* 8-bit RRRGGGBB */
+};
+
+/*
+ * Region of interest within the camera image, optionally decimated, i.e.
+ * only every dec_x-th pixel and dec_y-th line are kept. The frames contain
+ * just the selected pixels, see rpmsg_cam_get_img_size().
+ */
+struct rpmsg_cam_roi {
+	int x;								/* X offset (pixels) */
+	int y;								/* Y offset (lines) */
+	int width;							/* Width (pixels), 0 for the full image */
+	int height;							/* Height (lines), 0 for the full image */
+	int dec_x;							/* Horizontal decimation, 0 or 1 for none */
+	int dec_y;							/* Vertical decimation, 0 or 1 for none */
+};
+
+/*
+ * Frame integrity policy flags, see rpmsg_cam_set_frame_policy().
+ */
+#define RPMSG_CAM_F_VERIFY_CSUM		(1 << 0)	/* Discard frames with a checksum mismatch */
+#define RPMSG_CAM_F_PATCH_PARTIAL	(1 << 1)	/* Patch missing sections from previous frames */
+
+/*
+ * Note the image content is stored in the local buffer only when the driver
+ * frame ring is not available. Otherwise pixels points to the memory mapped
+ * ring slot, which must be given back via rpmsg_cam_put_frame().
+ *
+ * Without the driver frame ring, the image content can be also stored
+ * directly in a caller provided target, e.g. the frame buffer memory, by
+ * setting target and target_stride before calling rpmsg_cam_get_frame().
+ * In this case pixels points to target.
+ *
+ * Frames should be allocated via rpmsg_cam_alloc_frame(), which sizes the
+ * local buffer according to the negotiated image size.
+ *
+ * The timestamps are provided by rpmsg_cam_get_frame() for the latency
+ * statistics, see lat-stats.h. PRU doesn't report its processing time when
+ * the driver frame ring is used, while both receive times are then set to
+ * the time the frame was dequeued.
+ */
 struct rpmsg_cam_frame {
 	rpmsg_cam_handle_t handle;			/* Link frame to handle */
 	uint32_t seq;						/* Frame sequence */
-	uint8_t pixels[BCAM_FRAME_LEN_MAX];	/* Image content */
+	int slot;							/* Driver frame ring slot or -1 */
+	uint8_t *pixels;					/* Image content */
+	uint32_t stride;					/* Bytes between the lines in pixels */
+	uint8_t *target;					/* Optional image destination */
+	uint32_t target_stride;				/* Bytes between the lines in target */
+	uint32_t patched;					/* Bytes taken from the previous frames */
+	uint32_t pru_dropped;				/* Frames discarded by PRU before this one */
+	uint32_t pru_time;					/* PRU frame processing time (usec) or 0 */
+	unsigned long long recv_start;		/* Monotonic time (usec) of the first section */
+	unsigned long long recv_end;		/* Monotonic time (usec) of the last section */
+	uint32_t buf_len;					/* Local image buffer size */
+	uint8_t buf[];						/* Local image buffer */
 };
 
 rpmsg_cam_handle_t
 rpmsg_cam_init(const char *rpmsg_dev_path, int xres, int yres,
+			   const struct rpmsg_cam_roi *roi, enum rpmsg_cam_pix_fmt pix_fmt,
 			   int test_mode, int test_pclk_mhz);
 
 int rpmsg_cam_start(rpmsg_cam_handle_t handle);
 int rpmsg_cam_stop(rpmsg_cam_handle_t handle);
+int rpmsg_cam_reconfigure(rpmsg_cam_handle_t handle, int xres, int yres,
+						  const struct rpmsg_cam_roi *roi);
+int rpmsg_cam_get_img_size(int xres, int yres, const struct rpmsg_cam_roi *roi,
+						   int *img_xres, int *img_yres);
+int rpmsg_cam_set_frame_policy(rpmsg_cam_handle_t handle, unsigned int flags);
+int rpmsg_cam_record(rpmsg_cam_handle_t handle, const char *rec_path);
 int rpmsg_cam_release(rpmsg_cam_handle_t handle);
+struct rpmsg_cam_frame *rpmsg_cam_alloc_frame(rpmsg_cam_handle_t handle, int local_buf);
+void rpmsg_cam_free_frame(struct rpmsg_cam_frame *frame);
 int rpmsg_cam_get_frame(struct rpmsg_cam_frame* frame);
+int rpmsg_cam_put_frame(struct rpmsg_cam_frame* frame);
+int rpmsg_cam_get_poll_fd(rpmsg_cam_handle_t handle);
+int rpmsg_cam_get_ring_slots(rpmsg_cam_handle_t handle);
+int rpmsg_cam_has_pending_msgs(rpmsg_cam_handle_t handle);
+int rpmsg_cam_get_trace(rpmsg_cam_handle_t handle);
+int rpmsg_cam_log_stats(rpmsg_cam_handle_t handle);
 int rpmsg_cam_dump_frame(const struct rpmsg_cam_frame *frame, const char *file_path);
 
 #endif /* _RPMSG_CAM_H */
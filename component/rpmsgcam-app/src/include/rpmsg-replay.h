@@ -0,0 +1,48 @@
+/*
+ * Recording and replay of the RPMsg messages received from PRU.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#ifndef _RPMSG_REPLAY_H
+#define _RPMSG_REPLAY_H
+
+#include <stdint.h>
+
+#include "bcam-rpmsg-api.h"
+
+#define RPMSG_REC_MAGIC		0x31524342	/* "BCR1" */
+
+/*
+ * Recording file header, followed by the recorded messages. The capture
+ * configuration is the one in effect when the recording was started.
+ */
+struct rpmsg_rec_file_hdr {
+	uint32_t magic;
+	uint32_t msg_size;					/* Max message size */
+	struct bcam_cap_config cap_cfg;
+} __attribute__((packed));
+
+/* Header of each recorded message, followed by the message content */
+struct rpmsg_rec_msg_hdr {
+	uint32_t ts;						/* usec since the recording start */
+	uint16_t len;						/* Message size */
+	uint16_t reserved;
+} __attribute__((packed));
+
+struct rpmsg_rec;
+struct rpmsg_replay;
+
+struct rpmsg_rec *rpmsg_rec_open(const char *path, const struct bcam_cap_config *cfg,
+								 uint32_t msg_size);
+int rpmsg_rec_write(struct rpmsg_rec *rec, const uint8_t *msg, uint32_t len,
+					unsigned long long ts);
+int rpmsg_rec_close(struct rpmsg_rec *rec);
+
+void rpmsg_replay_set_params(float speed, int drop_pct, int inval_pct);
+int rpmsg_replay_is_rec(const char *path);
+struct rpmsg_replay *rpmsg_replay_open(const char *path);
+int rpmsg_replay_get_fd(const struct rpmsg_replay *rp);
+void rpmsg_replay_close(struct rpmsg_replay *rp);
+
+#endif /* _RPMSG_REPLAY_H */
@@ -0,0 +1,102 @@
+/*
+ * BeagleCam RPMsg camera driver user space API.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#ifndef _RPMSGCAM_DRV_API_H
+#define _RPMSGCAM_DRV_API_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Max no. of slots in the frame ring */
+#define RPMSGCAM_RING_SLOTS_MAX		16
+
+/*
+ * Use the DDR frame ring allocated for the PRU firmware carveout, i.e. PRU
+ * writes the frames directly in the ring slots. Requires BCAM_XFER_DDR to be
+ * set in the capture configuration, see BCAM_ARM_MSG_CAP_SETUP.
+ */
+#define RPMSGCAM_RING_F_DDR		(1 << 0)
+
+/*
+ * Frame ring configuration, see RPMSGCAM_IOC_SETUP_RING.
+ *
+ * When enabled, the driver reassembles the BCAM_PRU_MSG_CAP messages into
+ * the ring slots, instead of queuing them for read(). The ring memory can be
+ * mapped in user space and the completed frames are obtained via
+ * RPMSGCAM_IOC_DQBUF, while POLLPRI signals their availability.
+ *
+ * If RPMSGCAM_RING_F_DDR is requested but not available, the driver falls
+ * back to reassembling the frames and clears the flag.
+ *
+ * While the capture autostarted by the driver is running, requesting its frame
+ * size keeps the current ring, including the frames already completed, hence
+ * slot_cnt may differ from the requested one.
+ */
+struct rpmsgcam_ring_config {
+	__u32 frame_size;	/* [in] Frame size (bytes), 0 disables the ring */
+	__u32 slot_cnt;		/* [in/out] No. of frame slots */
+	__u32 slot_size;	/* [out] Page aligned offset between slots */
+	__u32 flags;		/* [in/out] RPMSGCAM_RING_F_* flags */
+};
+
+/* Frame slot descriptor, see RPMSGCAM_IOC_DQBUF and RPMSGCAM_IOC_QBUF. */
+struct rpmsgcam_frame_desc {
+	__u32 index;		/* Slot index in the frame ring */
+	__u32 seq;		/* Frame sequence no. */
+	__u32 len;		/* Frame size (bytes) */
+	__u32 flags;		/* Reserved, must be zero */
+};
+
+/*
+ * Batch of messages read from the kernel fifo, see RPMSGCAM_IOC_RECV_MSGS.
+ *
+ * The messages are stored back to back in buf, while their sizes are
+ * provided in the lens array. If copying a message to user space fails, the
+ * messages already stored are still reported, while the faulting one is
+ * dropped.
+ */
+struct rpmsgcam_msg_batch {
+	__u64 buf;		/* [in] User space buffer address */
+	__u64 lens;		/* [in] User space address of a __u32 array */
+	__u32 buf_len;		/* [in] Size of buf (bytes) */
+	__u32 max_cnt;		/* [in] Max no. of messages, i.e. lens array size */
+	__u32 cnt;		/* [out] No. of messages stored in buf */
+	__u32 reserved;		/* Reserved, must be zero */
+};
+
+/*
+ * Driver counters, see RPMSGCAM_IOC_GET_STATS.
+ *
+ * The same counters are also exposed as sysfs attributes of the rpmsgcam
+ * device. The frame counters are only updated while the frame ring is enabled.
+ * The kernel side drops are accounted in fifo_overflows and frames_dropped,
+ * while frames_broken and frames_invalid indicate PRU side issues.
+ */
+struct rpmsgcam_stats {
+	__u32 msgs_received;	/* Messages received from PRU */
+	__u32 fifo_overflows;	/* Messages dropped due to a full kernel fifo */
+	__u32 fifo_msgs;	/* Current kernel fifo size (messages) */
+	__u32 fifo_peak;	/* Max no. of messages queued in the kernel fifo */
+	__u32 frames_completed;	/* Frames reassembled in the frame ring */
+	__u32 frames_dropped;	/* Frames dropped due to a full frame ring */
+	__u32 frames_broken;	/* Frames with missing or unexpected sections */
+	__u32 frames_invalid;	/* Frames marked BCAM_FRM_INVALID by PRU */
+};
+
+#define RPMSGCAM_IOC_MAGIC		'B'
+
+/* Allocates the frame ring; not allowed while the ring is mapped */
+#define RPMSGCAM_IOC_SETUP_RING		_IOWR(RPMSGCAM_IOC_MAGIC, 1, struct rpmsgcam_ring_config)
+/* Gets the oldest completed frame; the slot is owned by the caller */
+#define RPMSGCAM_IOC_DQBUF		_IOR(RPMSGCAM_IOC_MAGIC, 2, struct rpmsgcam_frame_desc)
+/* Gives back a slot obtained via RPMSGCAM_IOC_DQBUF */
+#define RPMSGCAM_IOC_QBUF		_IOW(RPMSGCAM_IOC_MAGIC, 3, struct rpmsgcam_frame_desc)
+/* Waits for at least one message, then drains as many as fit in the batch */
+#define RPMSGCAM_IOC_RECV_MSGS		_IOWR(RPMSGCAM_IOC_MAGIC, 4, struct rpmsgcam_msg_batch)
+/* Gets the driver counters */
+#define RPMSGCAM_IOC_GET_STATS		_IOR(RPMSGCAM_IOC_MAGIC, 5, struct rpmsgcam_stats)
+
+#endif /* _RPMSGCAM_DRV_API_H */
@@ -0,0 +1,30 @@
+/*
+ * Streaming of the captured frames to a file, a pipe or the network.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#ifndef _SINK_H
+#define _SINK_H
+
+#include <stdint.h>
+
+/* RTP payload type of the UDP sink packets, from the dynamic range */
+#define SINK_RTP_PT			96
+
+/*
+ * Header following the RTP header in each UDP sink packet, giving the
+ * offset of the packet data in the frame. The frame end is signalled by
+ * the RTP marker bit. All fields are in network byte order.
+ */
+struct sink_udp_hdr {
+	uint32_t frm_off;					/* Frame data offset (bytes) */
+	uint32_t frm_len;					/* Frame size (bytes) */
+	uint16_t xres;						/* Image X resolution */
+	uint16_t yres;						/* Image Y resolution */
+} __attribute__((packed));
+
+int sink_init(const char *uri, uint32_t max_frame_len);
+void sink_release();
+
+#endif /* _SINK_H */
@@ -0,0 +1,14 @@
+/*
+ * Thread scheduling and memory locking utility.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#ifndef _THREAD_UTIL_H
+#define _THREAD_UTIL_H
+
+int threadutil_parse_sched(const char *spec);
+int threadutil_apply_sched(const char *name);
+int threadutil_lock_memory();
+
+#endif /* _THREAD_UTIL_H */
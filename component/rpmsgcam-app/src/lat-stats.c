@@ -0,0 +1,364 @@
+/*
+ * Frame pipeline latency statistics.
+ *
+ * The latencies of each pipeline stage are accounted in log2 bucketed
+ * histograms, i.e. bucket i holds the samples in the [2^i, 2^(i+1)) usec
+ * range, except the first and the last buckets, which are open-ended.
+ *
+ * The histograms are stored in a POSIX shared memory segment, allowing them
+ * to be inspected while the capture is running, e.g. via "rpmsgcam-app -S",
+ * without the logging overhead. Each histogram has a single writer thread,
+ * hence the updates are lock-free, while the readers get consistent
+ * snapshots via a per histogram sequence counter.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lat-stats.h"
+#include "log.h"
+
+/* Identifies the layout of the shared memory segment */
+#define LAT_STATS_MAGIC			0x4c415431	/* "LAT1" */
+
+/* No. of histogram buckets, the last one starts at ~16s */
+#define LAT_HIST_BUCKETS		24
+
+/* Max attempts to get a consistent histogram snapshot */
+#define LAT_SNAPSHOT_TRIES		1000
+
+/* Max size of a formatted histogram */
+#define LAT_HIST_STR_LEN		512
+
+struct lat_hist_data {
+	uint32_t cnt;
+	uint32_t min;						/* usec */
+	uint32_t max;						/* usec */
+	uint64_t sum;						/* usec */
+	uint64_t sum_sq;					/* usec^2, for the jitter */
+	uint32_t buckets[LAT_HIST_BUCKETS];
+};
+
+struct lat_hist {
+	_Atomic uint32_t seq;				/* Odd while being updated */
+	struct lat_hist_data data;
+};
+
+struct lat_stats {
+	uint32_t magic;
+	uint32_t stage_cnt;
+	struct lat_hist hist[LAT_STAGE_MAX];
+};
+
+static const char *lat_stage_names[LAT_STAGE_MAX] = {
+	[LAT_STAGE_PRU] = "pru",
+	[LAT_STAGE_RECV] = "recv",
+	[LAT_STAGE_ENQUEUE] = "enqueue",
+	[LAT_STAGE_WAKEUP] = "wakeup",
+	[LAT_STAGE_RENDER] = "render",
+	[LAT_STAGE_TOTAL] = "total",
+	[LAT_STAGE_INTERVAL] = "interval",
+};
+
+/* Fallback storage when the shared memory segment is not available */
+static struct lat_stats lat_stats_local;
+
+static struct lat_stats *lat_stats;
+static const char *lat_shm_name;
+
+/*
+ * Returns the monotonic time in usec.
+ */
+unsigned long long lat_get_time_usec()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		return 0;
+
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Creates the shared memory segment storing the histograms, replacing the
+ * one of a previous instance, if any.
+ *
+ * Returns 0 on success or -1 on error, in which case the histograms are still
+ * accounted, but only available via lat_stats_log().
+ */
+int lat_stats_init(const char *shm_name)
+{
+	struct lat_stats *stats;
+	int fd;
+
+	lat_stats = &lat_stats_local;
+	lat_stats->magic = LAT_STATS_MAGIC;
+	lat_stats->stage_cnt = LAT_STAGE_MAX;
+
+	fd = shm_open(shm_name, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		log_warn("Failed to create latency stats shm %s: %s", shm_name, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(*stats)) != 0) {
+		log_warn("Failed to size latency stats shm: %s", strerror(errno));
+		goto err_unlink;
+	}
+
+	stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (stats == MAP_FAILED) {
+		log_warn("Failed to map latency stats shm: %s", strerror(errno));
+		goto err_unlink;
+	}
+
+	close(fd);
+
+	/* The segment is zero filled on truncation */
+	stats->stage_cnt = LAT_STAGE_MAX;
+	stats->magic = LAT_STATS_MAGIC;
+
+	lat_stats = stats;
+	lat_shm_name = shm_name;
+
+	log_debug("Exporting latency stats via shm %s", shm_name);
+	return 0;
+
+err_unlink:
+	close(fd);
+	shm_unlink(shm_name);
+	return -1;
+}
+
+/*
+ * Accounts a latency sample of the given stage. Each stage must be updated
+ * from a single thread.
+ */
+void lat_stats_add(enum lat_stage stage, unsigned long long usec)
+{
+	struct lat_hist *hist;
+	struct lat_hist_data *d;
+	uint32_t seq, val, idx;
+
+	if (lat_stats == NULL || stage >= LAT_STAGE_MAX)
+		return;
+
+	hist = &lat_stats->hist[stage];
+	d = &hist->data;
+	val = (usec > UINT32_MAX ? UINT32_MAX : usec);
+	idx = (val < 2 ? 0 : 31 - __builtin_clz(val));
+	if (idx >= LAT_HIST_BUCKETS)
+		idx = LAT_HIST_BUCKETS - 1;
+
+	/* Make the counter odd before touching the data */
+	seq = atomic_load_explicit(&hist->seq, memory_order_relaxed);
+	atomic_store_explicit(&hist->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	if (d->cnt == 0 || val < d->min)
+		d->min = val;
+	if (val > d->max)
+		d->max = val;
+	d->cnt++;
+	d->sum += val;
+	d->sum_sq += (uint64_t)val * val;
+	d->buckets[idx]++;
+
+	atomic_store_explicit(&hist->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Copies the histogram data, retrying while it is being updated.
+ * Returns 0 on success or -1 if no consistent snapshot could be taken.
+ */
+static int lat_hist_snapshot(const struct lat_hist *hist, struct lat_hist_data *d)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < LAT_SNAPSHOT_TRIES; i++) {
+		seq = atomic_load_explicit(&hist->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		memcpy(d, &hist->data, sizeof(*d));
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&hist->seq, memory_order_relaxed) == seq)
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the upper bound of the bucket reaching the given percentile,
+ * limited to the max sample.
+ */
+static uint32_t lat_hist_percentile(const struct lat_hist_data *d, int pct)
+{
+	uint64_t cnt = 0, lim = ((uint64_t)d->cnt * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < LAT_HIST_BUCKETS - 1; i++) {
+		cnt += d->buckets[i];
+		if (cnt >= lim)
+			break;
+	}
+
+	if (i == LAT_HIST_BUCKETS - 1 || (2U << i) > d->max)
+		return d->max;
+
+	return 2U << i;
+}
+
+/*
+ * Formats the summary and the non-empty buckets of the histogram.
+ */
+static void lat_hist_format(const char *name, const struct lat_hist_data *d,
+							char *buf, size_t len)
+{
+	double avg, var;
+	size_t n;
+	int i;
+
+	if (d->cnt == 0) {
+		snprintf(buf, len, "%-8s cnt=0", name);
+		return;
+	}
+
+	avg = (double)d->sum / d->cnt;
+	var = (double)d->sum_sq / d->cnt - avg * avg;
+
+	n = snprintf(buf, len, "%-8s cnt=%u, avg=%.0fus, min=%uus, max=%uus, jitter=%.0fus, "
+				 "p50<=%uus, p99<=%uus, hist:", name, d->cnt, avg, d->min, d->max,
+				 var > 0 ? sqrt(var) : 0.0, lat_hist_percentile(d, 50),
+				 lat_hist_percentile(d, 99));
+
+	for (i = 0; i < LAT_HIST_BUCKETS && n < len; i++) {
+		if (d->buckets[i] != 0)
+			n += snprintf(buf + n, len - n, " %u:%u", i == 0 ? 0 : 1U << i, d->buckets[i]);
+	}
+}
+
+/*
+ * Logs the histograms of all stages.
+ */
+void lat_stats_log()
+{
+	struct lat_hist_data d;
+	char buf[LAT_HIST_STR_LEN];
+	int i;
+
+	if (lat_stats == NULL)
+		return;
+
+	for (i = 0; i < LAT_STAGE_MAX; i++) {
+		if (lat_hist_snapshot(&lat_stats->hist[i], &d) != 0)
+			continue;
+
+		lat_hist_format(lat_stage_names[i], &d, buf, sizeof(buf));
+		log_info("Latency %s", buf);
+	}
+}
+
+/*
+ * Writes the summary of all stages as a JSON object, for the benchmark
+ * results. The percentiles are the bucket upper bounds, as for the logs.
+ */
+void lat_stats_write_json(FILE *f)
+{
+	struct lat_hist_data d;
+	double avg, var;
+	int i;
+
+	fprintf(f, "{");
+
+	for (i = 0; lat_stats != NULL && i < LAT_STAGE_MAX; i++) {
+		if (lat_hist_snapshot(&lat_stats->hist[i], &d) != 0 || d.cnt == 0)
+			memset(&d, 0, sizeof(d));
+
+		avg = (d.cnt == 0 ? 0.0 : (double)d.sum / d.cnt);
+		var = (d.cnt == 0 ? 0.0 : (double)d.sum_sq / d.cnt - avg * avg);
+
+		fprintf(f, "%s\"%s\":{\"cnt\":%u,\"avg\":%.0f,\"min\":%u,\"max\":%u,"
+				"\"jitter\":%.0f,\"p50\":%u,\"p90\":%u,\"p99\":%u}",
+				i == 0 ? "" : ",", lat_stage_names[i], d.cnt, avg, d.min, d.max,
+				var > 0 ? sqrt(var) : 0.0, lat_hist_percentile(&d, 50),
+				lat_hist_percentile(&d, 90), lat_hist_percentile(&d, 99));
+	}
+
+	fprintf(f, "}");
+}
+
+/*
+ * Prints to stdout the histograms exported by a running instance.
+ * Returns 0 on success or -1 on error.
+ */
+int lat_stats_print(const char *shm_name)
+{
+	const struct lat_stats *stats;
+	struct lat_hist_data d;
+	char buf[LAT_HIST_STR_LEN];
+	int fd, i, ret = 0;
+
+	/* The segment is writable by its owner only */
+	fd = shm_open(shm_name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		log_error("Failed to open latency stats shm %s: %s", shm_name, strerror(errno));
+		return -1;
+	}
+
+	/* The sequence counters are only loaded, hence no write access needed */
+	stats = mmap(NULL, sizeof(*stats), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (stats == MAP_FAILED) {
+		log_error("Failed to map latency stats shm: %s", strerror(errno));
+		return -1;
+	}
+
+	if (stats->magic != LAT_STATS_MAGIC || stats->stage_cnt != LAT_STAGE_MAX) {
+		log_error("Unexpected latency stats layout");
+		ret = -1;
+		goto unmap;
+	}
+
+	for (i = 0; i < LAT_STAGE_MAX; i++) {
+		if (lat_hist_snapshot(&stats->hist[i], &d) != 0) {
+			log_error("Failed to get consistent %s latency stats", lat_stage_names[i]);
+			ret = -1;
+			continue;
+		}
+
+		lat_hist_format(lat_stage_names[i], &d, buf, sizeof(buf));
+		printf("%s\n", buf);
+	}
+
+unmap:
+	munmap((void *)stats, sizeof(*stats));
+	return ret;
+}
+
+/*
+ * Unmaps and removes the shared memory segment, if any.
+ */
+void lat_stats_release()
+{
+	if (lat_stats != NULL && lat_stats != &lat_stats_local) {
+		munmap(lat_stats, sizeof(*lat_stats));
+		shm_unlink(lat_shm_name);
+	}
+
+	lat_stats = NULL;
+}
@@ -1,19 +1,45 @@
 /*
  * Simple console logging utility.
  *
+ * Once log_start_async() is called, the messages are no longer written to
+ * the console by the calling threads, which would otherwise be stalled by
+ * the slow serial console. Instead, each thread formats its messages into a
+ * lock-free single producer ring, drained by a background writer thread
+ * which merges the rings in timestamp order, formats the message prefixes
+ * and writes them in batches. The messages are dropped while the ring of a
+ * thread is full, which is reported by the writer.
+ *
  * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
  */
 
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "log.h"
 
 #define LOG_LINE_MAX_LEN	1024
 
+/* Max length of a message body, excluding the prefix */
+#define LOG_MSG_MAX_LEN		232
+
+/* No. of messages in each thread ring, must be a power of 2 */
+#define LOG_RING_SIZE		128
+
+/* Max time the writer waits before draining the rings */
+#define LOG_FLUSH_MSEC		20
+
+/* Size of the writer output buffer */
+#define LOG_OUT_BUF_LEN		4096
+
 static int log_level = LOG_INFO;
 
 static const char *log_level_names[] = {
@@ -26,6 +52,39 @@ static const char *log_level_colors[] = {
 };
 #endif
 
+struct log_entry {
+	long tv_sec;
+	long tv_usec;
+	const char *file;					/* NULL for raw output, i.e. no prefix */
+	int line;
+	unsigned short level;
+	unsigned short len;
+	char msg[LOG_MSG_MAX_LEN];
+};
+
+/*
+ * Per thread ring, written only by the owner thread and read only by the
+ * writer thread. Rings are never freed, but reused by the threads created
+ * after the owner exited.
+ */
+struct log_ring {
+	struct log_ring *next;
+	_Atomic int owned;
+	_Atomic unsigned int head;			/* Next entry to be written */
+	_Atomic unsigned int tail;			/* Next entry to be read */
+	_Atomic unsigned int dropped;		/* Entries lost due to a full ring */
+	struct log_entry entries[LOG_RING_SIZE];
+};
+
+static _Atomic(struct log_ring *) log_rings;
+static __thread struct log_ring *log_thread_ring;
+static pthread_key_t log_ring_key;
+
+static _Atomic int log_async;
+static _Atomic int log_writer_stop;
+static pthread_t log_writer_thread;
+static int log_kick_fd = -1;
+
 /*
  * Change current log level.
  */
@@ -35,41 +94,328 @@ void log_set_level(int level)
 }
 
 /*
- * Writes a new log message to the console.
+ * Formats the timestamp of an entry, reusing the date and time part
+ * as long as the second doesn't change, if cache is set.
  */
-void log_write(int level, const char *file, int line, const char *fmt, ...)
+static int log_format_time(const struct log_entry *e, char *buf, int cache)
 {
-	char msg[LOG_LINE_MAX_LEN];
-	struct timeval tval;
-	struct tm *tm;
-	va_list args;
-	char *chunk;
+	static char cached_str[24];
+	static long cached_sec = -1;
+	char *str = cached_str, tmp[24];
+	time_t sec = e->tv_sec;
+	struct tm tm;
+
+	if (cache == 0 || sec != cached_sec) {
+		if (cache == 0)
+			str = tmp;
+		else
+			cached_sec = sec;
+
+		localtime_r(&sec, &tm);
+		strftime(str, sizeof(tmp), "%Y-%m-%d %H:%M:%S", &tm);
+	}
 
-	if (level > log_level)
-		return;
+	return sprintf(buf, "%s.%03d", str, (int)(e->tv_usec / 1000));
+}
 
-	gettimeofday(&tval, NULL);
-	tm = localtime(&tval.tv_sec);
+/*
+ * Formats an entry as a console line into buf, which must hold at least
+ * LOG_LINE_MAX_LEN bytes. Returns the line length.
+ */
+static int log_format_entry(const struct log_entry *e, char *buf, int cache)
+{
+	char *chunk = buf;
+
+	if (e->file == NULL)
+		goto body;
 
-	chunk = msg + strftime(msg, 24, "%Y-%m-%d %H:%M:%S", tm);
-	chunk += snprintf(chunk, 5, ".%03d", (int)(tval.tv_usec / 1000));
+	chunk += log_format_time(e, chunk, cache);
 
 #ifdef LOG_USE_COLOR
-	chunk += snprintf(chunk, LOG_LINE_MAX_LEN / 2 - (chunk - msg),
+	chunk += snprintf(chunk, LOG_LINE_MAX_LEN / 2 - (chunk - buf),
 					  " %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
-					  log_level_colors[level], log_level_names[level], file, line);
+					  log_level_colors[e->level], log_level_names[e->level],
+					  e->file, e->line);
 #else
-	chunk += snprintf(chunk, LOG_LINE_MAX_LEN / 2 - (chunk - msg),
-					  "%s %-5s %s:%d: ", log_level_names[level], file, line);
+	chunk += snprintf(chunk, LOG_LINE_MAX_LEN / 2 - (chunk - buf),
+					  " %-5s %s:%d: ", log_level_names[e->level], e->file, e->line);
 #endif
 
+body:
+	memcpy(chunk, e->msg, e->len);
+	chunk += e->len;
+	*chunk++ = '\n';
+
+	return chunk - buf;
+}
+
+/*
+ * Releases the ring of an exiting thread.
+ */
+static void log_release_ring(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+/*
+ * Gets the ring of the calling thread, claiming a released one or
+ * allocating a new one, if needed. Returns NULL on error.
+ */
+static struct log_ring *log_get_ring()
+{
+	struct log_ring *ring = log_thread_ring;
+	int owned;
+
+	if (ring != NULL)
+		return ring;
+
+	for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+		owned = 0;
+		if (atomic_compare_exchange_strong_explicit(&ring->owned, &owned, 1,
+													memory_order_acquire,
+													memory_order_relaxed))
+			break;
+	}
+
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(*ring));
+		if (ring == NULL)
+			return NULL;
+
+		ring->owned = 1;
+		ring->next = atomic_load(&log_rings);
+		while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring))
+			;
+	}
+
+	pthread_setspecific(log_ring_key, ring);
+	log_thread_ring = ring;
+
+	return ring;
+}
+
+/*
+ * Stores a formatted message in the ring of the calling thread, or writes
+ * it right away when the async mode is not enabled.
+ */
+static void log_submit(int level, const char *file, int line, const char *fmt, va_list args)
+{
+	char out[LOG_LINE_MAX_LEN];
+	struct log_entry *e, sync_e;
+	struct log_ring *ring = NULL;
+	struct timeval tval;
+	unsigned int head, used;
+	int len;
+
+	if (atomic_load_explicit(&log_async, memory_order_acquire) != 0)
+		ring = log_get_ring();
+
+	if (ring != NULL) {
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		used = head - atomic_load_explicit(&ring->tail, memory_order_acquire);
+		if (used == LOG_RING_SIZE) {
+			atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+			return;
+		}
+		e = &ring->entries[head & (LOG_RING_SIZE - 1)];
+	} else {
+		e = &sync_e;
+	}
+
+	gettimeofday(&tval, NULL);
+	e->tv_sec = tval.tv_sec;
+	e->tv_usec = tval.tv_usec;
+	e->file = file;
+	e->line = line;
+	e->level = level;
+
+	len = vsnprintf(e->msg, sizeof(e->msg), fmt, args);
+	e->len = (len < 0 ? 0 : (len >= sizeof(e->msg) ? sizeof(e->msg) - 1 : len));
+
+	if (ring == NULL) {
+		fwrite(out, log_format_entry(e, out, 0), 1, stderr);
+		return;
+	}
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	/* Wake up the writer early for errors or when the ring fills up */
+	if (level <= LOG_WARN || used + 1 == LOG_RING_SIZE / 2)
+		eventfd_write(log_kick_fd, 1);
+}
+
+/*
+ * Writes a new log message to the console.
+ */
+void log_write(int level, const char *file, int line, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > log_level)
+		return;
+
 	va_start(args, fmt);
-	chunk += vsnprintf(chunk, LOG_LINE_MAX_LEN - (chunk - msg), fmt, args);
+	log_submit(level, file, line, fmt, args);
 	va_end(args);
+}
 
-	*chunk++ = '\n';
+/*
+ * Writes a message without the log prefix.
+ */
+static void log_raw(int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	log_submit(level, NULL, 0, fmt, args);
+	va_end(args);
+}
+
+/*
+ * Writes dropped messages notices and the pending entries of all rings,
+ * in timestamp order.
+ */
+static void log_drain()
+{
+	char out[LOG_OUT_BUF_LEN + LOG_LINE_MAX_LEN];
+	struct log_ring *ring, *next;
+	struct log_entry *e, *next_e;
+	struct log_entry notice;
+	unsigned int tail, dropped;
+	struct timeval tval;
+	int len = 0;
+
+	for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+		dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+		if (dropped == 0)
+			continue;
+
+		gettimeofday(&tval, NULL);
+		notice.tv_sec = tval.tv_sec;
+		notice.tv_usec = tval.tv_usec;
+		notice.file = __FILE__;
+		notice.line = __LINE__;
+		notice.level = LOG_WARN;
+		notice.len = snprintf(notice.msg, sizeof(notice.msg),
+							  "Dropped %u log messages", dropped);
+		len += log_format_entry(&notice, out + len, 1);
+	}
+
+	while (1) {
+		next = NULL;
+		next_e = NULL;
+
+		for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+			tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+			if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+				continue;
+
+			e = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+			if (next_e == NULL || e->tv_sec < next_e->tv_sec ||
+				(e->tv_sec == next_e->tv_sec && e->tv_usec < next_e->tv_usec)) {
+				next = ring;
+				next_e = e;
+			}
+		}
+
+		if (next == NULL)
+			break;
+
+		len += log_format_entry(next_e, out + len, 1);
+
+		/* Done with the entry, give it back to the producer */
+		tail = atomic_load_explicit(&next->tail, memory_order_relaxed);
+		atomic_store_explicit(&next->tail, tail + 1, memory_order_release);
+
+		if (len >= LOG_OUT_BUF_LEN) {
+			fwrite(out, len, 1, stderr);
+			len = 0;
+		}
+	}
+
+	if (len > 0)
+		fwrite(out, len, 1, stderr);
+}
+
+/*
+ * Console writer thread.
+ */
+static void *log_writer(void *arg)
+{
+	struct pollfd pfd = { .fd = log_kick_fd, .events = POLLIN };
+	eventfd_t cnt;
+
+	while (atomic_load(&log_writer_stop) == 0) {
+		if (poll(&pfd, 1, LOG_FLUSH_MSEC) > 0)
+			eventfd_read(log_kick_fd, &cnt);
+
+		log_drain();
+	}
+
+	log_drain();
+	return NULL;
+}
+
+/*
+ * Enables the asynchronous logging, i.e. starts the console writer thread.
+ * The pending messages are written at exit or via log_stop_async().
+ *
+ * Returns 0 on success or -1 on error, in which case the messages are
+ * still written synchronously.
+ */
+int log_start_async()
+{
+	sigset_t mask, old_mask;
+	int ret;
+
+	if (atomic_load(&log_async) != 0)
+		return 0;
+
+	if (pthread_key_create(&log_ring_key, log_release_ring) != 0)
+		return -1;
+
+	log_kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (log_kick_fd < 0)
+		goto err_key;
+
+	/* The writer must not handle any signals, see the signalfd usage */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	atomic_store(&log_writer_stop, 0);
+	ret = pthread_create(&log_writer_thread, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0)
+		goto err_fd;
+
+	atomic_store_explicit(&log_async, 1, memory_order_release);
+	atexit(log_stop_async);
+
+	return 0;
+
+err_fd:
+	close(log_kick_fd);
+	log_kick_fd = -1;
+err_key:
+	pthread_key_delete(log_ring_key);
+	log_error("Failed to start async logging");
+	return -1;
+}
+
+/*
+ * Writes the pending messages and disables the asynchronous logging.
+ * Note the messages submitted by other threads meanwhile might be lost.
+ */
+void log_stop_async()
+{
+	if (atomic_exchange(&log_async, 0) == 0)
+		return;
 
-	fwrite(msg, chunk - msg, 1, stderr);
+	atomic_store(&log_writer_stop, 1);
+	eventfd_write(log_kick_fd, 1);
+	pthread_join(log_writer_thread, NULL);
 }
 
 /**
@@ -159,7 +505,7 @@ int log_hexdump(void const *data, int datalen, int linelen, int chunklen)
 		}
 
 		*ptr = '\0';
-		fprintf(stderr, "%s\n", buffer);
+		log_raw(LOG_TRACE, "%s", buffer);
 
 		inptr += linelen;
 		remaining -= linelen;
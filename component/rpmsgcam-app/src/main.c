@@ -4,10 +4,41 @@
  *
  * Additionally, signal the receiving of the first frame via GPIO.
  *
- * Using the Linux kernel circular buffer concept [1] to pass frame data from
- * the reader thread to the writer thread responsible for displaying images.
+ * Passing frame data from the acquisition thread to the thread responsible
+ * for displaying images via a lock-free pool of frames, where the latest
+ * received frame always replaces the one not yet displayed. The pool can be
+ * shared with other consumers, e.g. the streaming sink, each one dropping
+ * frames independently. The display thread is woken up via an eventfd,
+ * allowing it to run an epoll based event loop.
  *
- * [1] https://www.kernel.org/doc/Documentation/circular-buffers.txt
+ * Alternatively, for the shortest time to the first frame, a single thread
+ * event loop can be used to receive and display the frames, avoiding the
+ * threads creation and the cross-thread handoff.
+ *
+ * The capture resolution can be switched at runtime via SIGUSR1, between the
+ * main and an alternate resolution, e.g. a low-res preview and high-res stills.
+ *
+ * The errors recorded by PRU1 in its trace ring are retrieved when the
+ * capture is stopped, as well as on SIGUSR2.
+ *
+ * The latency of each pipeline stage is exported via a shared memory segment,
+ * which can be printed by another instance while the capture is running.
+ *
+ * The frames can be also streamed raw to a file, a pipe or a UDP socket,
+ * from a separate thread which just skips frames when the consumer is
+ * slower, without slowing down the display. Similarly, the frames can be
+ * recorded to storage via O_DIRECT, from another thread.
+ *
+ * The received RPMsg messages can be recorded to a file, which can be later
+ * replayed in place of the RPMsg device, e.g. for profiling the frame
+ * pipeline on a host without PRUs.
+ *
+ * The frame processing threads can be configured to run with a realtime
+ * scheduling policy, while the process memory can be locked, avoiding the
+ * page faults on the frame processing path.
+ *
+ * The run results can be appended as a JSON line to a file, for collecting
+ * the benchmark results, see rpmsgcam-bench.
  *
  * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
  */
@@ -17,16 +48,28 @@
 #include <libgen.h>
 #include <pthread.h>
 #include <signal.h>
-#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "fb.h"
+#include "frame-pool.h"
+#include "frame-rec.h"
 #include "gpio-util.h"
+#include "lat-stats.h"
 #include "log.h"
 #include "ov7670-i2c.h"
 #include "rpmsg-cam.h"
+#include "rpmsg-replay.h"
+#include "sink.h"
+#include "thread-util.h"
 
 /* Standard string conversion macros */
 #define STR_HELPER(x)			#x
@@ -42,35 +85,78 @@
 #define DEFAULT_RPMSG_DEV		"/dev/rpmsgcam31"
 #define DEFAULT_GPIOCHIP_DEV	"/dev/gpiochip3"
 #define DEFAULT_GPIOLINE_OFF	31
+#define DEFAULT_STATS_SHM		"/rpmsgcam-stats"
 #define DEFAULT_PCLK_MHZ		1
+#define DEFAULT_SCALE_MODE		1 /* FB_SCALE_NEAREST */
+#define DEFAULT_VIDEO_FRAMES	300
+#define DEFAULT_FB_BUFS			2
 
 /* Program options */
-#define PROG_OPT_STR			"l:x:y:m:c:f:r:g:o:s:tp:h"
+#define PROG_OPT_STR			"l:x:y:X:Y:R:D:F:VPm:c:f:r:g:o:s:tp:z:b:wdeu:v:T:LO:q:J:Sh"
 
 #define PROG_TRIVIAL_USAGE \
-	"[-l LOG_LEVEL] [-x CAM_XRES -y CAM_YRES] [-m MAX_FRAMES]" \
+	"[-l LOG_LEVEL] [-x CAM_XRES -y CAM_YRES] [-X ALT_XRES -Y ALT_YRES]" \
+	"\n                   [-R X,Y,W,H] [-D DEC_X,DEC_Y] [-F PIX_FMT] [-V] [-P]" \
+	"\n                   [-m MAX_FRAMES]" \
 	"\n                   [-c CAM_DEV] [-f FB_DEV] [-r RPMSG_DEV] [-s DUMP_FILE]" \
-	"\n                   [-t [-p PCLK_MHZ]] [-h]" \
+	"\n                   [-t [-p PCLK_MHZ]] [-z SCALE_MODE]" \
+	"\n                   [-b FB_BUFS] [-w] [-d] [-e] [-u SINK]" \
+	"\n                   [-v VIDEO_FILE[,VIDEO_FRAMES]] [-T THREAD=POLICY[:PRIO][@CPU],...] [-L]" \
+	"\n                   [-O REC_FILE]" \
+	"\n                   [-q SPEED[,DROP_PCT[,INVAL_PCT]]] [-J RESULTS_FILE] [-S] [-h]" \
 
 #define PROG_FULL_USAGE "Options:" \
 	"\n -l LOG_LEVEL      Console log level no (0 FATAL, 1 ERROR, 2 WARN, 3 INFO, 4 DEBUG, 5 TRACE)" \
 	"\n -x CAM_XRES       Camera X resolution (default "STR(DEFAULT_CAM_XRES)")" \
 	"\n -y CAM_YRES       Camera Y resolution (default "STR(DEFAULT_CAM_YRES)")" \
+	"\n -X ALT_XRES       Alternate camera X resolution, switched to and back on SIGUSR1" \
+	"\n -Y ALT_YRES       Alternate camera Y resolution, switched to and back on SIGUSR1" \
+	"\n -R X,Y,W,H        Capture only the region of interest at X,Y offset, of WxH size" \
+	"\n -D DEC_X,DEC_Y    Capture only every DEC_X-th pixel of every DEC_Y-th line" \
+	"\n -F PIX_FMT        Captured pixel format (0 RGB565, 1 8-bit grayscale, 2 RGB332, default 0)" \
+	"\n -V                Verify the frame checksums, discarding the corrupted frames" \
+	"\n -P                Patch the missing frame sections from the previous frames, instead of" \
+	"\n                   discarding the partial frames" \
 	"\n -m MAX_FRAMES     Exit app after receiving the indicated no. of frames" \
 	"\n -c CAM_DEV        Camera I2C device path (default "DEFAULT_CAM_DEV")" \
 	"\n -f FB_DEV         LCD display Frame Buffer device path (default "DEFAULT_FB_DEV")" \
-	"\n -r RPMSG_DEV      RPMsg device path (default "DEFAULT_RPMSG_DEV")" \
+	"\n -r RPMSG_DEV      RPMsg device path (default "DEFAULT_RPMSG_DEV"), or a file recorded" \
+	"\n                   via -O to be replayed instead, in which case the camera is not used" \
 	"\n -g GPIOCHIP_DEV   GPIO chip device path (default "DEFAULT_GPIOCHIP_DEV")" \
 	"\n -o GPIOLINE_OFF   GPIO line offset index relative to GPIO chip device (default "STR(DEFAULT_GPIOLINE_OFF)")." \
 	"\n                   The line is used to signal the receiving of the first frame" \
 	"\n -s DUMP_FILE      File path to save the raw content of the first frame" \
 	"\n -t                Enable test mode to let PRU0 generate RGB565 images" \
 	"\n -p PCLK_MHZ       Pixel clock frequency (MHz) for the generated images (default "STR(DEFAULT_PCLK_MHZ)")" \
+	"\n -z SCALE_MODE     Scale images to fit the LCD (0 none, 1 nearest, 2 bilinear, default "STR(DEFAULT_SCALE_MODE)")" \
+	"\n -b FB_BUFS        No. of LCD screen buffers for page flipping, 1 to "STR(FB_BUF_CNT_MAX)" (default "STR(DEFAULT_FB_BUFS)")" \
+	"\n -w                Wait for LCD vsync after displaying each frame" \
+	"\n -d                Receive frames directly into the LCD frame buffer, unless scaling, -u or -v is used" \
+	"\n -e                Use a single thread event loop to receive and display frames" \
+	"\n -u SINK           Stream the frames raw to SINK: - for stdout, udp://HOST:PORT for RTP" \
+	"\n                   packets or a file path, e.g. a named pipe" \
+	"\n -v VIDEO_FILE,... Record the frames to VIDEO_FILE, up to VIDEO_FRAMES (default "STR(DEFAULT_VIDEO_FRAMES)")" \
+	"\n -T THREAD=...     Scheduling policy (other, fifo, rr, batch, idle), priority and CPU of" \
+	"\n                   the acq, disp, sink and rec threads, e.g. acq=fifo:50,disp=fifo:40" \
+	"\n -L                Lock the memory, prefaulting the frame buffers, to avoid page faults" \
+	"\n -O REC_FILE       Record the RPMsg messages received from PRU to REC_FILE" \
+	"\n -q SPEED,...      Replay speed factor (0 for max speed, default 1) and the percentages" \
+	"\n                   of the capture messages to be dropped or marked invalid" \
+	"\n -J RESULTS_FILE   Append the run results (frame rate, errors, CPU usage, latencies)" \
+	"\n                   as a JSON line to RESULTS_FILE at exit" \
+	"\n -S                Print the frame pipeline latency stats of the running instance and exit" \
 
 struct prog_opts {
 	int log_level;
 	int cam_xres;
 	int cam_yres;
+	struct rpmsg_cam_roi roi;
+	enum rpmsg_cam_pix_fmt pix_fmt;
+	unsigned int frm_policy;
+	int img_xres;
+	int img_yres;
+	int alt_xres;
+	int alt_yres;
 	int max_frames;
 	const char *cam_dev;
 	const char *fb_dev;
@@ -80,13 +166,42 @@ struct prog_opts {
 	const char *dump_file;
 	int test_mode;
 	int test_pclk_mhz;
+	int scale_mode;
+	int fb_bufs;
+	int fb_wait_vsync;
+	int fb_direct_req;
+	int fb_direct;
+	int event_loop;
+	const char *sink_uri;
+	const char *video_file;
+	int video_frames;
+	int lock_mem;
+	const char *rec_file;
+	const char *results_file;
+};
+
+/*
+ * Frame buffer and camera module formats for each captured pixel format,
+ * i.e. the grayscale images are obtained from the YUV422 luma.
+ */
+static const struct {
+	enum fb_pix_fmt fb;
+	enum ov7670_out_fmt cam;
+} pix_fmts[] = {
+	[RPMSG_CAM_PIX_FMT_RGB565] = { FB_PIX_FMT_RGB565, OV7670_OUT_RGB565 },
+	[RPMSG_CAM_PIX_FMT_GRAY8] = { FB_PIX_FMT_GRAY8, OV7670_OUT_YUV422 },
+	[RPMSG_CAM_PIX_FMT_RGB332] = { FB_PIX_FMT_RGB332, OV7670_OUT_RGB565 },
 };
 
 /* Frame acquire statistics */
 struct frame_acq_stats {
+	unsigned long long start_time;		/* usec, capture start */
+	unsigned long long start_cpu_time;	/* usec, thread CPU time at capture start */
 	unsigned int total_frames;
 	unsigned int dropped_frames;
 	unsigned int discarded_frames;
+	unsigned int patched_frames;
+	unsigned int pru_dropped_frames;
 	unsigned int rpmsg_errors;
 };
 
@@ -94,43 +209,33 @@ struct frame_acq_stats {
 struct frame_disp_stats {
 	unsigned long long start_time;
 	unsigned long long end_time;
+	unsigned long long start_cpu_time;	/* usec */
 	unsigned int total_frames;
+	unsigned int wakeups;
+	unsigned long long wakeup_lat_sum;	/* usec */
+	unsigned long long wakeup_lat_max;	/* usec */
 };
 
-/* Utility to count elements in the ring buffer. */
-#define CIRC_CNT(head, tail, size) (((head) - (tail)) & ((size) - 1))
 /*
- * Utility to get the available space in the ring buffer.
- * Note there is always one free position as a completely full buffer has
- * head == tail, which is the same as empty.
+ * Run results, accumulated over the capture restarts, e.g. on switching
+ * the resolution. In event loop mode, all CPU time goes to acquisition.
  */
-#define CIRC_SPACE(head, tail, size) CIRC_CNT((tail), ((head) + 1), (size))
-
-/* Size of the frame ring buffer */
-#define FRAME_RING_SIZE		8
+struct run_results {
+	struct frame_acq_stats acq;
+	unsigned int disp_frames;
+	unsigned long long capture_time;	/* usec */
+	unsigned long long acq_cpu_time;	/* usec */
+	unsigned long long disp_cpu_time;	/* usec */
+};
 
-struct ring_buffer {
-	/* Data buffer */
-	struct rpmsg_cam_frame *buf[FRAME_RING_SIZE];
+static struct run_results run_results;
 
-	/* Frame buffer indexes for reader (tail) & writer (head) */
-	_Atomic int reader;
-	_Atomic int writer;
+/* Max time the display event loop waits for events */
+#define DISPLAY_EP_TIMEOUT_MSEC	1000
+#define DISPLAY_EP_MAX_EVENTS	4
 
-	/* Conditional variable to notify reader of new frames */
-	pthread_cond_t frame_rdy;
-	pthread_mutex_t frame_rdy_lock;
-};
-
-/*
- * The ring buffer storing frames received from the camera module.
- */
-static struct ring_buffer frame_ring = {
-	.reader = 0,
-	.writer = 0,
-	.frame_rdy = PTHREAD_COND_INITIALIZER,
-	.frame_rdy_lock = PTHREAD_MUTEX_INITIALIZER,
-};
+/* Max time the single thread event loop waits for RPMsg events */
+#define EVENT_LOOP_TIMEOUT_MSEC	1500
 
 /*
  * Generic structure to store an array of arg pointers.
@@ -142,19 +247,33 @@ struct composite_arg {
 /* Flag for stopping the application gracefully. */
 static volatile sig_atomic_t prog_stopping = 0;
 
+/* Flag for switching to the alternate capture resolution. */
+static volatile sig_atomic_t reconfig_requested = 0;
+
+/* Flag for getting the PRU trace events. */
+static volatile sig_atomic_t trace_requested = 0;
+
+/* Flag for signaling the first frame only once, i.e. not after reconfiguring. */
+static int first_frame_signaled = 0;
+
 /* Utility to programatically stop the application. */
 static void prog_stop()
 {
 	prog_stopping = 1;
 }
 
-/* Handler for SIGINT. */
+/* Handler for SIGINT, SIGUSR1 and SIGUSR2. */
 static void signal_handler(int sig)
 {
-	prog_stop();
+	if (sig == SIGUSR1)
+		reconfig_requested = 1;
+	else if (sig == SIGUSR2)
+		trace_requested = 1;
+	else
+		prog_stop();
 }
 
-/* Setup SIGINT handler. */
+/* Setup SIGINT, SIGUSR1 and SIGUSR2 handlers. */
 static int setup_signal_handler()
 {
 	struct sigaction sa;
@@ -170,12 +289,119 @@ static int setup_signal_handler()
 	}
 
 	ret = sigaction(SIGINT, &sa, NULL);
+	if (ret == 0)
+		ret = sigaction(SIGUSR1, &sa, NULL);
+	if (ret == 0)
+		ret = sigaction(SIGUSR2, &sa, NULL);
 	if (ret != 0)
 		log_error("Failed to setup signal handler: %s", strerror(errno));
 
 	return ret;
 }
 
+/*
+ * Returns the CPU time (usec) consumed by the calling thread.
+ */
+static unsigned long long get_thread_cpu_usec()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Marks the capture start, for accounting the capture time and the CPU time
+ * of the calling thread.
+ */
+static void start_acq_stats(struct frame_acq_stats *stats)
+{
+	stats->start_time = lat_get_time_usec();
+	stats->start_cpu_time = get_thread_cpu_usec();
+}
+
+/*
+ * Adds the stats of a stopped capture to the run results.
+ * Must be called from the thread which started the capture.
+ */
+static void add_acq_run_results(const struct frame_acq_stats *stats)
+{
+	struct run_results *r = &run_results;
+
+	r->acq.total_frames += stats->total_frames;
+	r->acq.dropped_frames += stats->dropped_frames;
+	r->acq.discarded_frames += stats->discarded_frames;
+	r->acq.patched_frames += stats->patched_frames;
+	r->acq.pru_dropped_frames += stats->pru_dropped_frames;
+	r->acq.rpmsg_errors += stats->rpmsg_errors;
+
+	/* The capture has not been started */
+	if (stats->start_time == 0)
+		return;
+
+	r->capture_time += lat_get_time_usec() - stats->start_time;
+	r->acq_cpu_time += get_thread_cpu_usec() - stats->start_cpu_time;
+}
+
+/*
+ * Appends the run results as a single JSON line to the given file.
+ * Returns 0 on success or -1 on error.
+ */
+static int write_run_results(const struct prog_opts *opts, int status, const char *path)
+{
+	const struct run_results *r = &run_results;
+	double secs = r->capture_time / 1000000.0;
+	struct rusage ru;
+	FILE *f;
+
+	f = fopen(path, "a");
+	if (f == NULL) {
+		log_error("Failed to open results file %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		memset(&ru, 0, sizeof(ru));
+
+	fprintf(f, "{\"status\":%d,\"xres\":%d,\"yres\":%d,\"img_xres\":%d,\"img_yres\":%d,"
+			"\"pix_fmt\":%d,\"test_mode\":%d,\"pclk_mhz\":%d,\"frm_policy\":%u,"
+			"\"event_loop\":%d,\"fb\":%d,\"fb_direct\":%d,",
+			status, opts->cam_xres, opts->cam_yres, opts->img_xres, opts->img_yres,
+			opts->pix_fmt, opts->test_mode, opts->test_pclk_mhz, opts->frm_policy,
+			opts->event_loop, opts->fb_dev[0] != '-', opts->fb_direct);
+
+	fprintf(f, "\"capture_us\":%llu,\"fps\":%.2f,\"disp_fps\":%.2f,\"frames\":%u,"
+			"\"displayed\":%u,\"dropped\":%u,\"discarded\":%u,\"patched\":%u,"
+			"\"pru_dropped\":%u,\"rpmsg_errors\":%u,",
+			r->capture_time,
+			secs > 0 ? (r->acq.total_frames - r->acq.discarded_frames) / secs : 0.0,
+			secs > 0 ? r->disp_frames / secs : 0.0,
+			r->acq.total_frames, r->disp_frames, r->acq.dropped_frames,
+			r->acq.discarded_frames, r->acq.patched_frames,
+			r->acq.pru_dropped_frames, r->acq.rpmsg_errors);
+
+	fprintf(f, "\"cpu\":{\"acq_us\":%llu,\"disp_us\":%llu,\"acq_pct\":%.1f,"
+			"\"disp_pct\":%.1f,\"proc_user_us\":%llu,\"proc_sys_us\":%llu},\"lat\":",
+			r->acq_cpu_time, r->disp_cpu_time,
+			secs > 0 ? r->acq_cpu_time / secs / 10000.0 : 0.0,
+			secs > 0 ? r->disp_cpu_time / secs / 10000.0 : 0.0,
+			(unsigned long long)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec,
+			(unsigned long long)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec);
+
+	lat_stats_write_json(f);
+	fprintf(f, "}\n");
+
+	if (fclose(f) != 0) {
+		log_error("Failed to write results file %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	log_info("Appended run results to: %s", path);
+	return 0;
+}
+
 /*
  * Handler for frames_acq_thread cleanup.
  */
@@ -187,24 +413,70 @@ static void acquire_frames_cleanup_handler(void *arg)
 	log_info("Stopping frames acquisition thread");
 
 	rpmsg_cam_stop((rpmsg_cam_handle_t)carg->args[0]);
+	rpmsg_cam_get_trace((rpmsg_cam_handle_t)carg->args[0]);
 
-	log_info("Frame acquire stats: total=%u, dropped=%u, discarded=%u, rpmsgerr=%u",
+	log_info("Frame acquire stats: total=%u, dropped=%u, discarded=%u, patched=%u, "
+			 "prudropped=%u, rpmsgerr=%u",
 			 frame_stats->total_frames, frame_stats->dropped_frames,
-			 frame_stats->discarded_frames, frame_stats->rpmsg_errors);
+			 frame_stats->discarded_frames, frame_stats->patched_frames,
+			 frame_stats->pru_dropped_frames, frame_stats->rpmsg_errors);
+
+	add_acq_run_results(frame_stats);
+	rpmsg_cam_log_stats((rpmsg_cam_handle_t)carg->args[0]);
+}
+
+/*
+ * Accounts the latency stats of a received frame, i.e. the PRU processing,
+ * the frame sections reception and the interval since the previous frame.
+ */
+static void update_acq_lat_stats(const struct rpmsg_cam_frame *frame,
+								 unsigned long long *last_recv_end)
+{
+	if (frame->pru_time != 0)
+		lat_stats_add(LAT_STAGE_PRU, frame->pru_time);
+
+	lat_stats_add(LAT_STAGE_RECV, frame->recv_end - frame->recv_start);
+
+	if (*last_recv_end != 0)
+		lat_stats_add(LAT_STAGE_INTERVAL, frame->recv_end - *last_recv_end);
+	*last_recv_end = frame->recv_end;
 }
 
 /*
- * Receives frames from the camera module into the ring buffer.
+ * Accounts the latency stats of a frame written to the FB, i.e. the
+ * rendering started at disp_start and the whole pipeline traversal.
+ */
+static void update_disp_lat_stats(const struct rpmsg_cam_frame *frame,
+								  unsigned long long disp_start)
+{
+	unsigned long long now = lat_get_time_usec();
+
+	lat_stats_add(LAT_STAGE_RENDER, now - disp_start);
+	lat_stats_add(LAT_STAGE_TOTAL, now - frame->recv_start);
+}
+
+/*
+ * Receives frames from the camera module into the frame pool.
  * It acts as a single producer (writer).
+ *
+ * In direct FB mode, the frames are received in the FB back buffer and
+ * displayed right away, while the frame pool just passes their metadata
+ * to the display thread.
  */
-static void *acquire_frames(void *rpmsg_cam_h)
+static void *acquire_frames(void *arg)
 {
+	struct composite_arg *acq_carg = (struct composite_arg *)arg;
+	rpmsg_cam_handle_t rpmsg_cam_h = (rpmsg_cam_handle_t)acq_carg->args[0];
+	struct prog_opts *opts = (struct prog_opts *)acq_carg->args[1];
 	struct frame_acq_stats frame_stats;
-	struct rpmsg_cam_frame dropped_frame;
+	unsigned long long last_recv_end = 0;
+	struct rpmsg_cam_frame *frame;
 	struct composite_arg carg;
-	int head, tail, ret;
+	int idx, ret, fb_frames = 0;
 
 	log_info("Starting frames acquisition thread");
+	threadutil_apply_sched("acq");
+	memset(&frame_stats, 0, sizeof(frame_stats));
 	carg.args[0] = rpmsg_cam_h;
 	carg.args[1] = &frame_stats;
 	pthread_cleanup_push(acquire_frames_cleanup_handler, &carg);
@@ -215,52 +487,61 @@ static void *acquire_frames(void *rpmsg_cam_h)
 		goto cleanup;
 	}
 
-	memset(&frame_stats, 0, sizeof(frame_stats));
-	dropped_frame.handle = rpmsg_cam_h;
+	start_acq_stats(&frame_stats);
 
 	while (1) {
-		head = frame_ring.writer;
-		tail = atomic_load_explicit(&frame_ring.reader, memory_order_relaxed);
-
-		if (CIRC_SPACE(head, tail, FRAME_RING_SIZE) >= 1) {
-			ret = rpmsg_cam_get_frame(frame_ring.buf[head]);
-			if (ret == -1) {
-				frame_stats.rpmsg_errors++;
-				log_error("Failed to get frame: %d", ret);
-				break;
-			}
+		idx = frame_pool_acquire();
+		frame = frame_pool_get(idx);
 
-			frame_stats.total_frames++;
+		if (trace_requested != 0) {
+			trace_requested = 0;
+			rpmsg_cam_get_trace(rpmsg_cam_h);
+		}
 
-			if (ret < -1) {
-				frame_stats.discarded_frames++;
-				log_debug("Discarding frame due to error: %d", ret);
-				continue; /* Ignore frame & sync errors */
-			}
+		if (opts->fb_direct != 0)
+			frame->target = fb_get_target(opts->img_xres, opts->img_yres,
+										  &frame->target_stride);
 
-			log_info("Received frame: seq=%d", frame_ring.buf[head]->seq);
+		ret = rpmsg_cam_get_frame(frame);
+		if (ret == -1) {
+			frame_stats.rpmsg_errors++;
+			log_error("Failed to get frame: %d", ret);
+			break;
+		}
 
-			/* Finish writing data before incrementing head */
-			atomic_store_explicit(&frame_ring.writer, (head + 1) & (FRAME_RING_SIZE - 1),
-								  memory_order_release);
+		frame_stats.total_frames++;
 
-			/* Notify the consumer thread */
-			ret = pthread_cond_signal(&frame_ring.frame_rdy);
-			if (ret != 0)
-				log_debug("pthread_cond_signal failed: %s", strerror(ret));
+		if (ret < -1) {
+			frame_stats.discarded_frames++;
+			log_debug("Discarding frame due to error: %d", ret);
+			continue; /* Ignore frame & sync errors */
+		}
 
-		} else {
-			log_warn("Ring buffer full, dropping frame");
+		if (frame->patched != 0)
+			frame_stats.patched_frames++;
+		frame_stats.pru_dropped_frames += frame->pru_dropped;
+		update_acq_lat_stats(frame, &last_recv_end);
 
-			ret = rpmsg_cam_get_frame(&dropped_frame);
-			if (ret == -1) {
-				frame_stats.rpmsg_errors++;
-				log_error("Failed to get dropped frame: %d", ret);
-				break;
+		log_info("Received frame: seq=%d", frame->seq);
+
+		if (FRAME_IN_FB(frame)) {
+			fb_present();
+
+			/* The FB buffer is reused for the subsequent frames */
+			if (++fb_frames == 1 && opts->dump_file[0] != 0) {
+				ret = rpmsg_cam_dump_frame(frame, opts->dump_file);
+				if (ret == 0)
+					log_info("Dumped frame to file: %s", opts->dump_file);
 			}
+		}
 
-			frame_stats.total_frames++;
-			frame_stats.dropped_frames++;
+		/* Latest frame wins, replacing the ones not yet consumed */
+		ret = frame_pool_publish(idx);
+		lat_stats_add(LAT_STAGE_ENQUEUE, frame_pool_get_publish_time(idx) - frame->recv_end);
+
+		if (ret != 0) {
+			frame_stats.dropped_frames += ret;
+			log_debug("Overwrote frame not yet displayed by: seq=%d", frame->seq);
 		}
 	}
 
@@ -277,7 +558,10 @@ cleanup:
  */
 static void display_frames_cleanup_handler(void *arg)
 {
-	struct frame_disp_stats *frame_stats = (struct frame_disp_stats *)arg;
+	struct composite_arg *carg = (struct composite_arg *)arg;
+	struct frame_disp_stats *frame_stats = (struct frame_disp_stats *)carg->args[0];
+	int ep_fd = *(int *)carg->args[1];
+	struct frame_pool_sub *sub = (struct frame_pool_sub *)carg->args[2];
 	float fps;
 
 	frame_stats->end_time = log_get_time_usec();
@@ -286,79 +570,208 @@ static void display_frames_cleanup_handler(void *arg)
 
 	log_info("Stopping FB display thread");
 
-	pthread_mutex_unlock(&frame_ring.frame_rdy_lock);
+	close(ep_fd);
+	frame_pool_put(sub);
+
+	run_results.disp_frames += frame_stats->total_frames;
+	run_results.disp_cpu_time += get_thread_cpu_usec() - frame_stats->start_cpu_time;
 
 	log_info("Frame display stats: fps=%.1f, cnt=%d", fps, frame_stats->total_frames);
+	log_info("Frame wakeup latency: avg=%lluus, max=%lluus, wakeups=%u",
+			 frame_stats->wakeups ? frame_stats->wakeup_lat_sum / frame_stats->wakeups : 0,
+			 frame_stats->wakeup_lat_max, frame_stats->wakeups);
+}
+
+/*
+ * Accounts the latency between publishing a frame and the display
+ * thread taking it at the given time.
+ */
+static void update_wakeup_stats(struct frame_disp_stats *frame_stats, int idx,
+								unsigned long long now)
+{
+	unsigned long long lat = now - frame_pool_get_publish_time(idx);
+
+	lat_stats_add(LAT_STAGE_WAKEUP, lat);
+
+	frame_stats->wakeups++;
+	frame_stats->wakeup_lat_sum += lat;
+	if (lat > frame_stats->wakeup_lat_max)
+		frame_stats->wakeup_lat_max = lat;
+}
+
+/*
+ * Signals the first displayed frame via GPIO and optionally dumps it.
+ */
+static void handle_first_frame(struct prog_opts *opts, int gpioline_fd,
+							   struct rpmsg_cam_frame *frame, int dump)
+{
+	int ret;
+
+	if (gpioline_fd >= 0 && first_frame_signaled == 0) {
+		first_frame_signaled = 1;
+		gpioutil_line_set_value(gpioline_fd, 1);
+		log_info("Signaled GPIO line: %d", opts->gpioline_off);
+	}
+
+	if (dump != 0 && opts->dump_file[0] != 0) {
+		ret = rpmsg_cam_dump_frame(frame, opts->dump_file);
+		if (ret == 0)
+			log_info("Dumped frame to file: %s", opts->dump_file);
+	}
+}
+
+/*
+ * Allocates the frame pool frames, sized according to the negotiated
+ * image size. Returns 0 on success or -1 on error.
+ */
+static int alloc_pool_frames(const struct prog_opts *opts, rpmsg_cam_handle_t rpmsg_cam_h)
+{
+	return frame_pool_alloc(rpmsg_cam_h, !opts->fb_direct, opts->img_xres, opts->img_yres,
+							opts->pix_fmt == RPMSG_CAM_PIX_FMT_RGB565 ? 16 : 8);
+}
+
+/*
+ * Switches between the main and the alternate capture resolution, i.e.
+ * stops the capture and reconfigures in place the PRU capture, the camera
+ * module and the FB scaler. All frames must be freed before and the capture
+ * is resumed by the caller, once the frames are reallocated.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int reconfigure_capture(struct prog_opts *opts, rpmsg_cam_handle_t rpmsg_cam_h)
+{
+	unsigned long long start_time = lat_get_time_usec();
+	int xres = opts->alt_xres, yres = opts->alt_yres;
+	int img_xres, img_yres;
+	uint32_t fb_stride;
+
+	log_info("Switching capture from %dx%d to %dx%d",
+			 opts->cam_xres, opts->cam_yres, xres, yres);
+
+	/* The ROI must fit both resolutions */
+	if (rpmsg_cam_get_img_size(xres, yres, &opts->roi, &img_xres, &img_yres) != 0)
+		return -1;
+
+	if (rpmsg_cam_reconfigure(rpmsg_cam_h, xres, yres, &opts->roi) != 0) {
+		log_error("Failed to reconfigure PRU capture");
+		return -1;
+	}
+
+	/* The camera module must not be changed while capturing */
+	if (opts->test_mode == 0 && opts->cam_dev[0] != '-' &&
+		ov7670_i2c_set_size(opts->cam_dev, xres, yres, pix_fmts[opts->pix_fmt].cam) != 0) {
+		log_error("Failed to reconfigure camera module");
+		return -1;
+	}
+
+	opts->alt_xres = opts->cam_xres;
+	opts->alt_yres = opts->cam_yres;
+	opts->cam_xres = xres;
+	opts->cam_yres = yres;
+	opts->img_xres = img_xres;
+	opts->img_yres = img_yres;
+
+	if (fb_set_src_res(img_xres, img_yres) != 0)
+		log_warn("FB scaling not available, cropping frames");
+
+	opts->fb_direct = opts->fb_direct_req;
+	if (opts->fb_direct != 0 && fb_get_target(img_xres, img_yres, &fb_stride) == NULL) {
+		log_warn("Direct FB rendering not available, copying frames");
+		opts->fb_direct = 0;
+	}
+
+	/* Only the very first frame is dumped */
+	opts->dump_file = "";
+
+	log_info("Reconfigured capture in %lluus", lat_get_time_usec() - start_time);
+	return 0;
 }
 
 /*
  * Sends frames to the FB as soon as they are ready.
- * It acts as a single consumer (reader).
+ * It acts as a frame pool subscriber (reader), running an epoll event loop.
  */
 static void *display_frames(void *arg)
 {
 	struct composite_arg *carg = (struct composite_arg *)arg;
 	struct prog_opts *opts = (struct prog_opts *)carg->args[0];
 	int gpioline_fd = (int)carg->args[1];
+	struct frame_pool_sub *sub = (struct frame_pool_sub *)carg->args[2];
+	struct epoll_event ev, evs[DISPLAY_EP_MAX_EVENTS];
 	struct frame_disp_stats frame_stats;
-	int head, tail, ret;
+	struct composite_arg cleanup_carg;
+	struct rpmsg_cam_frame *frame;
+	unsigned long long disp_start;
+	eventfd_t rdy_cnt;
+	int ep_fd, idx, ret, i;
 
 	log_info("Starting FB display thread");
+	threadutil_apply_sched("disp");
 
+	memset(&frame_stats, 0, sizeof(frame_stats));
 	frame_stats.start_time = log_get_time_usec();
-	frame_stats.total_frames = 0;
-
-	fb_clear();
+	frame_stats.start_cpu_time = get_thread_cpu_usec();
 
 	if (opts->max_frames == 0)
 		goto err_prog_stop;
 
-	/* Mutex must be locked before calling pthread_cond_wait() */
-	ret = pthread_mutex_lock(&frame_ring.frame_rdy_lock);
-	if (ret != 0) {
-		log_error("pthread_mutex_lock failed: %s", strerror(ret));
+	ep_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep_fd < 0) {
+		log_error("Failed to create epoll fd: %s", strerror(errno));
 		goto err_prog_stop;
 	}
 
-	pthread_cleanup_push(display_frames_cleanup_handler, &frame_stats);
+	ev.events = EPOLLIN;
+	ev.data.fd = sub->rdy_fd;
+	if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, sub->rdy_fd, &ev) != 0) {
+		log_error("Failed to add frame ready fd to epoll: %s", strerror(errno));
+		close(ep_fd);
+		goto err_prog_stop;
+	}
+
+	cleanup_carg.args[0] = &frame_stats;
+	cleanup_carg.args[1] = &ep_fd;
+	cleanup_carg.args[2] = sub;
+	pthread_cleanup_push(display_frames_cleanup_handler, &cleanup_carg);
 
 	while (1) {
-		/* Ensure index is read before content at that index */
-		head = atomic_load_explicit(&frame_ring.writer, memory_order_acquire);
-		tail = frame_ring.reader;
+		ret = epoll_wait(ep_fd, evs, DISPLAY_EP_MAX_EVENTS, DISPLAY_EP_TIMEOUT_MSEC);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			log_error("Display epoll error: %s", strerror(errno));
+			break;
+		}
 
-		if (CIRC_CNT(head, tail, FRAME_RING_SIZE) >= 1) {
-			/* Render image into the frame buffer */
-			fb_write((uint16_t *)frame_ring.buf[tail]->pixels, opts->cam_xres, opts->cam_yres);
-			frame_stats.total_frames++;
+		for (i = 0; i < ret; i++) {
+			/* Clear the counter before checking the ready frame */
+			if (evs[i].data.fd == sub->rdy_fd)
+				eventfd_read(sub->rdy_fd, &rdy_cnt);
+		}
 
-			/* Special handling for 1st frame */
-			if (frame_ring.buf[tail]->seq == 0) {
-				if (gpioline_fd >= 0) {
-					gpioutil_line_set_value(gpioline_fd, 1);
-					log_info("Signaled GPIO line: %d", opts->gpioline_off);
-				}
+		idx = frame_pool_take(sub);
+		if (idx >= 0) {
+			frame = frame_pool_get(idx);
 
-				if (opts->dump_file[0] != 0) {
-					ret = rpmsg_cam_dump_frame(frame_ring.buf[tail], opts->dump_file);
-					if (ret == 0)
-						log_info("Dumped frame to file: %s", opts->dump_file);
-				}
-			}
+			disp_start = lat_get_time_usec();
+			update_wakeup_stats(&frame_stats, idx, disp_start);
 
-			if ((opts->max_frames > 0) && (frame_ring.buf[tail]->seq + 1 >= opts->max_frames)) {
+			/* Render image into the frame buffer, unless already there */
+			if (!FRAME_IN_FB(frame))
+				fb_write(frame->pixels, opts->img_xres, opts->img_yres);
+			update_disp_lat_stats(frame, disp_start);
+			frame_stats.total_frames++;
+
+			/* Special handling for 1st frame, which might have been overwritten */
+			if (frame_stats.total_frames == 1)
+				handle_first_frame(opts, gpioline_fd, frame, !FRAME_IN_FB(frame));
+
+			if ((opts->max_frames > 0) && (frame->seq + 1 >= opts->max_frames)) {
 				log_info("Reached max allowed no. of frames: %d", opts->max_frames);
 				break;
 			}
 
-			/* Finish consuming data before incrementing tail */
-			atomic_store_explicit(&frame_ring.reader, (tail + 1) & (FRAME_RING_SIZE - 1),
-								  memory_order_release);
-		} else {
-			/* Ring buffer empty, wait for new frames */
-			ret = pthread_cond_wait(&frame_ring.frame_rdy, &frame_ring.frame_rdy_lock);
-			if (ret != 0)
-				log_debug("pthread_cond_wait failed: %s", strerror(ret));
+			frame_pool_put(sub);
 		}
 	}
 
@@ -370,6 +783,294 @@ err_prog_stop:
 	return NULL;
 }
 
+/*
+ * Receives frames and displays them from a single thread, driven by an
+ * epoll event loop multiplexing the RPMsg device and SIGINT via signalfd.
+ * The frames are still published to the other frame pool subscribers.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int run_event_loop(struct prog_opts *opts, rpmsg_cam_handle_t rpmsg_cam_h,
+						  int gpioline_fd)
+{
+	struct epoll_event ev, evs[DISPLAY_EP_MAX_EVENTS];
+	struct frame_acq_stats acq_stats;
+	unsigned long long last_recv_end = 0, disp_start;
+	struct rpmsg_cam_frame *frame;
+	struct signalfd_siginfo si;
+	int ep_fd, sig_fd, rpmsg_fd, idx, disp_cnt = 0, stop = 0, reconf = 0, trace = 0, ret, i;
+	sigset_t mask;
+
+	log_info("Starting single thread event loop");
+	threadutil_apply_sched("acq");
+	memset(&acq_stats, 0, sizeof(acq_stats));
+
+	/* Block SIGINT, SIGUSR1 and SIGUSR2 to have them delivered via signalfd only */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+		log_error("Failed to block signals: %s", strerror(errno));
+		return -1;
+	}
+
+	sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sig_fd < 0) {
+		log_error("Failed to create signalfd: %s", strerror(errno));
+		return -1;
+	}
+
+	ret = -1;
+
+	ep_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep_fd < 0) {
+		log_error("Failed to create epoll fd: %s", strerror(errno));
+		goto close_sig;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.fd = sig_fd;
+	if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, sig_fd, &ev) != 0) {
+		log_error("Failed to add signalfd to epoll: %s", strerror(errno));
+		goto close_ep;
+	}
+
+	rpmsg_fd = rpmsg_cam_get_poll_fd(rpmsg_cam_h);
+	ev.events = EPOLLIN | EPOLLPRI;
+	ev.data.fd = rpmsg_fd;
+	if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, rpmsg_fd, &ev) != 0) {
+		log_error("Failed to add RPMsg fd to epoll: %s", strerror(errno));
+		goto close_ep;
+	}
+
+	if (opts->max_frames == 0) {
+		ret = 0;
+		goto close_ep;
+	}
+
+	if (rpmsg_cam_start(rpmsg_cam_h) != 0) {
+		log_fatal("Failed to start camera frames capture");
+		goto close_ep;
+	}
+
+	start_acq_stats(&acq_stats);
+
+	while (stop == 0) {
+		/* Already received messages are not signalled by the RPMsg fd */
+		if (rpmsg_cam_has_pending_msgs(rpmsg_cam_h) == 0) {
+			ret = epoll_wait(ep_fd, evs, DISPLAY_EP_MAX_EVENTS, EVENT_LOOP_TIMEOUT_MSEC);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				log_error("Event loop epoll error: %s", strerror(errno));
+				break;
+			}
+
+			if (ret == 0) {
+				log_error("Timeout waiting for RPMsg events");
+				ret = -1;
+				break;
+			}
+
+			for (i = 0; i < ret; i++) {
+				if (evs[i].data.fd == sig_fd &&
+					read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+					log_info("Received signal %d", si.ssi_signo);
+					if (si.ssi_signo == SIGUSR1)
+						reconf = 1;
+					else if (si.ssi_signo == SIGUSR2)
+						trace = 1;
+					else
+						stop = 1;
+				}
+			}
+
+			ret = 0;
+			if (stop != 0)
+				break;
+
+			if (trace != 0) {
+				trace = 0;
+				rpmsg_cam_get_trace(rpmsg_cam_h);
+			}
+
+			if (reconf != 0) {
+				reconf = 0;
+
+				if (opts->alt_xres == 0) {
+					log_warn("No alternate resolution, ignoring SIGUSR1");
+					continue;
+				}
+
+				ret = -1;
+				if (frame_pool_free() != 0)
+					break;
+
+				if (reconfigure_capture(opts, rpmsg_cam_h) != 0)
+					break;
+
+				if (alloc_pool_frames(opts, rpmsg_cam_h) != 0)
+					break;
+
+				if (rpmsg_cam_start(rpmsg_cam_h) != 0) {
+					log_fatal("Failed to resume camera frames capture");
+					break;
+				}
+
+				ret = 0;
+				continue;
+			}
+		}
+
+		idx = frame_pool_acquire();
+		frame = frame_pool_get(idx);
+
+		if (opts->fb_direct != 0)
+			frame->target = fb_get_target(opts->img_xres, opts->img_yres,
+										  &frame->target_stride);
+
+		ret = rpmsg_cam_get_frame(frame);
+		if (ret == -1) {
+			acq_stats.rpmsg_errors++;
+			log_error("Failed to get frame: %d", ret);
+			break;
+		}
+
+		acq_stats.total_frames++;
+
+		if (ret < -1) {
+			acq_stats.discarded_frames++;
+			log_debug("Discarding frame due to error: %d", ret);
+			ret = 0;
+			continue; /* Ignore frame & sync errors */
+		}
+
+		if (frame->patched != 0)
+			acq_stats.patched_frames++;
+		acq_stats.pru_dropped_frames += frame->pru_dropped;
+		update_acq_lat_stats(frame, &last_recv_end);
+
+		log_info("Received frame: seq=%d", frame->seq);
+
+		disp_start = lat_get_time_usec();
+		if (FRAME_IN_FB(frame))
+			fb_present();
+		else
+			fb_write(frame->pixels, opts->img_xres, opts->img_yres);
+		update_disp_lat_stats(frame, disp_start);
+
+		if (++disp_cnt == 1)
+			handle_first_frame(opts, gpioline_fd, frame, 1);
+
+		frame_pool_publish(idx);
+
+		if ((opts->max_frames > 0) && (frame->seq + 1 >= opts->max_frames)) {
+			log_info("Reached max allowed no. of frames: %d", opts->max_frames);
+			break;
+		}
+	}
+
+	log_info("Stopping single thread event loop");
+
+	rpmsg_cam_stop(rpmsg_cam_h);
+	rpmsg_cam_get_trace(rpmsg_cam_h);
+
+	log_info("Frame acquire stats: total=%u, discarded=%u, patched=%u, prudropped=%u, "
+			 "rpmsgerr=%u, displayed=%d",
+			 acq_stats.total_frames, acq_stats.discarded_frames,
+			 acq_stats.patched_frames, acq_stats.pru_dropped_frames,
+			 acq_stats.rpmsg_errors, disp_cnt);
+
+	add_acq_run_results(&acq_stats);
+	run_results.disp_frames += disp_cnt;
+	rpmsg_cam_log_stats(rpmsg_cam_h);
+
+close_ep:
+	close(ep_fd);
+close_sig:
+	close(sig_fd);
+
+	return ret;
+}
+
+/*
+ * Configures the camera module, run in parallel with the rest of the
+ * initialization, since the SCCB transfers are rather slow.
+ */
+static void *setup_camera(void *arg)
+{
+	const struct prog_opts *opts = arg;
+
+	log_info("Initializing camera module");
+
+	return (void *)(intptr_t)ov7670_i2c_setup(opts->cam_dev, pix_fmts[opts->pix_fmt].cam);
+}
+
+/*
+ * Waits for the camera module setup to complete.
+ * Returns 0 on success or -1 on error.
+ */
+static int wait_camera_setup(pthread_t cam_setup_thread)
+{
+	void *res;
+	int ret;
+
+	ret = pthread_join(cam_setup_thread, &res);
+	if (ret != 0) {
+		log_error("Failed to join camera setup thread: %s", strerror(ret));
+		return -1;
+	}
+
+	if ((intptr_t)res != 0) {
+		log_fatal("Failed to initialize camera module");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Creates the frame display and acquisition threads.
+ * Returns 0 on success or -1 on error, in which case no thread is running.
+ */
+static int start_frame_threads(pthread_t *acq_thread, struct composite_arg *acq_carg,
+							   pthread_t *disp_thread, struct composite_arg *disp_carg)
+{
+	int ret;
+
+	log_debug("Creating frame display thread");
+	ret = pthread_create(disp_thread, NULL, display_frames, disp_carg);
+	if (ret != 0) {
+		log_fatal("Failed to create frame display thread: %s", strerror(ret));
+		return -1;
+	}
+
+	log_debug("Creating frame acquisition thread");
+	ret = pthread_create(acq_thread, NULL, acquire_frames, acq_carg);
+	if (ret != 0) {
+		log_fatal("Failed to create frame acquisition thread: %s", strerror(ret));
+		pthread_cancel(*disp_thread);
+		pthread_join(*disp_thread, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Cancels the frame acquisition and display threads, which also stops
+ * the capture.
+ */
+static void stop_frame_threads(pthread_t acq_thread, pthread_t disp_thread)
+{
+	pthread_cancel(acq_thread);
+	pthread_cancel(disp_thread);
+
+	pthread_join(acq_thread, NULL);
+	pthread_join(disp_thread, NULL);
+}
+
 /*
  * Prints program help text.
  */
@@ -386,8 +1087,12 @@ static void usage(char *prog_name, int full)
  */
 int main(int argc, char *argv[])
 {
-	pthread_t frames_acq_thread, frames_disp_thread;
-	struct composite_arg frames_disp_thread_carg;
+	pthread_t frames_acq_thread, frames_disp_thread, cam_setup_thread;
+	int cam_setup_pending = 0;
+	struct composite_arg frames_disp_thread_carg, frames_acq_thread_carg;
+	struct frame_pool_sub *disp_sub = NULL;
+	struct fb_config fb_cfg;
+	uint32_t fb_stride;
 	rpmsg_cam_handle_t rpmsg_cam_h = NULL;
 	int gpioline_fd = -1, opt, ret;
 
@@ -395,6 +1100,10 @@ int main(int argc, char *argv[])
 		.log_level = LOG_INFO,
 		.cam_xres = DEFAULT_CAM_XRES,
 		.cam_yres = DEFAULT_CAM_YRES,
+		.alt_xres = 0,
+		.alt_yres = 0,
+		.pix_fmt = RPMSG_CAM_PIX_FMT_RGB565,
+		.frm_policy = 0,
 		.max_frames = -1,
 		.cam_dev = DEFAULT_CAM_DEV,
 		.fb_dev = DEFAULT_FB_DEV,
@@ -404,7 +1113,22 @@ int main(int argc, char *argv[])
 		.dump_file = "",
 		.test_mode = 0,
 		.test_pclk_mhz = DEFAULT_PCLK_MHZ,
+		.scale_mode = DEFAULT_SCALE_MODE,
+		.fb_bufs = DEFAULT_FB_BUFS,
+		.fb_wait_vsync = 0,
+		.fb_direct_req = 0,
+		.fb_direct = 0,
+		.event_loop = 0,
+		.sink_uri = "",
+		.video_file = "",
+		.video_frames = DEFAULT_VIDEO_FRAMES,
+		.lock_mem = 0,
+		.rec_file = "",
+		.results_file = "",
 	};
+	float replay_speed = 1.0;
+	int replay_drop_pct = 0, replay_inval_pct = 0;
+	char *tok;
 
 	while ((opt = getopt(argc, argv, PROG_OPT_STR)) != -1) {
 		switch (opt) {
@@ -430,6 +1154,47 @@ int main(int argc, char *argv[])
 				options.cam_yres = ret;
 			break;
 
+		case 'X':
+			ret = strtol(optarg, NULL, 10);
+			if (ret > 0)
+				options.alt_xres = ret;
+			break;
+
+		case 'Y':
+			ret = strtol(optarg, NULL, 10);
+			if (ret > 0)
+				options.alt_yres = ret;
+			break;
+
+		case 'R':
+			if (sscanf(optarg, "%d,%d,%d,%d", &options.roi.x, &options.roi.y,
+					   &options.roi.width, &options.roi.height) != 4) {
+				usage(basename(argv[0]), 0);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'D':
+			if (sscanf(optarg, "%d,%d", &options.roi.dec_x, &options.roi.dec_y) != 2) {
+				usage(basename(argv[0]), 0);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'F':
+			ret = strtol(optarg, NULL, 10);
+			if (ret >= RPMSG_CAM_PIX_FMT_RGB565 && ret <= RPMSG_CAM_PIX_FMT_RGB332)
+				options.pix_fmt = ret;
+			break;
+
+		case 'V':
+			options.frm_policy |= RPMSG_CAM_F_VERIFY_CSUM;
+			break;
+
+		case 'P':
+			options.frm_policy |= RPMSG_CAM_F_PATCH_PARTIAL;
+			break;
+
 		case 'm':
 			ret = strtol(optarg, NULL, 10);
 			if (ret >= 0)
@@ -470,6 +1235,76 @@ int main(int argc, char *argv[])
 				options.test_pclk_mhz = ret;
 			break;
 
+		case 'z':
+			ret = strtol(optarg, NULL, 10);
+			if (ret >= FB_SCALE_NONE && ret <= FB_SCALE_BILINEAR)
+				options.scale_mode = ret;
+			break;
+
+		case 'b':
+			ret = strtol(optarg, NULL, 10);
+			if (ret >= 1 && ret <= FB_BUF_CNT_MAX)
+				options.fb_bufs = ret;
+			break;
+
+		case 'w':
+			options.fb_wait_vsync = 1;
+			break;
+
+		case 'd':
+			options.fb_direct_req = 1;
+			break;
+
+		case 'e':
+			options.event_loop = 1;
+			break;
+
+		case 'u':
+			options.sink_uri = optarg;
+			break;
+
+		case 'v':
+			options.video_file = optarg;
+			tok = strchr(optarg, ',');
+			if (tok != NULL) {
+				*tok++ = 0;
+				ret = strtol(tok, NULL, 10);
+				if (ret > 0)
+					options.video_frames = ret;
+			}
+			break;
+
+		case 'T':
+			if (threadutil_parse_sched(optarg) != 0) {
+				fprintf(stderr, "Invalid thread scheduling: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+
+		case 'L':
+			options.lock_mem = 1;
+			break;
+
+		case 'O':
+			options.rec_file = optarg;
+			break;
+
+		case 'q':
+			if (sscanf(optarg, "%f,%d,%d", &replay_speed, &replay_drop_pct,
+					   &replay_inval_pct) < 1) {
+				usage(basename(argv[0]), 0);
+				exit(EXIT_FAILURE);
+			}
+			rpmsg_replay_set_params(replay_speed, replay_drop_pct, replay_inval_pct);
+			break;
+
+		case 'J':
+			options.results_file = optarg;
+			break;
+
+		case 'S':
+			exit(lat_stats_print(DEFAULT_STATS_SHM) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
 		case 'h':
 			usage(basename(argv[0]), 1);
 			exit(EXIT_SUCCESS);
@@ -485,48 +1320,130 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	if (options.cam_xres * options.cam_yres > BCAM_FRAME_LEN_MAX / 2) {
+	if (options.cam_xres * options.cam_yres > BCAM_FRAME_LEN_MAX / 2 ||
+		options.alt_xres * options.alt_yres > BCAM_FRAME_LEN_MAX / 2) {
 		fprintf(stderr, "Camera supported maximum resolution is 640x480 or equivalent.\n");
 		exit(EXIT_FAILURE);
 	}
 
+	if ((options.alt_xres == 0) != (options.alt_yres == 0)) {
+		fprintf(stderr, "Both alternate X and Y resolutions must be provided.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (rpmsg_cam_get_img_size(options.cam_xres, options.cam_yres, &options.roi,
+							   &options.img_xres, &options.img_yres) != 0) {
+		fprintf(stderr, "Invalid region of interest.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	options.fb_direct = options.fb_direct_req;
+
+	/* The replayed frames don't depend on the camera module */
+	if (rpmsg_replay_is_rec(options.rpmsg_dev))
+		options.cam_dev = "-";
+
 	/* Set log level */
 	log_set_level(options.log_level);
 
+	/* Not fatal, the frames are just more exposed to page fault delays */
+	if (options.lock_mem != 0 && threadutil_lock_memory() == 0)
+		log_info("Locked process memory");
+
+	/* Keep the slow console writes out of the frame processing threads */
+	log_start_async();
+
 	log_info("Starting rpmsgcam app");
 
 	/* Setup the signal handler for stopping app gracefully */
 	setup_signal_handler();
 
-	/* Configure the OV7670 Camera Module via the I2C-like interface */
+	/* Not fatal, the stats are still logged at exit */
+	lat_stats_init(DEFAULT_STATS_SHM);
+
+	/*
+	 * Configure the OV7670 Camera Module via the I2C-like interface,
+	 * overlapped with the frame buffer setup and the wait for the RPMsg
+	 * device. The capture must not be started before completion.
+	 */
 	if (options.test_mode == 0 && options.cam_dev[0] != '-') {
-		log_info("Initializing camera module");
-		ret = ov7670_i2c_setup(options.cam_dev);
+		ret = pthread_create(&cam_setup_thread, NULL, setup_camera, &options);
 		if (ret != 0) {
-			log_fatal("Failed to initialize camera module");
-			goto free_ring;
+			log_fatal("Failed to create camera setup thread: %s", strerror(ret));
+			goto free_pool;
 		}
+		cam_setup_pending = 1;
 	}
 
 	/* Initialize LCD frame buffer */
 	if (options.fb_dev[0] != '-') {
 		log_info("Initializing LCD frame buffer");
-		ret = fb_init(options.fb_dev);
+		fb_cfg.xres = options.img_xres;
+		fb_cfg.yres = options.img_yres;
+		fb_cfg.pix_fmt = pix_fmts[options.pix_fmt].fb;
+		fb_cfg.scale_mode = options.scale_mode;
+		fb_cfg.buf_cnt = options.fb_bufs;
+		fb_cfg.wait_vsync = options.fb_wait_vsync;
+
+		ret = fb_init(options.fb_dev, &fb_cfg);
 		if (ret != 0) {
 			log_fatal("Failed to initialize frame buffer");
-			goto free_ring;
+			goto free_pool;
 		}
+
+		fb_clear();
+	}
+
+	/* Not fatal, the frames are still displayed */
+	if (options.sink_uri[0] != 0 && sink_init(options.sink_uri, BCAM_FRAME_LEN_MAX) != 0) {
+		log_error("Failed to initialize frame streaming sink");
+		options.sink_uri = "";
+	}
+
+	/* Not fatal either */
+	if (options.video_file[0] != 0 &&
+		frame_rec_init(options.video_file, options.video_frames, BCAM_FRAME_LEN_MAX) != 0) {
+		log_error("Failed to initialize frame recording");
+		options.video_file = "";
+	}
+
+	/* The FB buffers are reused while the sink or the recorder still read them */
+	if (options.fb_direct_req != 0 &&
+		(options.sink_uri[0] != 0 || options.video_file[0] != 0)) {
+		log_warn("Direct FB rendering not available with frame streaming or recording, copying frames");
+		options.fb_direct_req = 0;
+		options.fb_direct = 0;
+	}
+
+	if (options.fb_direct != 0 &&
+		fb_get_target(options.img_xres, options.img_yres, &fb_stride) == NULL) {
+		log_warn("Direct FB rendering not available, copying frames");
+		options.fb_direct = 0;
 	}
 
 	/* Initialize PRUs via RPMsg */
 	log_info("Initializing PRUs for %dx%d frame acquisition",
 			 options.cam_xres, options.cam_yres);
 	rpmsg_cam_h = rpmsg_cam_init(options.rpmsg_dev, options.cam_xres, options.cam_yres,
+								 &options.roi, options.pix_fmt,
 								 options.test_mode, options.test_pclk_mhz);
 	if (rpmsg_cam_h == NULL) {
 		log_fatal("Failed to initialize RPMsg camera communication");
 		ret = -1;
-		goto free_ring;
+		goto free_pool;
+	}
+
+	if (options.frm_policy != 0 &&
+		rpmsg_cam_set_frame_policy(rpmsg_cam_h, options.frm_policy) != 0) {
+		log_fatal("Failed to set the frame integrity policy");
+		ret = -1;
+		goto free_pool;
+	}
+
+	if (options.rec_file[0] != 0 && rpmsg_cam_record(rpmsg_cam_h, options.rec_file) != 0) {
+		log_fatal("Failed to record the RPMsg messages");
+		ret = -1;
+		goto free_pool;
 	}
 
 	/* Initialize GPIO output line */
@@ -538,54 +1455,93 @@ int main(int argc, char *argv[])
 			log_error("Failed to initialize GPIO output line: %d", options.gpioline_off);
 	}
 
-	/* Allocate memory for frames circular buffer */
-	for (int i = 0; i < FRAME_RING_SIZE; i++) {
-		frame_ring.buf[i] = malloc(sizeof(struct rpmsg_cam_frame));
-		if (frame_ring.buf[i] == NULL) {
-			log_fatal("Not enough memory");
+	if (cam_setup_pending != 0) {
+		cam_setup_pending = 0;
+		ret = wait_camera_setup(cam_setup_thread);
+		if (ret != 0)
+			goto free_pool;
+	}
+
+	/* The event loop displays the frames itself */
+	if (options.event_loop == 0) {
+		disp_sub = frame_pool_subscribe("display", FRAME_POOL_SUB_DISPLAY);
+		if (disp_sub == NULL) {
 			ret = -1;
-			goto free_ring;
+			goto free_pool;
 		}
-		frame_ring.buf[i]->handle = rpmsg_cam_h;
 	}
 
-	log_debug("Creating frame display thread");
+	/* Allocate memory for the frame pool */
+	ret = alloc_pool_frames(&options, rpmsg_cam_h);
+	if (ret != 0)
+		goto free_pool;
+
+	if (options.event_loop != 0) {
+		ret = run_event_loop(&options, rpmsg_cam_h, gpioline_fd);
+		goto free_pool;
+	}
+
 	frames_disp_thread_carg.args[0] = &options;
 	frames_disp_thread_carg.args[1] = (void *)gpioline_fd;
+	frames_disp_thread_carg.args[2] = disp_sub;
+	frames_acq_thread_carg.args[0] = rpmsg_cam_h;
+	frames_acq_thread_carg.args[1] = &options;
 
-	ret = pthread_create(&frames_disp_thread, NULL, display_frames, &frames_disp_thread_carg);
-	if (ret != 0) {
-		log_fatal("Failed to create frame display thread: %s", strerror(ret));
-		goto free_ring;
-	}
+	ret = start_frame_threads(&frames_acq_thread, &frames_acq_thread_carg,
+							  &frames_disp_thread, &frames_disp_thread_carg);
+	if (ret != 0)
+		goto free_pool;
 
-	log_debug("Creating frame acquisition thread");
-	ret = pthread_create(&frames_acq_thread, NULL, acquire_frames, rpmsg_cam_h);
-	if (ret != 0) {
-		log_fatal("Failed to create frame acquisition thread: %s", strerror(ret));
-		pthread_cancel(frames_disp_thread);
-		goto join_disp;
-	}
+	while (prog_stopping == 0) {
+		if (reconfig_requested == 0) {
+			usleep(100000);
+			continue;
+		}
 
-	while (prog_stopping == 0)
-		usleep(100000);
+		reconfig_requested = 0;
+
+		if (options.alt_xres == 0) {
+			log_warn("No alternate resolution, ignoring SIGUSR1");
+			continue;
+		}
+
+		/* The frames are resized, hence the pipeline must be stopped */
+		stop_frame_threads(frames_acq_thread, frames_disp_thread);
+		ret = frame_pool_free();
+		if (ret == 0)
+			ret = reconfigure_capture(&options, rpmsg_cam_h);
+		if (ret == 0)
+			ret = alloc_pool_frames(&options, rpmsg_cam_h);
+		if (ret == 0)
+			ret = start_frame_threads(&frames_acq_thread, &frames_acq_thread_carg,
+									  &frames_disp_thread, &frames_disp_thread_carg);
+		if (ret != 0)
+			goto free_pool;
+	}
 
 	log_info("Stopping rpmsgcam app");
 
-	pthread_cancel(frames_acq_thread);
-	pthread_cancel(frames_disp_thread);
+	stop_frame_threads(frames_acq_thread, frames_disp_thread);
 
-	pthread_join(frames_acq_thread, NULL);
-join_disp:
-	pthread_join(frames_disp_thread, NULL);
+free_pool:
+	if (cam_setup_pending != 0)
+		wait_camera_setup(cam_setup_thread);
 
-free_ring:
-	for (int i = 0; i < FRAME_RING_SIZE; i++)
-		free(frame_ring.buf[i]);
+	/* The sink and the recorder give back their frames once stopped */
+	sink_release();
+	frame_rec_release();
+	frame_pool_free();
+	frame_pool_log_stats();
+	frame_pool_release();
 
 	if (gpioline_fd >= 0)
 		close(gpioline_fd);
 
+	lat_stats_log();
+	if (options.results_file[0] != 0)
+		write_run_results(&options, ret == 0 ? 0 : 1, options.results_file);
+	lat_stats_release();
+
 	rpmsg_cam_release(rpmsg_cam_h);
 	fb_release();
 
@@ -13,6 +13,9 @@
 #include "ov7670-i2c.h"
 #include "ov7670-regs.h"
 
+/* Generated by ov7670-regs-gen, see Makefile */
+#include "ov7670-init-regs.h"
+
 /*
  * Reads the value of a register.
  */
@@ -34,27 +37,68 @@ static int ov7670_read_reg(int i2c_fd, unsigned char i2c_addr,
 	return ret;
 }
 
+/* The register lists are submitted as (reg_num, value) byte pairs */
+_Static_assert(sizeof(struct regval_list) == 2, "unexpected regval_list layout");
+
+/*
+ * Writes a run of register settings, batched in as few I2C_RDWR ioctls as
+ * possible. Falls back to one register per ioctl if the batch fails, e.g.
+ * when the adapter doesn't cope with repeated START conditions.
+ */
+static int ov7670_write_run(int i2c_fd, unsigned char i2c_addr,
+							const struct regval_list *regs, unsigned int cnt)
+{
+	unsigned int i;
+	int ret;
+
+	ret = i2c_write_regs8(i2c_fd, i2c_addr, (const unsigned char *)regs, cnt);
+	if (ret == 0 || cnt == 1)
+		return ret;
+
+	log_warn("Batched ov7670 reg writes failed, retrying one by one");
+
+	for (i = 0; i < cnt; i++) {
+		ret = i2c_write_regs8(i2c_fd, i2c_addr,
+							  (const unsigned char *)&regs[i], 1);
+		if (ret != 0) {
+			log_error("Failed to write ov7670 i2c reg 0x%02x", regs[i].reg_num);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
 /*
  * Writes a list of register settings; 0xff / 0xff stops the process.
  */
-static int ov7670_write_regs(int i2c_fd, const struct regval_list *regs)
+static int ov7670_write_regs(int i2c_fd, unsigned char i2c_addr,
+							 const struct regval_list *regs)
 {
-	unsigned char buf[2];
+	unsigned int cnt;
+	int ret;
 
 	while (regs->reg_num != 0xff || regs->value != 0xff) {
-		buf[0] = regs->reg_num;
-		buf[1] = regs->value;
+		if (regs->reg_num == REG_COM7 && (regs->value & COM7_RESET)) {
+			ret = ov7670_write_run(i2c_fd, i2c_addr, regs, 1);
+			if (ret != 0)
+				return ret;
 
-		if (write(i2c_fd, buf, 2) != 2) {
-			log_error("failed to write ov7670 i2c reg 0x%02x: %s",
-					  regs->reg_num, strerror(errno));
-			return -errno;
+			usleep(5 * 1000);	/* Wait at least 1 ms for reset to complete */
+			regs++;
+			continue;
 		}
 
-		if (regs->reg_num == REG_COM7 && (regs->value & COM7_RESET))
-			usleep(5 * 1000);	/* Wait at least 1 ms for reset to complete */
+		/* Batch everything up to the next reset or the end marker */
+		for (cnt = 1; regs[cnt].reg_num != 0xff || regs[cnt].value != 0xff; cnt++)
+			if (regs[cnt].reg_num == REG_COM7 && (regs[cnt].value & COM7_RESET))
+				break;
 
-		regs++;
+		ret = ov7670_write_run(i2c_fd, i2c_addr, regs, cnt);
+		if (ret != 0)
+			return ret;
+
+		regs += cnt;
 	}
 
 	return 0;
@@ -108,23 +152,19 @@ static int ov7670_detect(int i2c_fd, unsigned char i2c_addr)
 	return 0;
 }
 
+/* Max no. of entries in a size register list, see ov7670_i2c_set_size() */
+#define OV7670_SIZE_REGS_MAX	16
+
 /**
  * Configures the OV7670 camera module using the I2C-compatible interface.
  *
  * @dev_path I2C camera device path
+ * @fmt Camera output format
  *
  * Return: 0 on success or -errno on failure
  */
-int ov7670_i2c_setup(const char *dev_path)
+int ov7670_i2c_setup(const char *dev_path, enum ov7670_out_fmt fmt)
 {
-	const struct regval_list ov7670_custom_regs[] = {
-		{ REG_CLKRC, 0x1 },					/* F(internal clock) = F(input clock)/2 */
-		{ REG_COM7, COM7_FMT_QVGA | COM7_RGB },
-		{ REG_COM10, COM10_PCLK_HB },		/* Suppress PCLK on horiz blank */
-		{ REG_COM14, COM14_DCWEN | 0x1 },	/* DCW/PCLK-scale enable, PCLK divider=2 */
-		/* TODO: check if needed to set SCALING_PCLK_DIV[3:0] (0x73) */
-	};
-
 	unsigned char cam_addr = OV7670_I2C_ADDR >> 1;
 	int cam_fd, ret;
 
@@ -138,24 +178,83 @@ int ov7670_i2c_setup(const char *dev_path)
 	if (ret != 0)
 		goto err_close;
 
-	log_debug("Writing ov7670 default regs");
-	ret = ov7670_write_regs(cam_fd, ov7670_get_regval_list(OV7670_REGS_DEFAULT));
-	if (ret != 0)
-		goto err_close;
+	if (fmt == OV7670_OUT_YUV422) {
+		log_debug("Writing ov7670 yuv422 qvga regs");
+		ret = ov7670_write_regs(cam_fd, cam_addr, ov7670_init_regs_yuv422_qvga);
+	} else {
+		log_debug("Writing ov7670 rgb565 qvga regs");
+		ret = ov7670_write_regs(cam_fd, cam_addr, ov7670_init_regs_rgb565_qvga);
+	}
 
-	log_debug("Writing ov7670 rgb565 regs");
-	ret = ov7670_write_regs(cam_fd, ov7670_get_regval_list(OV7670_REGS_FMT_RGB565));
-	if (ret != 0)
-		goto err_close;
+err_close:
+	close(cam_fd);
+	return ret;
+}
 
-	log_debug("Writing ov7670 custom regs");
-	ret = ov7670_write_regs(cam_fd, ov7670_custom_regs);
-	if (ret != 0)
-		goto err_close;
+/**
+ * Changes the output image size of an already configured OV7670 camera
+ * module, see ov7670_i2c_setup().
+ *
+ * The size lists assume RGB output, hence the COM7 output format bits are
+ * adjusted according to fmt, which must match the one used for the setup.
+ *
+ * @dev_path I2C camera device path
+ * @xres Image X resolution
+ * @yres Image Y resolution
+ * @fmt Camera output format
+ *
+ * Return: 0 on success or -errno on failure
+ */
+int ov7670_i2c_set_size(const char *dev_path, int xres, int yres,
+						enum ov7670_out_fmt fmt)
+{
+	static const struct {
+		int xres;
+		int yres;
+		enum ov7670_reglist_ids regs;
+	} sizes[] = {
+		{ 640, 480, OV7670_REGS_SIZE_VGA },
+		{ 320, 240, OV7670_REGS_SIZE_QVGA },
+		{ 160, 120, OV7670_REGS_SIZE_QQVGA },
+	};
 
-	return 0;
+	unsigned char cam_addr = OV7670_I2C_ADDR >> 1;
+	unsigned char com7_out = (fmt == OV7670_OUT_YUV422 ? COM7_YUV : COM7_RGB);
+	struct regval_list regs[OV7670_SIZE_REGS_MAX];
+	const struct regval_list *rv;
+	int cam_fd, ret, i, n;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		if (sizes[i].xres == xres && sizes[i].yres == yres)
+			break;
+
+	if (i == sizeof(sizes) / sizeof(sizes[0])) {
+		log_error("Unsupported ov7670 image size: %dx%d", xres, yres);
+		return -EINVAL;
+	}
+
+	rv = ov7670_get_regval_list(sizes[i].regs);
+	for (n = 0; n < OV7670_SIZE_REGS_MAX; n++) {
+		regs[n] = rv[n];
+		if (regs[n].reg_num == 0xff && regs[n].value == 0xff)
+			break;
+
+		if (regs[n].reg_num == REG_COM7)
+			regs[n].value = (regs[n].value & ~COM7_OUT_MASK) | com7_out;
+	}
+
+	if (n == OV7670_SIZE_REGS_MAX) {
+		log_error("Too many ov7670 size regs");
+		return -EINVAL;
+	}
+
+	cam_fd = i2c_open(dev_path, cam_addr);
+	if (cam_fd < 0)
+		return cam_fd;
+
+	log_debug("Writing ov7670 %dx%d size regs", xres, yres);
+	ret = ov7670_write_regs(cam_fd, cam_addr, regs);
 
-err_close:
 	close(cam_fd);
 	return ret;
 }
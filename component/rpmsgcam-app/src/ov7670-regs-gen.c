@@ -0,0 +1,158 @@
+/*
+ * Build time generator of the OV7670 camera init register tables.
+ *
+ * The camera setup consists of applying a sequence of register lists, i.e.
+ * the default settings, followed by the output format and the BeagleCam
+ * specific ones. Since many registers are written more than once across
+ * those lists, this tool merges each sequence into its final-state delta,
+ * which is printed to stdout as a C header included by ov7670-i2c.c.
+ *
+ * The merge rules are:
+ *   - everything preceding the last COM7 reset is dropped, except the reset
+ *     itself, which is kept as the first entry
+ *   - for the remaining entries, only the last write to each register is
+ *     kept, in the original order of those last writes
+ *   - the writes to the multiplexed 0x79 (index) / 0xc8 (data) register pair
+ *     are always kept, since they address different internal registers
+ *   - the output format bits of the remaining COM7 writes are replaced with
+ *     the ones of the table, since the BeagleCam list also selects the image
+ *     size via COM7, assuming RGB output
+ *
+ * Note this runs on the build host, hence it must not depend on anything but
+ * ov7670-regs.c and the standard C library.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ov7670-regs.h"
+
+/* Multiplexed register window, see ov7670_default_regs */
+#define REG_MUX_INDEX		0x79
+#define REG_MUX_DATA		0xc8
+
+/* Max no. of register writes in a sequence */
+#define GEN_REGS_MAX		1024
+
+/* Max no. of register lists in a sequence */
+#define GEN_LISTS_MAX		4
+
+struct gen_table {
+	const char *name;
+	enum ov7670_reglist_ids lists[GEN_LISTS_MAX];
+	unsigned int list_cnt;
+	unsigned char com7_out;		/* COM7_OUT_MASK bits */
+};
+
+static const struct gen_table gen_tables[] = {
+	{
+		.name = "ov7670_init_regs_rgb565_qvga",
+		.lists = {
+			OV7670_REGS_DEFAULT,
+			OV7670_REGS_FMT_RGB565,
+			OV7670_REGS_BCAM_QVGA,
+		},
+		.list_cnt = 3,
+		.com7_out = COM7_RGB,
+	},
+	{
+		.name = "ov7670_init_regs_yuv422_qvga",
+		.lists = {
+			OV7670_REGS_DEFAULT,
+			OV7670_REGS_FMT_YUV422,
+			OV7670_REGS_BCAM_QVGA,
+		},
+		.list_cnt = 3,
+		.com7_out = COM7_YUV,
+	},
+};
+
+static int is_end_marker(const struct regval_list *rv)
+{
+	return rv->reg_num == 0xff && rv->value == 0xff;
+}
+
+static int is_reset(const struct regval_list *rv)
+{
+	return rv->reg_num == REG_COM7 && (rv->value & COM7_RESET);
+}
+
+static int is_muxed(const struct regval_list *rv)
+{
+	return rv->reg_num == REG_MUX_INDEX || rv->reg_num == REG_MUX_DATA;
+}
+
+static int gen_table(const struct gen_table *tbl)
+{
+	static struct regval_list regs[GEN_REGS_MAX];
+	unsigned int i, j, cnt = 0, start = 0, out = 0;
+	int last_write[256];
+
+	for (i = 0; i < tbl->list_cnt; i++) {
+		const struct regval_list *rv = ov7670_get_regval_list(tbl->lists[i]);
+
+		if (rv == NULL) {
+			fprintf(stderr, "%s: invalid reglist id %d\n",
+					tbl->name, tbl->lists[i]);
+			return -1;
+		}
+
+		for (; !is_end_marker(rv); rv++) {
+			if (cnt == GEN_REGS_MAX) {
+				fprintf(stderr, "%s: too many registers\n", tbl->name);
+				return -1;
+			}
+
+			if (is_reset(rv))
+				start = cnt;
+
+			regs[cnt++] = *rv;
+		}
+	}
+
+	/* Not fatal, but the sensor state would depend on its history */
+	if (cnt == 0 || !is_reset(&regs[start]))
+		fprintf(stderr, "%s: warning: no COM7 reset\n", tbl->name);
+
+	for (j = 0; j < 256; j++)
+		last_write[j] = -1;
+
+	for (i = start; i < cnt; i++)
+		if (!is_reset(&regs[i]))
+			last_write[regs[i].reg_num] = i;
+
+	printf("\n/* Merged from %u register writes */\n", cnt);
+	printf("static const struct regval_list %s[] = {\n", tbl->name);
+
+	for (i = start; i < cnt; i++) {
+		if (is_reset(&regs[i]) ? i != start :
+			(!is_muxed(&regs[i]) && last_write[regs[i].reg_num] != i))
+			continue;
+
+		if (regs[i].reg_num == REG_COM7 && !is_reset(&regs[i]))
+			regs[i].value = (regs[i].value & ~COM7_OUT_MASK) | tbl->com7_out;
+
+		printf("\t{ 0x%02x, 0x%02x },\n", regs[i].reg_num, regs[i].value);
+		out++;
+	}
+
+	printf("\t{ 0xff, 0xff },\t/* END MARKER, %u entries */\n};\n", out);
+
+	return 0;
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	printf("/*\n * OV7670 camera init register tables.\n *\n"
+		   " * Generated by ov7670-regs-gen from ov7670-regs.c, do not edit.\n */\n");
+
+	for (i = 0; i < sizeof(gen_tables) / sizeof(gen_tables[0]); i++)
+		if (gen_table(&gen_tables[i]) != 0)
+			return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -200,6 +200,61 @@ static const struct regval_list ov7670_fmt_raw[] = {
 	{ 0xff, 0xff },
 };
 
+/*
+ * BeagleCam specific settings, applied on top of the default and the
+ * RGB565 format lists.
+ */
+static const struct regval_list ov7670_bcam_qvga[] = {
+	{ REG_CLKRC, 0x1 },		/* F(internal clock) = F(input clock)/2 */
+	{ REG_COM7, COM7_FMT_QVGA | COM7_RGB },
+	{ REG_COM10, COM10_PCLK_HB },	/* Suppress PCLK on horiz blank */
+	{ REG_COM14, COM14_DCWEN | 0x1 },	/* DCW/PCLK-scale enable, PCLK divider=2 */
+	/* TODO: check if needed to set SCALING_PCLK_DIV[3:0] (0x73) */
+	{ 0xff, 0xff },
+};
+
+/*
+ * Output image size, applied on top of the format settings when changing
+ * the capture resolution at runtime. The values are based on the OV7670
+ * implementation guide, i.e. VGA window with DCW downsampling and PCLK
+ * division for the smaller sizes.
+ */
+static const struct regval_list ov7670_size_vga[] = {
+	{ REG_COM7, COM7_FMT_VGA | COM7_RGB },
+	{ REG_COM3, 0 },
+	{ REG_COM14, 0 },
+	{ REG_SCALING_XSC, 0x3a },
+	{ REG_SCALING_YSC, 0x35 },
+	{ 0x72, 0x11 },		/* DCW: no downsampling */
+	{ 0x73, 0xf0 },		/* PCLK divider: bypass */
+	{ 0xa2, 0x02 },		/* PCLK delay */
+	{ 0xff, 0xff },
+};
+
+static const struct regval_list ov7670_size_qvga[] = {
+	{ REG_COM7, COM7_FMT_VGA | COM7_RGB },
+	{ REG_COM3, COM3_DCWEN },
+	{ REG_COM14, COM14_DCWEN | 0x09 },	/* Manual scaling, PCLK divider=2 */
+	{ REG_SCALING_XSC, 0x3a },
+	{ REG_SCALING_YSC, 0x35 },
+	{ 0x72, 0x11 },		/* DCW: downsample by 2 */
+	{ 0x73, 0xf1 },		/* PCLK divider=2 */
+	{ 0xa2, 0x02 },		/* PCLK delay */
+	{ 0xff, 0xff },
+};
+
+static const struct regval_list ov7670_size_qqvga[] = {
+	{ REG_COM7, COM7_FMT_VGA | COM7_RGB },
+	{ REG_COM3, COM3_DCWEN },
+	{ REG_COM14, COM14_DCWEN | 0x0a },	/* Manual scaling, PCLK divider=4 */
+	{ REG_SCALING_XSC, 0x3a },
+	{ REG_SCALING_YSC, 0x35 },
+	{ 0x72, 0x22 },		/* DCW: downsample by 4 */
+	{ 0x73, 0xf2 },		/* PCLK divider=4 */
+	{ 0xa2, 0x02 },		/* PCLK delay */
+	{ 0xff, 0xff },
+};
+
 /*
  * API helpers.
  */
@@ -209,6 +264,10 @@ static const struct regval_list *ov7670_reglists[] = {
 	ov7670_fmt_rgb565,
 	ov7670_fmt_rgb444,
 	ov7670_fmt_raw,
+	ov7670_bcam_qvga,
+	ov7670_size_vga,
+	ov7670_size_qvga,
+	ov7670_size_qqvga,
 };
 
 const struct regval_list *ov7670_get_regval_list(enum ov7670_reglist_ids id)
@@ -6,54 +6,197 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bcam-rpmsg-api.h"
+#include "lat-stats.h"
 #include "log.h"
 #include "rpmsg-cam.h"
+#include "rpmsg-replay.h"
+#include "rpmsgcam-drv-api.h"
 
 #define RPMSG_MESSAGE_SIZE		496
+/* Image data size of the BCAM_PRU_MSG_CAP messages, except for the last ones */
+#define RPMSG_SECT_DATA_SIZE	(RPMSG_MESSAGE_SIZE - offsetof(struct bcam_pru_msg, cap_hdr.data))
 #define EP_MAX_EVENTS			1
 #define EP_TIMEOUT_MSEC			1500
-#define DEFAULT_IMG_BPP			16
+#define CAM_BPP					16
+
+/* Max time to wait for the RPMsg device node to be created */
+#define RPMSG_DEV_TMOUT_MSEC	3000
+
+/* Max no. of messages received at once via RPMSGCAM_IOC_RECV_MSGS */
+#define RPMSG_BATCH_MSGS		32
+
+/* Max no. of BCAM_ARM_MSG_GET_TRACE requests to drain the PRU trace ring */
+#define RPMSG_TRACE_REQS_MAX	8
+
+/*
+ * No. of slots requested for the driver frame ring. Must be larger than the
+ * no. of frames the application keeps at once, to always have a free slot
+ * for the frame being received, see rpmsg_cam_get_ring_slots().
+ */
+#define FRAME_RING_SLOTS		RPMSGCAM_RING_SLOTS_MAX
 
 /*
  * State of a RPMsg capture instance.
  * Not directly exposed to user API, which uses rpmsg_cam_handle_t instead.
  */
 struct rpmsg_cam_handle {
-	uint32_t img_xres;						/* Image X resolution */
-	uint32_t img_yres;						/* Image Y resolution */
+	uint32_t cam_xres;						/* Camera X resolution */
+	uint32_t cam_yres;						/* Camera Y resolution */
+	struct rpmsg_cam_roi roi;				/* Captured region of interest */
+	uint32_t img_xres;						/* Image X resolution, i.e. after ROI */
+	uint32_t img_yres;						/* Image Y resolution, i.e. after ROI */
+	enum rpmsg_cam_pix_fmt pix_fmt;			/* Image pixel format */
 	uint32_t img_bpp;						/* Image bits per pixel */
 	uint32_t img_sz;						/* Image size in bytes */
 	uint32_t frame_cnt;						/* Counter for image frames */
+	int test_mode;							/* PRU0 generates test images */
+	int test_pclk_mhz;						/* Test images pixel clock */
 	int rpmsg_fd;							/* RPMsg file descriptor */
-	uint8_t rpmsg_buf[RPMSG_MESSAGE_SIZE];	/* RPMsg receive buffer */
+	int rpmsg_batch;						/* Batch receive supported */
+	uint8_t rpmsg_buf[RPMSG_BATCH_MSGS * RPMSG_MESSAGE_SIZE]; /* RPMsg receive buffer */
+	uint32_t msg_lens[RPMSG_BATCH_MSGS];	/* Size of each received message */
+	uint32_t msg_cnt;						/* No. of received messages */
+	uint32_t msg_idx;						/* Index of the next message to process */
+	uint32_t msg_off;						/* Offset of the next message to process */
+	uint8_t msg_type;						/* Type of the last received message */
+	uint8_t msg_sect;						/* Frame section of the last cap message */
+	uint16_t msg_seq;						/* Seq no. of the last cap message */
+	int trace_pending;						/* PRU trace events left or -1 */
+	unsigned int frm_flags;					/* RPMSG_CAM_F_* frame policy flags */
+	uint8_t *ref_buf;						/* Latest data received at each frame offset */
+	int ref_valid;							/* The whole image is covered by ref_buf */
+	uint8_t *ref_sects;						/* Sections of ref_buf already received */
+	uint32_t ref_missing;					/* Sections of ref_buf not yet received */
 	int ep_fd;								/* Epoll file descriptor */
 	struct epoll_event ep_evs[EP_MAX_EVENTS]; /* Epoll event list */
+	int frm_ep_fd;							/* Epoll fd for frame ring events */
+	uint8_t *frm_ring;						/* Mapped driver frame ring */
+	uint32_t frm_ring_len;					/* Frame ring mapping size */
+	uint32_t frm_slot_size;					/* Offset between frame ring slots */
+	uint8_t xfer_mode;						/* Member of enum bcam_xfer_mode */
+	int ring_disabled;						/* Frame ring not to be used */
+	int ddr_disabled;						/* DDR frame ring rejected by PRU */
+	uint8_t log_level;						/* Level of the last PRU log message */
+	struct bcam_cap_config cap_cfg;			/* Last capture config sent to PRU */
+	struct rpmsg_rec *rec;					/* Recording of the received messages */
+	struct rpmsg_replay *replay;			/* Replay emulating the RPMsg device */
 };
 
 /*
- * Reads a PRU cap frame message having the expected sequence number.
- * Additionally, receives INFO and LOG messages.
- * The caller can access the message content via data and len parameters.
+ * Opens the RPMsg device, waiting for the device node to be created, if
+ * necessary. The parent directory is watched via inotify, hence the node is
+ * opened as soon as it appears, without polling.
  *
- * Returns:
- *  0: Received non-frame message, to be ignored
- * >0: Valid frame section: BCAM_FRM_START, BCAM_FRM_BODY or BCAM_FRM_END
- * -1: Read error
- * -2: Invalid frame section, need to discard current frame
- * -3: Unexpected sequence number
+ * Returns the device file descriptor on success or -1 on error.
  */
-static int rpmsg_cam_read_msg(struct rpmsg_cam_handle *h, int exp_seq,
-							  int *len, uint8_t **data)
+static int rpmsg_cam_open_dev(const char *dev_path, int tmout_msec)
 {
-	struct bcam_pru_msg* msg = (struct bcam_pru_msg*)h->rpmsg_buf;
-	int ret;
+	char dir_path[PATH_MAX];
+	char ev_buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	struct timespec start, now;
+	struct pollfd pfd;
+	int fd, ino_fd, elapsed;
+
+	fd = open(dev_path, O_RDWR);
+	if (fd >= 0 || errno != ENOENT)
+		goto out;
+
+	log_info("Waiting for device: %s", dev_path);
+
+	strncpy(dir_path, dev_path, sizeof(dir_path) - 1);
+	dir_path[sizeof(dir_path) - 1] = 0;
+
+	ino_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (ino_fd < 0) {
+		log_error("Failed to init inotify: %s", strerror(errno));
+		return -1;
+	}
+
+	if (inotify_add_watch(ino_fd, dirname(dir_path), IN_CREATE | IN_ATTRIB) < 0) {
+		log_error("Failed to watch %s: %s", dir_path, strerror(errno));
+		close(ino_fd);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pfd.fd = ino_fd;
+	pfd.events = POLLIN;
+
+	while (1) {
+		/* The node might have been created before adding the watch */
+		fd = open(dev_path, O_RDWR);
+		if (fd >= 0 || errno != ENOENT)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+				  (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (elapsed >= tmout_msec)
+			break;
+
+		if (poll(&pfd, 1, tmout_msec - elapsed) < 0 && errno != EINTR) {
+			log_error("Failed to poll inotify: %s", strerror(errno));
+			break;
+		}
+
+		/* Drain the events, just retry opening the device */
+		while (read(ino_fd, ev_buf, sizeof(ev_buf)) > 0)
+			;
+	}
+
+	close(ino_fd);
+
+out:
+	if (fd < 0)
+		log_error("Failed to open %s: %s", dev_path, strerror(errno));
+
+	return fd;
+}
+
+/*
+ * Appends the messages just received to the recording.
+ */
+static void rpmsg_cam_record_msgs(struct rpmsg_cam_handle *h)
+{
+	unsigned long long now = lat_get_time_usec();
+	uint32_t i, off = 0;
+
+	for (i = 0; i < h->msg_cnt; i++) {
+		if (rpmsg_rec_write(h->rec, h->rpmsg_buf + off, h->msg_lens[i], now) != 0) {
+			/* Stop recording, rather than failing the capture */
+			rpmsg_rec_close(h->rec);
+			h->rec = NULL;
+			return;
+		}
+		off += h->msg_lens[i];
+	}
+}
+
+/*
+ * Waits for RPMsg messages and receives all of them at once in rpmsg_buf,
+ * if supported by the driver, or just one message otherwise.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int rpmsg_cam_recv_msgs(struct rpmsg_cam_handle *h)
+{
+	struct rpmsgcam_msg_batch batch;
+	int ret, len;
 
 	log_trace("RPMSg start reading msg");
 
@@ -67,42 +210,197 @@ static int rpmsg_cam_read_msg(struct rpmsg_cam_handle *h, int exp_seq,
 		return -1;
 	}
 
-	*len = read(h->ep_evs[0].data.fd, h->rpmsg_buf, RPMSG_MESSAGE_SIZE);
-	if (*len < 0) {
+	h->msg_idx = 0;
+	h->msg_off = 0;
+
+	if (h->rpmsg_batch != 0) {
+		memset(&batch, 0, sizeof(batch));
+		batch.buf = (uintptr_t)h->rpmsg_buf;
+		batch.lens = (uintptr_t)h->msg_lens;
+		batch.buf_len = sizeof(h->rpmsg_buf);
+		batch.max_cnt = RPMSG_BATCH_MSGS;
+
+		ret = ioctl(h->ep_evs[0].data.fd, RPMSGCAM_IOC_RECV_MSGS, &batch);
+		if (ret == 0) {
+			h->msg_cnt = batch.cnt;
+			if (h->rec != NULL)
+				rpmsg_cam_record_msgs(h);
+			return 0;
+		}
+
+		if (errno != ENOTTY) {
+			log_error("RPMsg batch read error: %s", strerror(errno));
+			return -1;
+		}
+
+		log_debug("RPMsg batch read not supported");
+		h->rpmsg_batch = 0;
+	}
+
+	len = read(h->ep_evs[0].data.fd, h->rpmsg_buf, RPMSG_MESSAGE_SIZE);
+	if (len < 0) {
 		log_error("RPMsg read error: %s", strerror(errno));
 		return -1;
 	}
 
-	if (*len == 0) {
+	if (len == 0) {
 		log_debug("RPMsg empty read");
 		return -1;
 	}
 
+	h->msg_lens[0] = len;
+	h->msg_cnt = 1;
+
+	if (h->rec != NULL)
+		rpmsg_cam_record_msgs(h);
+
+	return 0;
+}
+
+/*
+ * Logs a PRU trace event. The frame edges are logged at debug level only.
+ */
+static void rpmsg_cam_log_trace_evt(const struct bcam_trace_evt *evt)
+{
+	unsigned int ts = evt->ts / BCAM_PRU_TICKS_PER_USEC;
+
+	switch (evt->id) {
+	case BCAM_TRACE_FRM_START:
+		log_write(LOG_DEBUG, "PRU", 1, "%uus: Frame start (seq=%u)", ts, evt->arg0);
+		break;
+
+	case BCAM_TRACE_FRM_END:
+		log_write(LOG_DEBUG, "PRU", 1, "%uus: Frame end (len=%u, status=%d)",
+				  ts, evt->arg1, (int16_t)evt->arg0);
+		break;
+
+	case BCAM_TRACE_FRM_INCOMPLETE:
+		log_write(LOG_WARN, "PRU", 1, "%uus: Incomplete frame from PRU0 (line=%u, len=%u)",
+				  ts, evt->arg0, evt->arg1);
+		break;
+
+	case BCAM_TRACE_SEQ_GAP:
+		log_write(LOG_WARN, "PRU", 1, "%uus: Unexpected seq from PRU0: %u instead of %u",
+				  ts, (uint16_t)evt->arg1, evt->arg0);
+		break;
+
+	case BCAM_TRACE_LINE_OVERRUN:
+		log_write(LOG_WARN, "PRU", 1, "%uus: PRU0 exceeded the line cycle budget (line=%u)",
+				  ts, evt->arg0);
+		break;
+
+	case BCAM_TRACE_LINE_ERR:
+		log_write(LOG_WARN, "PRU", 1, "%uus: Unexpected line size from PRU0 (line=%u, len=%u)",
+				  ts, evt->arg0, evt->arg1);
+		break;
+
+	case BCAM_TRACE_PRU0_TMOUT:
+		log_write(LOG_ERROR, "PRU", 1, "%uus: Timeout receiving data from PRU0 (line=%u)",
+				  ts, evt->arg0);
+		break;
+
+	case BCAM_TRACE_VRING_BUSY:
+		log_write(LOG_WARN, "PRU", 1, "%uus: No vring buffer available (cap seq=%u)",
+				  ts, evt->arg0);
+		break;
+
+	case BCAM_TRACE_SEND_ERR:
+		log_write(LOG_ERROR, "PRU", 1, "%uus: Failed to send cap data (sect=%u, status=%d)",
+				  ts, evt->arg0, (int16_t)evt->arg1);
+		break;
+
+	case BCAM_TRACE_SLOTS_BUSY:
+		log_write(LOG_WARN, "PRU", 1, "%uus: DDR frame ring slots busy, frame skipped (seq=%u)",
+				  ts, evt->arg0);
+		break;
+
+	default:
+		log_write(LOG_WARN, "PRU", 1, "%uus: Unknown trace event %u (%u, %u)",
+				  ts, evt->id, evt->arg0, evt->arg1);
+	}
+}
+
+/*
+ * Reads a PRU cap frame message having the expected sequence number.
+ * Additionally, receives INFO, LOG and TRACE messages.
+ * The caller can access the message content via data and len parameters.
+ *
+ * The section and the sequence number of a cap message are also stored in
+ * msg_sect and msg_seq, allowing the caller to recover from the errors.
+ *
+ * Returns:
+ *  0: Received non-frame message, to be ignored
+ * >0: Valid frame section: BCAM_FRM_START, BCAM_FRM_BODY or BCAM_FRM_END
+ * -1: Read error
+ * -2: Invalid frame section, need to discard current frame
+ * -3: Unexpected sequence number
+ */
+static int rpmsg_cam_read_msg(struct rpmsg_cam_handle *h, int exp_seq,
+							  int *len, uint8_t **data)
+{
+	struct bcam_pru_msg* msg;
+	uint8_t *buf;
+	int ret;
+
+	/* The section refers to the current message only, i.e. none on errors */
+	h->msg_sect = BCAM_FRM_NONE;
+
+	/* Process the messages already received before waiting for new ones */
+	if (h->msg_idx >= h->msg_cnt) {
+		ret = rpmsg_cam_recv_msgs(h);
+		if (ret != 0)
+			return ret;
+	}
+
+	buf = h->rpmsg_buf + h->msg_off;
+	msg = (struct bcam_pru_msg *)buf;
+	*len = h->msg_lens[h->msg_idx];
+
+	h->msg_off += *len;
+	h->msg_idx++;
+	h->msg_type = msg->type;
+
 	log_trace("RPMSg end reading msg: type=%d, len=%d", msg->type, *len);
-	log_hexdump(h->rpmsg_buf, *len, 16, 8);
+	if (LOG_ENABLED(LOG_TRACE))
+		log_hexdump(buf, *len, 16, 8);
 
 	switch (msg->type) {
 	case BCAM_PRU_MSG_INFO:
-		*len -= msg->info_hdr.data - h->rpmsg_buf;
+		*len -= msg->info_hdr.data - buf;
 		*data = msg->info_hdr.data;
 		return 0;
 
 	case BCAM_PRU_MSG_LOG:
-		*len -= msg->log_hdr.data - h->rpmsg_buf;
+		*len -= msg->log_hdr.data - buf;
 		*data = msg->log_hdr.data;
+		h->log_level = msg->log_hdr.level;
 		log_write(msg->log_hdr.level, "PRU", 1, "%.*s", *len, *data);
 		return 0;
 
+	case BCAM_PRU_MSG_TRACE:
+		*len -= msg->trace_hdr.data - buf;
+		*data = msg->trace_hdr.data;
+		if (msg->trace_hdr.lost != 0)
+			log_warn("Lost %u PRU trace events", msg->trace_hdr.lost);
+		for (ret = 0; ret + sizeof(struct bcam_trace_evt) <= *len;
+			 ret += sizeof(struct bcam_trace_evt))
+			rpmsg_cam_log_trace_evt((const struct bcam_trace_evt *)(*data + ret));
+		h->trace_pending = msg->trace_hdr.pending;
+		return 0;
+
 	case BCAM_PRU_MSG_CAP:
-		*len -= msg->cap_hdr.data - h->rpmsg_buf;
+		*len -= msg->cap_hdr.data - buf;
 		*data = msg->cap_hdr.data;
+		h->msg_sect = msg->cap_hdr.frm;
+		h->msg_seq = msg->cap_hdr.seq;
 		if (msg->cap_hdr.frm == BCAM_FRM_NONE)
 			return 0;
 		if (msg->cap_hdr.frm >= BCAM_FRM_INVALID) {
 			log_trace("Received invalid frame section");
 			return -2;
 		}
-		if (msg->cap_hdr.seq != exp_seq) {
+		/* A new frame can start at any time */
+		if (msg->cap_hdr.frm != BCAM_FRM_START && msg->cap_hdr.seq != exp_seq) {
 			log_trace("Received unexpected RPMsg cap seq: %d instead of %d",
 					  msg->cap_hdr.seq, exp_seq);
 			return -3;
@@ -157,6 +455,272 @@ static int rpmsg_cam_send_cmd(struct rpmsg_cam_handle *h, enum bcam_arm_msg_type
 	return ret;
 }
 
+/*
+ * Disables the driver frame ring, hence the frames are sent again via
+ * the capture messages.
+ */
+static void rpmsg_cam_disable_ring(struct rpmsg_cam_handle *h)
+{
+	struct rpmsgcam_ring_config cfg;
+
+	memset(&cfg, 0, sizeof(cfg));
+	ioctl(h->rpmsg_fd, RPMSGCAM_IOC_SETUP_RING, &cfg);
+}
+
+/*
+ * Enables the driver frame ring, allowing frames to be accessed without
+ * copying the content of the capture messages. The DDR frame ring is
+ * preferred, if available, in which case PRU writes the frames directly
+ * in the ring slots.
+ *
+ * Returns 0 on success or -1 if the ring is not available, in which case the
+ * frames are reassembled from the messages read from the RPMsg device.
+ */
+static int rpmsg_cam_setup_ring(struct rpmsg_cam_handle *h)
+{
+	struct rpmsgcam_ring_config cfg;
+	struct epoll_event ev;
+	int ret;
+
+	/* Frames are sent via the capture messages, unless the DDR ring is used */
+	h->xfer_mode = BCAM_XFER_RPMSG;
+
+	cfg.frame_size = h->img_sz;
+	cfg.slot_cnt = FRAME_RING_SLOTS;
+	cfg.flags = h->ddr_disabled ? 0 : RPMSGCAM_RING_F_DDR;
+
+	ret = ioctl(h->rpmsg_fd, RPMSGCAM_IOC_SETUP_RING, &cfg);
+	if (ret != 0) {
+		log_warn("Frame ring not available: %s", strerror(errno));
+		return -1;
+	}
+
+	h->frm_ring_len = cfg.slot_cnt * cfg.slot_size;
+	h->frm_slot_size = cfg.slot_size;
+	h->frm_ring = mmap(NULL, h->frm_ring_len, PROT_READ, MAP_SHARED, h->rpmsg_fd, 0);
+	if (h->frm_ring == MAP_FAILED) {
+		log_error("Failed to map frame ring: %s", strerror(errno));
+		goto err_disable;
+	}
+
+	h->frm_ep_fd = epoll_create1(0);
+	if (h->frm_ep_fd < 0) {
+		log_error("epoll_create failed: %s", strerror(errno));
+		goto err_unmap;
+	}
+
+	/* Frame ring events are signaled via POLLPRI */
+	ev.data.fd = h->rpmsg_fd;
+	ev.events = EPOLLIN | EPOLLPRI;
+	ret = epoll_ctl(h->frm_ep_fd, EPOLL_CTL_ADD, h->rpmsg_fd, &ev);
+	if (ret != 0) {
+		log_error("epoll_ctl failed: %s", strerror(errno));
+		goto err_close;
+	}
+
+	/* The driver clears RPMSGCAM_RING_F_DDR when the DDR ring is missing */
+	h->xfer_mode = (cfg.flags & RPMSGCAM_RING_F_DDR) ? BCAM_XFER_DDR : BCAM_XFER_RPMSG;
+
+	log_debug("Mapped %s frame ring: %u x %u bytes",
+			  h->xfer_mode == BCAM_XFER_DDR ? "DDR" : "driver",
+			  cfg.slot_cnt, cfg.slot_size);
+	return 0;
+
+err_close:
+	close(h->frm_ep_fd);
+	h->frm_ep_fd = -1;
+err_unmap:
+	munmap(h->frm_ring, h->frm_ring_len);
+err_disable:
+	h->frm_ring = NULL;
+	rpmsg_cam_disable_ring(h);
+	return -1;
+}
+
+/*
+ * Unmaps the driver frame ring, if any. The ring itself is released by the
+ * driver when closing the RPMsg device or reallocated by a subsequent
+ * rpmsg_cam_setup_ring() call.
+ */
+static void rpmsg_cam_release_ring(struct rpmsg_cam_handle *h)
+{
+	int ret;
+
+	if (h->frm_ring != NULL) {
+		ret = munmap(h->frm_ring, h->frm_ring_len);
+		if (ret != 0)
+			log_error("Failed to unmap frame ring: %s", strerror(errno));
+		h->frm_ring = NULL;
+	}
+
+	if (h->frm_ep_fd >= 0) {
+		ret = close(h->frm_ep_fd);
+		if (ret != 0)
+			log_error("Failed to close epoll descriptor: %s", strerror(errno));
+		h->frm_ep_fd = -1;
+	}
+
+	h->xfer_mode = BCAM_XFER_RPMSG;
+}
+
+/*
+ * Computes the size of the images captured from a xres x yres camera image,
+ * given the optional region of interest and decimation.
+ *
+ * Returns 0 on success or -1 if the ROI doesn't fit the camera image.
+ */
+int rpmsg_cam_get_img_size(int xres, int yres, const struct rpmsg_cam_roi *roi,
+						   int *img_xres, int *img_yres)
+{
+	int roi_w = xres, roi_h = yres;
+
+	if (roi != NULL) {
+		if (roi->width != 0)
+			roi_w = roi->width;
+		if (roi->height != 0)
+			roi_h = roi->height;
+
+		if (roi->x < 0 || roi->y < 0 || roi_w <= 0 || roi_h <= 0 ||
+			roi->dec_x < 0 || roi->dec_x > 0xff || roi->dec_y < 0 || roi->dec_y > 0xff ||
+			roi->x + roi_w > xres || roi->y + roi_h > yres) {
+			log_error("ROI %d,%d %dx%d doesn't fit %dx%d image",
+					  roi->x, roi->y, roi_w, roi_h, xres, yres);
+			return -1;
+		}
+
+		roi_w = BCAM_DEC_LEN(roi_w, roi->dec_x);
+		roi_h = BCAM_DEC_LEN(roi_h, roi->dec_y);
+	}
+
+	*img_xres = roi_w;
+	*img_yres = roi_h;
+	return 0;
+}
+
+/*
+ * Stores the camera resolution and the ROI in the handle, computing the
+ * resulting image size.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int rpmsg_cam_set_size(struct rpmsg_cam_handle *h, int xres, int yres,
+							  const struct rpmsg_cam_roi *roi)
+{
+	int img_xres, img_yres;
+
+	if (xres <= 0 || yres <= 0 ||
+		(uint32_t)xres * yres * CAM_BPP / 8 > BCAM_FRAME_LEN_MAX) {
+		log_error("Unsupported capture resolution: %dx%d", xres, yres);
+		return -1;
+	}
+
+	if (rpmsg_cam_get_img_size(xres, yres, roi, &img_xres, &img_yres) != 0)
+		return -1;
+
+	h->cam_xres = xres;
+	h->cam_yres = yres;
+	h->img_xres = img_xres;
+	h->img_yres = img_yres;
+
+	if (roi != NULL)
+		h->roi = *roi;
+	else
+		memset(&h->roi, 0, sizeof(h->roi));
+
+	return 0;
+}
+
+/*
+ * (Re)allocates the buffer holding the latest frame data, used to patch the
+ * partial frames, according to the current image size.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int rpmsg_cam_alloc_ref(struct rpmsg_cam_handle *h)
+{
+	free(h->ref_buf);
+	free(h->ref_sects);
+	h->ref_buf = NULL;
+	h->ref_sects = NULL;
+	h->ref_valid = 0;
+
+	if ((h->frm_flags & RPMSG_CAM_F_PATCH_PARTIAL) == 0)
+		return 0;
+
+	/* The sections might come from different frames, e.g. under heavy loss */
+	h->ref_missing = (h->img_sz + RPMSG_SECT_DATA_SIZE - 1) / RPMSG_SECT_DATA_SIZE;
+	h->ref_buf = malloc(h->img_sz);
+	h->ref_sects = calloc(h->ref_missing, 1);
+	if (h->ref_buf == NULL || h->ref_sects == NULL) {
+		log_error("Not enough memory for the partial frames buffer");
+		free(h->ref_buf);
+		h->ref_buf = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sets up the frame ring, if available, and sends the capture configuration
+ * to PRU, according to the image size stored in the handle.
+ */
+static int rpmsg_cam_setup_capture(struct rpmsg_cam_handle *h)
+{
+	static const uint8_t bcam_pix_fmts[] = {
+		[RPMSG_CAM_PIX_FMT_RGB565] = BCAM_PIX_FMT_RGB565,
+		[RPMSG_CAM_PIX_FMT_GRAY8] = BCAM_PIX_FMT_Y8,
+		[RPMSG_CAM_PIX_FMT_RGB332] = BCAM_PIX_FMT_RGB332,
+	};
+	struct bcam_cap_config setup_data;
+	int ret;
+
+	h->img_sz = h->img_xres * h->img_yres * h->img_bpp / 8;
+
+	if (rpmsg_cam_alloc_ref(h) != 0)
+		return -1;
+
+	/* The frame transfer mode must be known before setting up the capture */
+	if (h->ring_disabled == 0)
+		rpmsg_cam_setup_ring(h);
+
+	setup_data.xres = h->cam_xres;
+	setup_data.yres = h->cam_yres;
+	setup_data.bpp = CAM_BPP;
+	setup_data.test_mode = h->test_mode;
+	setup_data.test_pclk_mhz = h->test_pclk_mhz;
+	setup_data.xfer_mode = h->xfer_mode;
+	setup_data.roi_x = h->roi.x;
+	setup_data.roi_y = h->roi.y;
+	setup_data.roi_w = h->roi.width;
+	setup_data.roi_h = h->roi.height;
+	setup_data.dec_x = h->roi.dec_x;
+	setup_data.dec_y = h->roi.dec_y;
+	setup_data.pix_fmt = bcam_pix_fmts[h->pix_fmt];
+	h->cap_cfg = setup_data;
+
+	h->log_level = BCAM_PRU_LOG_INFO;
+	ret = rpmsg_cam_send_cmd(h, BCAM_ARM_MSG_CAP_SETUP, &setup_data, sizeof(setup_data));
+	if (ret != 0 || h->xfer_mode != BCAM_XFER_DDR || h->log_level > BCAM_PRU_LOG_ERROR)
+		return ret;
+
+	/*
+	 * PRU has no access to the DDR frame ring, e.g. the carveout is missing
+	 * from its resource table, hence fall back to the RPMsg transfer for the
+	 * rest of the session.
+	 */
+	log_warn("DDR frame transfer rejected by PRU, falling back to RPMsg");
+	h->ddr_disabled = 1;
+	rpmsg_cam_release_ring(h);
+	if (rpmsg_cam_setup_ring(h) != 0)
+		rpmsg_cam_disable_ring(h);
+
+	setup_data.xfer_mode = h->xfer_mode;
+	h->cap_cfg = setup_data;
+
+	return rpmsg_cam_send_cmd(h, BCAM_ARM_MSG_CAP_SETUP, &setup_data, sizeof(setup_data));
+}
+
 /*
  * Starts capturing frames via PRU.
  *
@@ -165,12 +729,18 @@ static int rpmsg_cam_send_cmd(struct rpmsg_cam_handle *h, enum bcam_arm_msg_type
  */
 rpmsg_cam_handle_t rpmsg_cam_init(const char *rpmsg_dev_path,
 								  int xres, int yres,
+								  const struct rpmsg_cam_roi *roi,
+								  enum rpmsg_cam_pix_fmt pix_fmt,
 								  int test_mode, int test_pclk_mhz)
 {
-	struct bcam_cap_config setup_data;
 	struct rpmsg_cam_handle *h;
 	struct epoll_event ev;
-	int i, ret;
+	int ret;
+
+	if (pix_fmt < RPMSG_CAM_PIX_FMT_RGB565 || pix_fmt > RPMSG_CAM_PIX_FMT_RGB332) {
+		log_error("Unsupported pixel format: %d", pix_fmt);
+		return NULL;
+	}
 
 	h = malloc(sizeof(*h));
 	if (h == NULL) {
@@ -178,22 +748,41 @@ rpmsg_cam_handle_t rpmsg_cam_init(const char *rpmsg_dev_path,
 		return NULL;
 	}
 
-	/* RPMsg device might not be ready, let's keep trying for up to 3000 ms */
-	for (i = 0;; i++) {
-		h->rpmsg_fd = open(rpmsg_dev_path, O_RDWR);
-		if (h->rpmsg_fd >= 0)
-			break;
-
-		if (errno != ENOENT || i == 3000) {
-			log_error("Failed to open %s: %s", rpmsg_dev_path, strerror(errno));
+	h->ep_fd = -1;
+	h->frm_ep_fd = -1;
+	h->frm_ring = NULL;
+	h->xfer_mode = BCAM_XFER_RPMSG;
+	h->rpmsg_batch = 1;
+	h->msg_cnt = 0;
+	h->msg_idx = 0;
+	h->frm_flags = 0;
+	h->ref_buf = NULL;
+	h->ref_valid = 0;
+	h->ref_sects = NULL;
+	h->rec = NULL;
+	h->replay = NULL;
+	h->ring_disabled = 0;
+	h->ddr_disabled = 0;
+	h->log_level = BCAM_PRU_LOG_INFO;
+
+	if (rpmsg_replay_is_rec(rpmsg_dev_path)) {
+		/* The recorded frames are only available as capture messages */
+		h->replay = rpmsg_replay_open(rpmsg_dev_path);
+		if (h->replay == NULL) {
 			free(h);
 			return NULL;
 		}
 
-		if (i == 0)
-			log_info("Waiting for device: %s", rpmsg_dev_path);
-
-		usleep(1000);
+		h->rpmsg_fd = rpmsg_replay_get_fd(h->replay);
+		h->rpmsg_batch = 0;
+		h->ring_disabled = 1;
+	} else {
+		/* RPMsg device might not be ready yet */
+		h->rpmsg_fd = rpmsg_cam_open_dev(rpmsg_dev_path, RPMSG_DEV_TMOUT_MSEC);
+		if (h->rpmsg_fd < 0) {
+			free(h);
+			return NULL;
+		}
 	}
 
 	h->ep_fd = epoll_create1(0);
@@ -214,24 +803,20 @@ rpmsg_cam_handle_t rpmsg_cam_init(const char *rpmsg_dev_path,
 		return NULL;
 	}
 
-	setup_data.xres = xres;
-	setup_data.yres = yres;
-	setup_data.bpp = DEFAULT_IMG_BPP;
-	setup_data.test_mode = test_mode;
-	setup_data.test_pclk_mhz = test_pclk_mhz;
+	h->pix_fmt = pix_fmt;
+	h->img_bpp = (pix_fmt == RPMSG_CAM_PIX_FMT_RGB565 ? 16 : 8);
+	h->frame_cnt = 0;
+	h->test_mode = test_mode;
+	h->test_pclk_mhz = test_pclk_mhz;
 
-	ret = rpmsg_cam_send_cmd(h, BCAM_ARM_MSG_CAP_SETUP, &setup_data, sizeof(setup_data));
+	ret = rpmsg_cam_set_size(h, xres, yres, roi);
+	if (ret == 0)
+		ret = rpmsg_cam_setup_capture(h);
 	if (ret != 0) {
 		rpmsg_cam_release(h);
 		return NULL;
 	}
 
-	h->img_xres = setup_data.xres;
-	h->img_yres = setup_data.yres;
-	h->img_bpp = setup_data.bpp;
-	h->img_sz = h->img_xres * h->img_yres * h->img_bpp / 8;
-	h->frame_cnt = 0;
-
 	return h;
 }
 
@@ -251,6 +836,123 @@ int rpmsg_cam_stop(rpmsg_cam_handle_t handle)
 	return rpmsg_cam_send_cmd(handle, BCAM_ARM_MSG_CAP_STOP, NULL, 0);
 }
 
+/*
+ * Changes the capture resolution and the optional ROI without reopening the
+ * RPMsg device, i.e. stops the capture, reallocates the frame ring for the
+ * new image size and sends the new capture configuration to PRU.
+ *
+ * All frames must be freed before, since they are sized according to the
+ * previous image size and may point to the frame ring being released.
+ * On success, the capture is resumed via rpmsg_cam_start(), once the frames
+ * have been reallocated via rpmsg_cam_alloc_frame().
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int rpmsg_cam_reconfigure(rpmsg_cam_handle_t handle, int xres, int yres,
+						  const struct rpmsg_cam_roi *roi)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)handle;
+	int img_xres, img_yres, len, ret;
+	uint8_t *data;
+
+	if (h == NULL)
+		return -1;
+
+	/* Validate before stopping the capture */
+	if (rpmsg_cam_get_img_size(xres, yres, roi, &img_xres, &img_yres) != 0)
+		return -1;
+
+	ret = rpmsg_cam_stop(handle);
+
+	/*
+	 * The cap messages of the previous configuration are discarded up to
+	 * the stop reply, which is a PRU log message, unlike the trace or info
+	 * messages possibly returned by rpmsg_cam_stop().
+	 */
+	while (ret != -1 && (ret != 0 || h->msg_type != BCAM_PRU_MSG_LOG))
+		ret = rpmsg_cam_read_msg(h, 0, &len, &data);
+	if (ret != 0)
+		return -1;
+
+	/* Nothing else is sent by PRU once the capture is stopped */
+	h->msg_cnt = 0;
+	h->msg_idx = 0;
+
+	rpmsg_cam_release_ring(h);
+
+	ret = rpmsg_cam_set_size(h, xres, yres, roi);
+	if (ret == 0)
+		ret = rpmsg_cam_setup_capture(h);
+	if (ret != 0)
+		return -1;
+
+	if (h->rec != NULL)
+		log_warn("The recording keeps the initial capture configuration only");
+
+	log_info("Reconfigured capture for %dx%d frames (%dx%d camera image)",
+			 h->img_xres, h->img_yres, xres, yres);
+	return 0;
+}
+
+/*
+ * Records the messages received from PRU to the given file, to be replayed
+ * later by passing the file as the RPMsg device path to rpmsg_cam_init().
+ *
+ * Since the driver frame ring consumes the capture messages, it is disabled
+ * for the rest of the session, i.e. the capture is set up again. Hence this
+ * must be called before starting the capture and allocating the frames.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int rpmsg_cam_record(rpmsg_cam_handle_t handle, const char *rec_path)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)handle;
+
+	if (h == NULL || h->rec != NULL)
+		return -1;
+
+	h->ring_disabled = 1;
+
+	if (h->frm_ring != NULL) {
+		rpmsg_cam_release_ring(h);
+		rpmsg_cam_disable_ring(h);
+
+		if (rpmsg_cam_setup_capture(h) != 0)
+			return -1;
+	}
+
+	h->rec = rpmsg_rec_open(rec_path, &h->cap_cfg, RPMSG_MESSAGE_SIZE);
+
+	return h->rec != NULL ? 0 : -1;
+}
+
+/*
+ * Sets the policy for the frames received via RPMsg messages, i.e. without
+ * the driver frame ring:
+ *
+ * RPMSG_CAM_F_VERIFY_CSUM: the frames are validated against the checksum
+ * provided by PRU in the frame trailer, at the cost of an extra pass over
+ * the frame data.
+ *
+ * RPMSG_CAM_F_PATCH_PARTIAL: instead of discarding the frames with missing
+ * sections, e.g. due to kernel fifo overflows, or discarded by PRU midway,
+ * the missing data is taken from the previous frames. Such frames are
+ * reported via the patched frame attribute and cannot be checksum verified.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int rpmsg_cam_set_frame_policy(rpmsg_cam_handle_t handle, unsigned int flags)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)handle;
+
+	if (h == NULL)
+		return -1;
+
+	h->frm_flags = flags;
+
+	return rpmsg_cam_alloc_ref(h);
+}
+
 /*
  * Releases the internal state memory.
  */
@@ -262,6 +964,11 @@ int rpmsg_cam_release(rpmsg_cam_handle_t handle)
 	if (h == NULL)
 		return 0;
 
+	rpmsg_cam_release_ring(h);
+	rpmsg_rec_close(h->rec);
+	free(h->ref_buf);
+	free(h->ref_sects);
+
 	if (h->ep_fd >= 0) {
 		ret = epoll_ctl(h->ep_fd, EPOLL_CTL_DEL, h->rpmsg_fd, NULL);
 		if (ret != 0)
@@ -272,18 +979,234 @@ int rpmsg_cam_release(rpmsg_cam_handle_t handle)
 			log_error("Failed to close epoll descriptor: %s", strerror(errno));
 	}
 
-	ret = close(h->rpmsg_fd);
-	if (ret != 0)
-		log_error("Failed to close RPMsg descriptor: %s", strerror(errno));
+	if (h->replay != NULL) {
+		rpmsg_replay_close(h->replay);
+		ret = 0;
+	} else {
+		ret = close(h->rpmsg_fd);
+		if (ret != 0)
+			log_error("Failed to close RPMsg descriptor: %s", strerror(errno));
+	}
 
 	free(h);
 	return ret;
 }
 
+/*
+ * Allocates a frame linked to the given handle. The local image buffer is
+ * omitted when the frames are provided by the driver frame ring or when
+ * local_buf is 0, i.e. the caller always provides a frame target.
+ *
+ * Returns the frame on success or NULL on error.
+ */
+struct rpmsg_cam_frame *rpmsg_cam_alloc_frame(rpmsg_cam_handle_t handle, int local_buf)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)handle;
+	struct rpmsg_cam_frame *frame;
+	uint32_t buf_len;
+
+	buf_len = (h->frm_ring != NULL || local_buf == 0 ? 0 : h->img_sz);
+
+	frame = malloc(sizeof(*frame) + buf_len);
+	if (frame == NULL) {
+		log_error("Failed to allocate frame: %s", strerror(errno));
+		return NULL;
+	}
+
+	frame->handle = handle;
+	frame->seq = 0;
+	frame->slot = -1;
+	frame->pixels = NULL;
+	frame->stride = h->img_xres * h->img_bpp / 8;
+	frame->target = NULL;
+	frame->target_stride = 0;
+	frame->patched = 0;
+	frame->pru_dropped = 0;
+	frame->buf_len = buf_len;
+
+	return frame;
+}
+
+/*
+ * Releases a frame allocated via rpmsg_cam_alloc_frame(), including the
+ * driver frame ring slot it may still hold.
+ */
+void rpmsg_cam_free_frame(struct rpmsg_cam_frame *frame)
+{
+	if (frame == NULL)
+		return;
+
+	rpmsg_cam_put_frame(frame);
+	free(frame);
+}
+
+/*
+ * Gets the next frame completed in the driver frame ring, while still
+ * processing the INFO and LOG messages.
+ */
+static int rpmsg_cam_get_ring_frame(struct rpmsg_cam_handle *h,
+									struct rpmsg_cam_frame *frame)
+{
+	struct rpmsgcam_frame_desc desc;
+	struct epoll_event ev;
+	int ret, data_len;
+	uint8_t *data;
+
+	while (1) {
+		ret = epoll_wait(h->frm_ep_fd, &ev, 1, EP_TIMEOUT_MSEC);
+		if (ret < 0) {
+			log_error("RPMsg epoll error: %s", strerror(errno));
+			return -1;
+		}
+		if (ret == 0) {
+			log_error("RPMsg frame timeout");
+			return -1;
+		}
+
+		if (ev.events & EPOLLPRI)
+			break;
+
+		/* Process all pending INFO and LOG messages */
+		do {
+			ret = rpmsg_cam_read_msg(h, 0, &data_len, &data);
+			if (ret == -1)
+				return ret;
+		} while (h->msg_idx < h->msg_cnt);
+	}
+
+	ret = ioctl(h->rpmsg_fd, RPMSGCAM_IOC_DQBUF, &desc);
+	if (ret != 0) {
+		log_error("Failed to dequeue frame: %s", strerror(errno));
+		return -1;
+	}
+
+	log_debug("Dequeued frame slot %u (seq=%u, len=%u)", desc.index, desc.seq, desc.len);
+
+	frame->slot = desc.index;
+	frame->pixels = h->frm_ring + desc.index * h->frm_slot_size;
+	frame->stride = h->img_xres * h->img_bpp / 8;
+	frame->seq = h->frame_cnt++;
+	frame->pru_time = 0;
+	frame->recv_start = lat_get_time_usec();
+	frame->recv_end = frame->recv_start;
+
+	return 0;
+}
+
+/*
+ * Stores len bytes of image data at offset off in the frame content,
+ * taking into account the frame stride.
+ */
+static void rpmsg_cam_store_data(struct rpmsg_cam_handle *h, struct rpmsg_cam_frame *frame,
+								 uint32_t off, const uint8_t *data, uint32_t len)
+{
+	uint32_t line_sz = h->img_xres * h->img_bpp / 8;
+	uint32_t line, col, chunk;
+
+	if (frame->stride == line_sz) {
+		memcpy(frame->pixels + off, data, len);
+		return;
+	}
+
+	line = off / line_sz;
+	col = off % line_sz;
+
+	while (len > 0) {
+		chunk = line_sz - col;
+		if (chunk > len)
+			chunk = len;
+
+		memcpy(frame->pixels + line * frame->stride + col, data, chunk);
+		data += chunk;
+		len -= chunk;
+		line++;
+		col = 0;
+	}
+}
+
+/*
+ * Stores frame data like rpmsg_cam_store_data(), also keeping a copy for
+ * patching the subsequent partial frames, if enabled.
+ */
+static void rpmsg_cam_put_data(struct rpmsg_cam_handle *h, struct rpmsg_cam_frame *frame,
+							   uint32_t off, const uint8_t *data, uint32_t len)
+{
+	uint32_t sect, end;
+
+	rpmsg_cam_store_data(h, frame, off, data, len);
+
+	if (h->ref_buf == NULL)
+		return;
+
+	memcpy(h->ref_buf + off, data, len);
+
+	if (h->ref_valid != 0)
+		return;
+
+	/* Account the sections fully covered, the last one is usually shorter */
+	sect = (off + RPMSG_SECT_DATA_SIZE - 1) / RPMSG_SECT_DATA_SIZE;
+	end = (off + len == h->img_sz ? h->img_sz + RPMSG_SECT_DATA_SIZE - 1 : off + len) /
+		RPMSG_SECT_DATA_SIZE;
+
+	for (; sect < end; sect++) {
+		if (h->ref_sects[sect] == 0) {
+			h->ref_sects[sect] = 1;
+			h->ref_missing--;
+		}
+	}
+
+	h->ref_valid = (h->ref_missing == 0);
+}
+
+/*
+ * Fills len bytes of the frame content at offset off with the latest data
+ * received for the previous frames.
+ *
+ * Returns 0 on success or -1 if the partial frames are not to be patched.
+ */
+static int rpmsg_cam_patch_data(struct rpmsg_cam_handle *h, struct rpmsg_cam_frame *frame,
+								uint32_t off, uint32_t len)
+{
+	if (h->ref_buf == NULL || h->ref_valid == 0)
+		return -1;
+
+	log_debug("Patching frame data at %u (len=%u)", off, len);
+
+	rpmsg_cam_store_data(h, frame, off, h->ref_buf + off, len);
+	frame->patched += len;
+
+	return 0;
+}
+
+/*
+ * Validates the frame content against the checksum computed by PRU.
+ */
+static int rpmsg_cam_verify_csum(struct rpmsg_cam_handle *h, const struct rpmsg_cam_frame *frame,
+								 uint32_t exp_csum)
+{
+	uint32_t line_sz = h->img_xres * h->img_bpp / 8;
+	uint32_t csum = 0;
+
+	for (uint32_t y = 0; y < h->img_yres; y++)
+		csum = bcam_frm_csum(csum, frame->pixels + y * frame->stride, line_sz);
+
+	if (csum != exp_csum) {
+		log_debug("Frame checksum mismatch: 0x%08x vs. 0x%08x", csum, exp_csum);
+		return -1;
+	}
+
+	return 0;
+}
+
 /*
  * Transfers a full image frame.
- * Note the caller must set the "handle" frame attribute to point
- * to the return value of rpmsg_cam_init().
+ * Note the frame must be allocated via rpmsg_cam_alloc_frame() and, on
+ * success, given back via rpmsg_cam_put_frame() once its content is not
+ * needed.
+ *
+ * Since all frame sections but the last ones are filled with the same amount
+ * of data, the offset of a section in the frame is given by its seq no. This
+ * allows patching the missing sections, see rpmsg_cam_set_frame_policy().
  *
  * Returns:
  *  0: Successful transfer
@@ -295,8 +1218,29 @@ int rpmsg_cam_get_frame(struct rpmsg_cam_frame* frame)
 {
 	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)(frame->handle);
 	int seq = 0, cnt = 0, ret, data_len;
+	struct bcam_frm_trailer trailer = { 0 };
+	uint32_t off;
 	uint8_t *data;
 
+	if (h->frm_ring != NULL)
+		return rpmsg_cam_get_ring_frame(h, frame);
+
+	frame->slot = -1;
+	frame->patched = 0;
+	frame->pru_dropped = 0;
+	frame->pru_time = 0;
+
+	if (frame->target != NULL) {
+		frame->pixels = frame->target;
+		frame->stride = frame->target_stride;
+	} else if (frame->buf_len >= h->img_sz) {
+		frame->pixels = frame->buf;
+		frame->stride = h->img_xres * h->img_bpp / 8;
+	} else {
+		log_error("No frame target provided");
+		return -1;
+	}
+
 	log_debug("Synchronizing frame start section");
 
 	/* Keep reading RPMsg packets until receiving a "frame start" section */
@@ -310,7 +1254,8 @@ int rpmsg_cam_get_frame(struct rpmsg_cam_frame* frame)
 						  data_len, h->img_sz);
 				return -2;
 			}
-			memcpy(frame->pixels, data, data_len);
+			frame->recv_start = lat_get_time_usec();
+			rpmsg_cam_put_data(h, frame, 0, data, data_len);
 			cnt = data_len;
 			seq = 1;
 			log_debug("Received start frame section %d (len=%d)", seq, data_len);
@@ -344,37 +1289,85 @@ int rpmsg_cam_get_frame(struct rpmsg_cam_frame* frame)
 			log_debug("Received a new frame start section, reset current frame");
 			seq = 0;
 			cnt = 0;
+			frame->patched = 0;
+			frame->recv_start = lat_get_time_usec();
+			break;
+
 		case BCAM_FRM_BODY:
 		case BCAM_FRM_END:
-			if (cnt + data_len > h->img_sz) {
-				log_debug("Received frame too large: %d vs. %d bytes",
-						  cnt + data_len, h->img_sz);
-				return -2;
-			}
 			break;
 
 		case 0:
 			continue;
 
+		case -2:
+		case -3:
+			/* Sections lost or the frame discarded by PRU midway */
+			if (h->ref_buf != NULL && h->ref_valid != 0 &&
+				(ret == -3 || h->msg_sect == BCAM_FRM_INVALID) &&
+				(int)h->msg_seq >= seq) {
+				ret = h->msg_sect;
+				seq = h->msg_seq;
+				break;
+			}
+			/* fall through */
+
 		default:
 			log_debug("Aborting frame transfer at %d out of %d bytes (err=%d)",
 					  cnt, h->img_sz, ret);
 			return ret;
 		}
 
+		/* The frame end section is completed by the trailer */
+		if (ret == BCAM_FRM_END) {
+			if (data_len < sizeof(trailer) || data_len - sizeof(trailer) > h->img_sz) {
+				log_debug("Received invalid frame end section (len=%d)", data_len);
+				return -2;
+			}
+
+			data_len -= sizeof(trailer);
+			memcpy(&trailer, data + data_len, sizeof(trailer));
+			off = h->img_sz - data_len;
+		} else {
+			off = seq * RPMSG_SECT_DATA_SIZE;
+		}
+
+		if (off + data_len > h->img_sz || off < cnt) {
+			log_debug("Received unexpected frame section %d: %d bytes at %u vs. %d bytes",
+					  seq, data_len, off, h->img_sz);
+			return -2;
+		}
+
+		if (off > cnt && rpmsg_cam_patch_data(h, frame, cnt, off - cnt) != 0) {
+			log_debug("Received incomplete frame: %d out of %d bytes", cnt, h->img_sz);
+			return -2;
+		}
+
 		/* Copy message data to frame buffer */
-		memcpy(frame->pixels + cnt, data, data_len);
-		cnt += data_len;
+		rpmsg_cam_put_data(h, frame, off, data, data_len);
+		cnt = off + data_len;
 		seq++;
 
+		if (ret == BCAM_FRM_INVALID) {
+			frame->recv_end = lat_get_time_usec();
+			rpmsg_cam_patch_data(h, frame, cnt, h->img_sz - cnt);
+			log_debug("Received partial frame: %u out of %d bytes patched",
+					  frame->patched, h->img_sz);
+			frame->seq = h->frame_cnt++;
+			break;
+		}
+
 		if (ret == BCAM_FRM_END) {
-			if (cnt < h->img_sz) {
-				log_debug("Received incomplete frame: %d out of %d bytes",
-						  cnt, h->img_sz);
+			frame->recv_end = lat_get_time_usec();
+
+			if (frame->patched == 0 && (h->frm_flags & RPMSG_CAM_F_VERIFY_CSUM) &&
+				rpmsg_cam_verify_csum(h, frame, trailer.csum) != 0)
 				return -2;
-			}
 
-			log_debug("Received end frame section %d (len=%d)", seq, data_len);
+			log_debug("Received end frame section %d (len=%d, patched=%u)",
+					  seq, data_len, frame->patched);
+			frame->pru_dropped = trailer.frm_dropped;
+			frame->pru_time = trailer.cap_time / BCAM_PRU_TICKS_PER_USEC;
 			frame->seq = h->frame_cnt++;
 			break;
 		}
@@ -385,6 +1378,128 @@ int rpmsg_cam_get_frame(struct rpmsg_cam_frame* frame)
 	return 0;
 }
 
+/*
+ * Releases the driver frame ring slot holding the frame content, if any.
+ */
+int rpmsg_cam_put_frame(struct rpmsg_cam_frame* frame)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)(frame->handle);
+	struct rpmsgcam_frame_desc desc;
+	int ret;
+
+	if (frame->slot < 0)
+		return 0;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.index = frame->slot;
+	frame->slot = -1;
+
+	ret = ioctl(h->rpmsg_fd, RPMSGCAM_IOC_QBUF, &desc);
+	if (ret != 0)
+		log_error("Failed to queue frame slot %u: %s", desc.index, strerror(errno));
+
+	return ret;
+}
+
+/*
+ * Provides the RPMsg device file descriptor, allowing rpmsg_cam_get_frame()
+ * to be driven by an external event loop. The fd should be polled for both
+ * EPOLLIN and EPOLLPRI events, the latter signalling the frame ring frames.
+ */
+int rpmsg_cam_get_poll_fd(rpmsg_cam_handle_t handle)
+{
+	return ((struct rpmsg_cam_handle *)handle)->rpmsg_fd;
+}
+
+/*
+ * Provides the no. of driver frame ring slots, which might be less than
+ * requested, e.g. for the large frames in the DDR frame ring. The caller
+ * must keep less frames than slots at once, since each frame dequeued from
+ * the ring holds its slot until given back via rpmsg_cam_put_frame().
+ *
+ * Returns the no. of slots or 0 if the frame ring is not used.
+ */
+int rpmsg_cam_get_ring_slots(rpmsg_cam_handle_t handle)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)handle;
+
+	return (h->frm_ring != NULL ? h->frm_ring_len / h->frm_slot_size : 0);
+}
+
+/*
+ * Checks if there are messages already received in a batch, but not yet
+ * processed, hence not signalled anymore by the RPMsg device fd.
+ */
+int rpmsg_cam_has_pending_msgs(rpmsg_cam_handle_t handle)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)handle;
+
+	return h->frm_ring == NULL && h->msg_idx < h->msg_cnt;
+}
+
+/*
+ * Gets the events recorded in the PRU trace ring and logs them.
+ *
+ * This is meant to be called while the capture is stopped or from the
+ * thread getting the frames, since the capture messages received meanwhile
+ * are discarded, i.e. the frame being received is likely lost.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int rpmsg_cam_get_trace(rpmsg_cam_handle_t handle)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)handle;
+	int i, len, ret;
+	uint8_t *data;
+
+	if (h == NULL)
+		return -1;
+
+	for (i = 0; i < RPMSG_TRACE_REQS_MAX; i++) {
+		h->trace_pending = -1;
+
+		ret = rpmsg_cam_send_cmd(h, BCAM_ARM_MSG_GET_TRACE, NULL, 0);
+
+		/* Other messages might have been received before the response */
+		while (ret != -1 && h->trace_pending < 0)
+			ret = rpmsg_cam_read_msg(h, 0, &len, &data);
+
+		if (ret == -1) {
+			log_error("Failed to get PRU trace events");
+			return -1;
+		}
+
+		if (h->trace_pending == 0)
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Logs the driver counters, useful to tell apart the messages dropped
+ * by the kernel from the frames broken on the PRU side.
+ */
+int rpmsg_cam_log_stats(rpmsg_cam_handle_t handle)
+{
+	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)handle;
+	struct rpmsgcam_stats stats;
+
+	if (ioctl(h->rpmsg_fd, RPMSGCAM_IOC_GET_STATS, &stats) != 0) {
+		log_debug("Failed to get driver stats: %s", strerror(errno));
+		return -1;
+	}
+
+	log_info("Driver stats: msgs=%u, fifo_overflows=%u, fifo_msgs=%u, fifo_peak=%u",
+			 stats.msgs_received, stats.fifo_overflows,
+			 stats.fifo_msgs, stats.fifo_peak);
+	log_info("Driver frame stats: completed=%u, dropped=%u, broken=%u, invalid=%u",
+			 stats.frames_completed, stats.frames_dropped,
+			 stats.frames_broken, stats.frames_invalid);
+
+	return 0;
+}
+
 /*
  * Utility to write the content of a frame to a file.
  * Note the caller must set the "handle" frame attribute to point
@@ -394,6 +1509,7 @@ int rpmsg_cam_dump_frame(const struct rpmsg_cam_frame *frame,
 						 const char *file_path)
 {
 	struct rpmsg_cam_handle *h = (struct rpmsg_cam_handle *)(frame->handle);
+	uint32_t line_sz = h->img_xres * h->img_bpp / 8;
 	FILE *f;
 	int ret;
 
@@ -403,10 +1519,13 @@ int rpmsg_cam_dump_frame(const struct rpmsg_cam_frame *frame,
 		return -1;
 	}
 
-	ret = fwrite(frame->pixels, h->img_sz, 1, f);
-	if (ret != 1) {
-		log_error("Failed to dump frame: %s", strerror(errno));
-		return -1;
+	for (uint32_t y = 0; y < h->img_yres; y++) {
+		ret = fwrite(frame->pixels + y * frame->stride, line_sz, 1, f);
+		if (ret != 1) {
+			log_error("Failed to dump frame: %s", strerror(errno));
+			fclose(f);
+			return -1;
+		}
 	}
 
 	ret = fclose(f);
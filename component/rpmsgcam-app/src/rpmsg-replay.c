@@ -0,0 +1,525 @@
+/*
+ * Recording and replay of the RPMsg messages received from PRU, allowing
+ * the frame pipeline to be profiled offline, e.g. on a development host.
+ *
+ * The recording holds the received messages as they are, each one preceded
+ * by its receive timestamp. The replay emulates the RPMsg device via a
+ * SOCK_SEQPACKET socketpair, which preserves the message boundaries like the
+ * rpmsg char device: a player thread answers the commands written by the app
+ * and, while the capture is started, sends the recorded capture messages at
+ * the recorded pace, scaled by the replay speed, or as fast as the app reads
+ * them. The recording is replayed in a loop, optionally dropping or marking
+ * as invalid a percentage of the capture messages, to exercise the frame
+ * recovery paths.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lat-stats.h"
+#include "log.h"
+#include "rpmsg-replay.h"
+
+/* Max size of a replayed message */
+#define RPMSG_REPLAY_MSG_MAX	512
+
+/* Fixed seed, for reproducible fault injection */
+#define RPMSG_REPLAY_SEED		0x5eed
+
+struct rpmsg_rec {
+	FILE *f;
+	unsigned long long start_time;		/* usec */
+	unsigned int msg_cnt;
+};
+
+struct rpmsg_replay {
+	uint8_t *data;						/* Mapped recording */
+	size_t len;
+	size_t off;							/* Offset of the next message */
+	const struct rpmsg_rec_file_hdr *hdr;
+	int fds[2];							/* App and player socket ends */
+	pthread_t thread;
+	int capturing;
+	unsigned int seed;
+	unsigned long long base_time;		/* usec, replay time of base_ts */
+	uint32_t base_ts;
+	unsigned int sent_msgs;
+	unsigned int dropped_msgs;
+	unsigned int invalid_msgs;
+	unsigned int loops;
+};
+
+/* Replay speed factor, 0 for max speed */
+static float replay_speed = 1.0;
+/* Percentages of the capture messages to be dropped or invalidated */
+static int replay_drop_pct;
+static int replay_inval_pct;
+
+/*
+ * Creates a recording file for the messages received with the given
+ * capture configuration.
+ *
+ * Returns the recording on success or NULL on error.
+ */
+struct rpmsg_rec *rpmsg_rec_open(const char *path, const struct bcam_cap_config *cfg,
+								 uint32_t msg_size)
+{
+	struct rpmsg_rec_file_hdr hdr;
+	struct rpmsg_rec *rec;
+
+	rec = malloc(sizeof(*rec));
+	if (rec == NULL) {
+		log_error("Not enough memory");
+		return NULL;
+	}
+
+	rec->f = fopen(path, "w");
+	if (rec->f == NULL) {
+		log_error("Failed to open %s: %s", path, strerror(errno));
+		free(rec);
+		return NULL;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = RPMSG_REC_MAGIC;
+	hdr.msg_size = msg_size;
+	hdr.cap_cfg = *cfg;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, rec->f) != 1) {
+		log_error("Failed to write %s: %s", path, strerror(errno));
+		fclose(rec->f);
+		free(rec);
+		return NULL;
+	}
+
+	rec->start_time = lat_get_time_usec();
+	rec->msg_cnt = 0;
+
+	log_info("Recording RPMsg messages to: %s", path);
+	return rec;
+}
+
+/*
+ * Appends a message received at the given monotonic time (usec).
+ * Returns 0 on success or -1 on error.
+ */
+int rpmsg_rec_write(struct rpmsg_rec *rec, const uint8_t *msg, uint32_t len,
+					unsigned long long ts)
+{
+	struct rpmsg_rec_msg_hdr hdr;
+
+	hdr.ts = ts - rec->start_time;
+	hdr.len = len;
+	hdr.reserved = 0;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, rec->f) != 1 ||
+		fwrite(msg, len, 1, rec->f) != 1) {
+		log_error("Failed to record message: %s", strerror(errno));
+		return -1;
+	}
+
+	rec->msg_cnt++;
+	return 0;
+}
+
+/*
+ * Flushes and closes the recording file.
+ * Returns 0 on success or -1 on error.
+ */
+int rpmsg_rec_close(struct rpmsg_rec *rec)
+{
+	int ret;
+
+	if (rec == NULL)
+		return 0;
+
+	ret = fclose(rec->f);
+	if (ret != 0)
+		log_error("Failed to close recording: %s", strerror(errno));
+	else
+		log_info("Recorded %u RPMsg messages", rec->msg_cnt);
+
+	free(rec);
+	return ret;
+}
+
+/*
+ * Sets the replay speed factor (0 for max speed) and the percentages of the
+ * capture messages to be dropped, causing seq gaps, or to be marked as
+ * invalid sections. Applies to the subsequently opened replays.
+ */
+void rpmsg_replay_set_params(float speed, int drop_pct, int inval_pct)
+{
+	replay_speed = (speed < 0 ? 0 : speed);
+	replay_drop_pct = drop_pct;
+	replay_inval_pct = inval_pct;
+}
+
+/*
+ * Checks if the RPMsg device path refers to a recording, i.e. a regular file.
+ */
+int rpmsg_replay_is_rec(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/*
+ * Sends a message to the app, just like PRU1 via the RPMsg device.
+ * Returns 0 on success or -1 if the app end has been closed.
+ */
+static int rpmsg_replay_send(struct rpmsg_replay *rp, const void *msg, size_t len)
+{
+	if (send(rp->fds[1], msg, len, MSG_NOSIGNAL) != (ssize_t)len) {
+		if (errno != EPIPE && errno != ECONNRESET)
+			log_error("Failed to send replay message: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends a PRU log message, i.e. the response to most commands.
+ */
+static int rpmsg_replay_send_log(struct rpmsg_replay *rp, int level, const char *str)
+{
+	uint8_t buf[RPMSG_REPLAY_MSG_MAX];
+	struct bcam_pru_msg *msg = (struct bcam_pru_msg *)buf;
+	size_t len = strlen(str);
+
+	msg->type = BCAM_PRU_MSG_LOG;
+	msg->log_hdr.level = level;
+	memcpy(msg->log_hdr.data, str, len);
+
+	return rpmsg_replay_send(rp, buf, msg->log_hdr.data - buf + len);
+}
+
+/*
+ * Checks if the capture config sent by the app gives the recorded frames.
+ */
+static int rpmsg_replay_check_cfg(const struct rpmsg_replay *rp,
+								  const struct bcam_cap_config *cfg)
+{
+	const struct bcam_cap_config *rec_cfg = &rp->hdr->cap_cfg;
+
+	return cfg->xres == rec_cfg->xres && cfg->yres == rec_cfg->yres &&
+		   cfg->bpp == rec_cfg->bpp && cfg->pix_fmt == rec_cfg->pix_fmt &&
+		   cfg->roi_x == rec_cfg->roi_x && cfg->roi_y == rec_cfg->roi_y &&
+		   cfg->roi_w == rec_cfg->roi_w && cfg->roi_h == rec_cfg->roi_h &&
+		   cfg->dec_x == rec_cfg->dec_x && cfg->dec_y == rec_cfg->dec_y ? 0 : -1;
+}
+
+/*
+ * Handles a command written by the app, emulating the PRU1 responses.
+ * Returns 0 on success or -1 if the app end has been closed.
+ */
+static int rpmsg_replay_handle_cmd(struct rpmsg_replay *rp, const uint8_t *buf, ssize_t len)
+{
+	const struct bcam_arm_msg *cmd = (const struct bcam_arm_msg *)buf;
+	struct bcam_pru_msg msg;
+
+	if (len < (ssize_t)sizeof(*cmd) ||
+		(cmd->magic_byte.high << 8 | cmd->magic_byte.low) != BCAM_ARM_MSG_MAGIC)
+		return rpmsg_replay_send_log(rp, BCAM_PRU_LOG_DEBUG, "Malformed cmd");
+
+	switch (cmd->id) {
+	case BCAM_ARM_MSG_CAP_SETUP:
+		if (len < (ssize_t)(sizeof(*cmd) + sizeof(struct bcam_cap_config)) ||
+			rpmsg_replay_check_cfg(rp, (const struct bcam_cap_config *)cmd->data) != 0)
+			return rpmsg_replay_send_log(rp, BCAM_PRU_LOG_ERROR,
+										 "Capture config differs from the recording");
+		return rpmsg_replay_send_log(rp, BCAM_PRU_LOG_INFO, "Capture configured");
+
+	case BCAM_ARM_MSG_CAP_START:
+		rp->capturing = 1;
+		rp->base_time = 0;
+		return rpmsg_replay_send_log(rp, BCAM_PRU_LOG_INFO, "Capture initiated");
+
+	case BCAM_ARM_MSG_CAP_STOP:
+		rp->capturing = 0;
+		return rpmsg_replay_send_log(rp, BCAM_PRU_LOG_INFO, "Capture stopped");
+
+	case BCAM_ARM_MSG_GET_TRACE:
+		/* No events are recorded, just report an empty trace ring */
+		memset(&msg, 0, sizeof(msg));
+		msg.type = BCAM_PRU_MSG_TRACE;
+		return rpmsg_replay_send(rp, &msg, msg.trace_hdr.data - (uint8_t *)&msg);
+	}
+
+	return rpmsg_replay_send_log(rp, BCAM_PRU_LOG_ERROR, "Unknown command");
+}
+
+/*
+ * Gets the next recorded capture message, restarting from the beginning
+ * at the end of the recording. The replay pace is rebased on restart.
+ */
+static const struct rpmsg_rec_msg_hdr *rpmsg_replay_next(struct rpmsg_replay *rp)
+{
+	const struct rpmsg_rec_msg_hdr *hdr;
+
+	while (1) {
+		if (rp->off + sizeof(*hdr) > rp->len) {
+			rp->off = sizeof(*rp->hdr);
+			rp->base_time = 0;
+			rp->loops++;
+		}
+
+		hdr = (const struct rpmsg_rec_msg_hdr *)(rp->data + rp->off);
+		if (((const struct bcam_pru_msg *)(hdr + 1))->type == BCAM_PRU_MSG_CAP)
+			break;
+
+		rp->off += sizeof(*hdr) + hdr->len;
+	}
+
+	if (rp->base_time == 0) {
+		rp->base_time = lat_get_time_usec();
+		rp->base_ts = hdr->ts;
+	}
+
+	return hdr;
+}
+
+/*
+ * Sends a recorded capture message, injecting the configured faults.
+ * Returns 0 on success or -1 if the app end has been closed.
+ */
+static int rpmsg_replay_send_cap(struct rpmsg_replay *rp, const struct rpmsg_rec_msg_hdr *hdr)
+{
+	uint8_t buf[RPMSG_REPLAY_MSG_MAX];
+	struct bcam_pru_msg *msg = (struct bcam_pru_msg *)buf;
+
+	rp->off += sizeof(*hdr) + hdr->len;
+
+	if (replay_drop_pct > 0 && rand_r(&rp->seed) % 100 < replay_drop_pct) {
+		rp->dropped_msgs++;
+		return 0;
+	}
+
+	memcpy(buf, hdr + 1, hdr->len);
+
+	if (replay_inval_pct > 0 && msg->cap_hdr.frm != BCAM_FRM_NONE &&
+		rand_r(&rp->seed) % 100 < replay_inval_pct) {
+		msg->cap_hdr.frm = BCAM_FRM_INVALID;
+		rp->invalid_msgs++;
+	}
+
+	rp->sent_msgs++;
+	return rpmsg_replay_send(rp, buf, hdr->len);
+}
+
+/*
+ * Player thread, running until the app end is closed.
+ */
+static void *rpmsg_replay_run(void *arg)
+{
+	struct rpmsg_replay *rp = arg;
+	const struct rpmsg_rec_msg_hdr *hdr = NULL;
+	uint8_t cmd_buf[RPMSG_REPLAY_MSG_MAX];
+	unsigned long long due, now;
+	struct pollfd pfd;
+	int tmout, ret;
+	ssize_t len;
+
+	pfd.fd = rp->fds[1];
+	pfd.events = POLLIN;
+
+	while (1) {
+		tmout = -1;
+		due = 0;
+
+		if (rp->capturing != 0) {
+			hdr = rpmsg_replay_next(rp);
+			now = lat_get_time_usec();
+
+			if (replay_speed > 0)
+				due = rp->base_time + (hdr->ts - rp->base_ts) / replay_speed;
+
+			/* Spin through the last msec, the poll timeout is too coarse */
+			tmout = (due > now ? (due - now) / 1000 : 0);
+		}
+
+		ret = poll(&pfd, 1, tmout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			log_error("Replay poll error: %s", strerror(errno));
+			break;
+		}
+
+		if (pfd.revents & POLLIN) {
+			len = recv(rp->fds[1], cmd_buf, sizeof(cmd_buf), 0);
+			if (len <= 0 || rpmsg_replay_handle_cmd(rp, cmd_buf, len) != 0)
+				break;
+			continue;
+		}
+
+		if (pfd.revents & (POLLHUP | POLLERR))
+			break;
+
+		if (rp->capturing != 0 && lat_get_time_usec() >= due &&
+			rpmsg_replay_send_cap(rp, hdr) != 0)
+			break;
+	}
+
+	return NULL;
+}
+
+/*
+ * Validates the recorded messages, counting the capture ones.
+ * Returns 0 on success or -1 on error.
+ */
+static int rpmsg_replay_check(const struct rpmsg_replay *rp, unsigned int *msg_cnt,
+							  unsigned int *cap_cnt)
+{
+	const struct rpmsg_rec_msg_hdr *hdr;
+	size_t off = sizeof(*rp->hdr);
+
+	*msg_cnt = 0;
+	*cap_cnt = 0;
+
+	while (off + sizeof(*hdr) <= rp->len) {
+		hdr = (const struct rpmsg_rec_msg_hdr *)(rp->data + off);
+		off += sizeof(*hdr) + hdr->len;
+
+		if (hdr->len == 0 || hdr->len > RPMSG_REPLAY_MSG_MAX || off > rp->len) {
+			log_error("Truncated or corrupted recording at message %u", *msg_cnt);
+			return -1;
+		}
+
+		(*msg_cnt)++;
+		if (((const struct bcam_pru_msg *)(hdr + 1))->type == BCAM_PRU_MSG_CAP)
+			(*cap_cnt)++;
+	}
+
+	if (*cap_cnt == 0) {
+		log_error("No capture messages recorded");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens a recording for replay and starts the player thread.
+ * Use rpmsg_replay_get_fd() to get the emulated RPMsg device fd.
+ *
+ * Returns the replay on success or NULL on error.
+ */
+struct rpmsg_replay *rpmsg_replay_open(const char *path)
+{
+	struct rpmsg_replay *rp;
+	unsigned int msg_cnt, cap_cnt;
+	sigset_t mask, old_mask;
+	struct stat st;
+	int fd, ret;
+
+	rp = calloc(1, sizeof(*rp));
+	if (rp == NULL) {
+		log_error("Not enough memory");
+		return NULL;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		log_error("Failed to open %s: %s", path, strerror(errno));
+		goto err_close;
+	}
+
+	if (st.st_size < sizeof(*rp->hdr)) {
+		log_error("Invalid recording: %s", path);
+		goto err_close;
+	}
+
+	rp->len = st.st_size;
+	rp->data = mmap(NULL, rp->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (rp->data == MAP_FAILED) {
+		log_error("Failed to map %s: %s", path, strerror(errno));
+		goto err_close;
+	}
+
+	close(fd);
+	fd = -1;
+
+	rp->hdr = (const struct rpmsg_rec_file_hdr *)rp->data;
+	if (rp->hdr->magic != RPMSG_REC_MAGIC) {
+		log_error("Invalid recording: %s", path);
+		goto err_unmap;
+	}
+
+	if (rpmsg_replay_check(rp, &msg_cnt, &cap_cnt) != 0)
+		goto err_unmap;
+
+	rp->off = sizeof(*rp->hdr);
+	rp->seed = RPMSG_REPLAY_SEED;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, rp->fds) != 0) {
+		log_error("Failed to create replay socketpair: %s", strerror(errno));
+		goto err_unmap;
+	}
+
+	/* The player must not handle any signals, see the signalfd usage */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	ret = pthread_create(&rp->thread, NULL, rpmsg_replay_run, rp);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0) {
+		log_error("Failed to create replay thread: %s", strerror(ret));
+		close(rp->fds[0]);
+		close(rp->fds[1]);
+		goto err_unmap;
+	}
+
+	log_info("Replaying %s: %u messages, %u capture (%ux%u camera image)",
+			 path, msg_cnt, cap_cnt, rp->hdr->cap_cfg.xres, rp->hdr->cap_cfg.yres);
+	return rp;
+
+err_unmap:
+	munmap(rp->data, rp->len);
+err_close:
+	if (fd >= 0)
+		close(fd);
+	free(rp);
+	return NULL;
+}
+
+/*
+ * Provides the app end of the emulated RPMsg device.
+ */
+int rpmsg_replay_get_fd(const struct rpmsg_replay *rp)
+{
+	return rp->fds[0];
+}
+
+/*
+ * Closes the app end, stopping the player thread, and releases the replay.
+ */
+void rpmsg_replay_close(struct rpmsg_replay *rp)
+{
+	if (rp == NULL)
+		return;
+
+	close(rp->fds[0]);
+	pthread_join(rp->thread, NULL);
+	close(rp->fds[1]);
+	munmap(rp->data, rp->len);
+
+	log_info("Replay stats: sent=%u, dropped=%u, invalidated=%u, loops=%u",
+			 rp->sent_msgs, rp->dropped_msgs, rp->invalid_msgs, rp->loops);
+
+	free(rp);
+}
@@ -0,0 +1,451 @@
+/*
+ * Streaming of the captured frames to a file, a pipe or the network.
+ *
+ * The sink is a frame pool subscriber, i.e. the latest frame always replaces
+ * the one not yet sent. A dedicated thread writes them out, hence a slow
+ * consumer only causes frames to be skipped by the sink, without slowing
+ * down the frame acquisition or the LCD rendering.
+ *
+ * The frames are written raw, in the captured pixel format, either to a
+ * file, e.g. stdout or a named pipe to be consumed by an encoder, or to a
+ * UDP socket. In the latter case each frame is split in RTP packets, sent
+ * in batches via sendmmsg().
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#define _GNU_SOURCE		/* sendmmsg() */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "frame-pool.h"
+#include "lat-stats.h"
+#include "log.h"
+#include "sink.h"
+#include "thread-util.h"
+
+/* UDP payload size, fitting the Ethernet MTU */
+#define SINK_UDP_PAYLOAD	1400
+/* Max no. of packets sent at once */
+#define SINK_UDP_BATCH		32
+
+/* RTP clock rate for video (kHz) */
+#define SINK_RTP_CLOCK_KHZ	90
+
+/* Max time the sink thread waits for frames, before checking for stop */
+#define SINK_POLL_MSEC		100
+
+/* Frame content to be sent */
+struct sink_buf {
+	uint32_t xres;
+	uint32_t yres;
+	uint32_t len;
+	const uint8_t *data;
+};
+
+struct rtp_hdr {
+	uint8_t vpxcc;						/* Version, padding, extension, CSRC count */
+	uint8_t mpt;						/* Marker, payload type */
+	uint16_t seq;
+	uint32_t ts;
+	uint32_t ssrc;
+} __attribute__((packed));
+
+/* Headers of a UDP sink packet */
+struct sink_pkt_hdr {
+	struct rtp_hdr rtp;
+	struct sink_udp_hdr udp;
+} __attribute__((packed));
+
+enum sink_type {
+	SINK_FILE = 0,
+	SINK_UDP,
+};
+
+static struct {
+	enum sink_type type;
+	const char *path;
+	int fd;
+	int active;
+	pthread_t thread;
+	_Atomic int stop;
+	struct frame_pool_sub *sub;
+	uint8_t *frame_buf;					/* Copy of the frame being sent */
+	uint32_t max_len;
+	uint16_t rtp_seq;
+	uint32_t rtp_ssrc;
+	unsigned int sent_frames;
+	unsigned int errors;
+} sink = {
+	.fd = -1,
+};
+
+/*
+ * The sink thread is only cancelled while blocked on the output, e.g. a
+ * stalled pipe reader, otherwise it stops on its own.
+ */
+static inline void sink_cancel_point(int enable)
+{
+	pthread_setcancelstate(enable ? PTHREAD_CANCEL_ENABLE : PTHREAD_CANCEL_DISABLE, NULL);
+}
+
+/*
+ * Opens the output file, waiting for a reader in case of a named pipe.
+ * Returns 0 on success or -1 on error.
+ */
+static int sink_open_file()
+{
+	if (strcmp(sink.path, "-") == 0) {
+		sink.fd = STDOUT_FILENO;
+		return 0;
+	}
+
+	sink_cancel_point(1);
+	sink.fd = open(sink.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	sink_cancel_point(0);
+
+	if (sink.fd < 0) {
+		log_error("Failed to open sink %s: %s", sink.path, strerror(errno));
+		return -1;
+	}
+
+	log_info("Streaming frames to: %s", sink.path);
+	return 0;
+}
+
+/*
+ * Writes a frame to the output file.
+ * Returns 0 on success or -1 on error.
+ */
+static int sink_write_file(const struct sink_buf *b)
+{
+	uint32_t off = 0;
+	ssize_t ret;
+
+	while (off < b->len) {
+		sink_cancel_point(1);
+		ret = write(sink.fd, b->data + off, b->len - off);
+		sink_cancel_point(0);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		off += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends a frame as a sequence of RTP packets, in batches.
+ * Returns 0 on success or -1 on error.
+ */
+static int sink_send_udp(const struct sink_buf *b)
+{
+	static struct sink_pkt_hdr hdrs[SINK_UDP_BATCH];
+	static struct iovec iovs[SINK_UDP_BATCH][2];
+	static struct mmsghdr msgs[SINK_UDP_BATCH];
+	const uint32_t data_sz = SINK_UDP_PAYLOAD - sizeof(struct sink_pkt_hdr);
+	uint32_t ts = lat_get_time_usec() * SINK_RTP_CLOCK_KHZ / 1000;
+	uint32_t off = 0, len;
+	int cnt, sent, ret;
+
+	while (off < b->len) {
+		for (cnt = 0; cnt < SINK_UDP_BATCH && off < b->len; cnt++) {
+			len = (b->len - off > data_sz ? data_sz : b->len - off);
+
+			hdrs[cnt].rtp.vpxcc = 0x80;
+			hdrs[cnt].rtp.mpt = SINK_RTP_PT | (off + len == b->len ? 0x80 : 0);
+			hdrs[cnt].rtp.seq = htons(sink.rtp_seq++);
+			hdrs[cnt].rtp.ts = htonl(ts);
+			hdrs[cnt].rtp.ssrc = htonl(sink.rtp_ssrc);
+			hdrs[cnt].udp.frm_off = htonl(off);
+			hdrs[cnt].udp.frm_len = htonl(b->len);
+			hdrs[cnt].udp.xres = htons(b->xres);
+			hdrs[cnt].udp.yres = htons(b->yres);
+
+			iovs[cnt][0].iov_base = &hdrs[cnt];
+			iovs[cnt][0].iov_len = sizeof(hdrs[cnt]);
+			iovs[cnt][1].iov_base = (void *)(b->data + off);
+			iovs[cnt][1].iov_len = len;
+
+			memset(&msgs[cnt], 0, sizeof(msgs[cnt]));
+			msgs[cnt].msg_hdr.msg_iov = iovs[cnt];
+			msgs[cnt].msg_hdr.msg_iovlen = 2;
+
+			off += len;
+		}
+
+		for (sent = 0; sent < cnt; sent += ret) {
+			sink_cancel_point(1);
+			ret = sendmmsg(sink.fd, msgs + sent, cnt - sent, 0);
+			sink_cancel_point(0);
+
+			if (ret < 0) {
+				if (errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				/* E.g. ECONNREFUSED, while no receiver is listening */
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Gives back the frame held, if any, when the thread is cancelled.
+ */
+static void sink_run_cleanup(void *arg)
+{
+	frame_pool_put(sink.sub);
+}
+
+/*
+ * Copies the content of a frame to be sent, with the lines packed. The frame
+ * can be given back before sending its content, hence a stalled output never
+ * holds a pool frame, e.g. while the frames are reallocated.
+ *
+ * Returns 0 on success or -1 if the frame does not fit the sink.
+ */
+static int sink_get_buf(const struct rpmsg_cam_frame *frame, struct sink_buf *b)
+{
+	uint32_t bpp, line_sz, y;
+
+	frame_pool_get_format(&b->xres, &b->yres, &bpp);
+	line_sz = b->xres * bpp / 8;
+	b->len = line_sz * b->yres;
+
+	if (b->len > sink.max_len)
+		return -1;
+
+	/* The frames received directly in the FB use the FB stride */
+	if (frame->stride == line_sz) {
+		memcpy(sink.frame_buf, frame->pixels, b->len);
+	} else {
+		for (y = 0; y < b->yres; y++)
+			memcpy(sink.frame_buf + y * line_sz, frame->pixels + y * frame->stride, line_sz);
+	}
+	b->data = sink.frame_buf;
+
+	return 0;
+}
+
+/*
+ * Sink thread, writing out the latest frame published in the frame pool.
+ */
+static void *sink_run(void *arg)
+{
+	struct sink_buf b;
+	struct pollfd pfd;
+	eventfd_t cnt;
+	int idx, ret, err;
+
+	sink_cancel_point(0);
+	threadutil_apply_sched("sink");
+
+	pfd.fd = sink.sub->rdy_fd;
+	pfd.events = POLLIN;
+
+	pthread_cleanup_push(sink_run_cleanup, NULL);
+
+	while (atomic_load(&sink.stop) == 0) {
+		if (sink.type == SINK_FILE && sink.fd < 0 && sink_open_file() != 0)
+			break;
+
+		ret = poll(&pfd, 1, SINK_POLL_MSEC);
+		if (ret < 0 && errno != EINTR) {
+			log_error("Sink poll error: %s", strerror(errno));
+			break;
+		}
+
+		/* Clear the counter before checking the ready frame */
+		if (ret > 0)
+			eventfd_read(sink.sub->rdy_fd, &cnt);
+
+		idx = frame_pool_take(sink.sub);
+		if (idx < 0)
+			continue;
+
+		ret = sink_get_buf(frame_pool_get(idx), &b);
+
+		/* Finish copying data before giving back the frame */
+		frame_pool_put(sink.sub);
+
+		if (ret == 0) {
+			if (sink.type == SINK_UDP)
+				ret = sink_send_udp(&b);
+			else
+				ret = sink_write_file(&b);
+		} else {
+			errno = EMSGSIZE;
+		}
+
+		/* The logger might change errno */
+		err = errno;
+
+		if (ret == 0) {
+			sink.sent_frames++;
+			continue;
+		}
+
+		if (sink.errors++ == 0)
+			log_warn("Failed to stream frame: %s", strerror(err));
+
+		/* The pipe reader is gone, wait for the next one */
+		if (err == EPIPE && sink.fd != STDOUT_FILENO) {
+			close(sink.fd);
+			sink.fd = -1;
+		} else if (sink.type == SINK_FILE) {
+			break;
+		}
+	}
+
+	pthread_cleanup_pop(0);
+	return NULL;
+}
+
+/*
+ * Creates the UDP socket connected to the host and port given as
+ * udp://HOST:PORT.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int sink_open_udp(const char *uri)
+{
+	struct addrinfo hints, *res;
+	char host[256], *port;
+	int ret;
+
+	strncpy(host, uri, sizeof(host) - 1);
+	host[sizeof(host) - 1] = 0;
+
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		log_error("Missing UDP sink port: %s", uri);
+		return -1;
+	}
+	*port++ = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret != 0) {
+		log_error("Failed to resolve UDP sink %s: %s", uri, gai_strerror(ret));
+		return -1;
+	}
+
+	sink.fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+	if (sink.fd < 0 || connect(sink.fd, res->ai_addr, res->ai_addrlen) != 0) {
+		log_error("Failed to connect UDP sink %s: %s", uri, strerror(errno));
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	freeaddrinfo(res);
+
+	log_info("Streaming frames to UDP %s:%s", host, port);
+	return 0;
+}
+
+/*
+ * Starts streaming the frames published in the frame pool to the given URI:
+ * "-" for stdout, udp://HOST:PORT or a file path, e.g. a named pipe. Must be
+ * called before allocating the frame pool.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int sink_init(const char *uri, uint32_t max_frame_len)
+{
+	sigset_t mask, old_mask;
+	int ret;
+
+	sink.max_len = max_frame_len;
+	sink.path = uri;
+	atomic_store(&sink.stop, 0);
+
+	sink.frame_buf = malloc(max_frame_len);
+	if (sink.frame_buf == NULL) {
+		log_error("Not enough memory for the sink buffer");
+		return -1;
+	}
+
+	if (strncmp(uri, "udp://", 6) == 0) {
+		sink.type = SINK_UDP;
+		sink.rtp_ssrc = lat_get_time_usec() ^ getpid();
+		if (sink_open_udp(uri + 6) != 0)
+			goto err_release;
+	} else {
+		/* Opened by the sink thread, since a named pipe waits for a reader */
+		sink.type = SINK_FILE;
+	}
+
+	sink.sub = frame_pool_subscribe("sink", 0);
+	if (sink.sub == NULL)
+		goto err_release;
+
+	/* The sink must not handle any signals, see the signalfd usage */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old_mask);
+	ret = pthread_create(&sink.thread, NULL, sink_run, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (ret != 0) {
+		log_error("Failed to create sink thread: %s", strerror(ret));
+		goto err_release;
+	}
+
+	sink.active = 1;
+	return 0;
+
+err_release:
+	sink_release();
+	return -1;
+}
+
+/*
+ * Stops the sink thread and releases the sink resources. The frame pool
+ * subscription is kept, but no frames are taken anymore.
+ */
+void sink_release()
+{
+	if (sink.active != 0) {
+		sink.active = 0;
+		atomic_store(&sink.stop, 1);
+		eventfd_write(sink.sub->rdy_fd, 1);
+
+		/* Only effective while blocked on the output */
+		pthread_cancel(sink.thread);
+		pthread_join(sink.thread, NULL);
+
+		log_info("Sink stats: sent=%u, errors=%u", sink.sent_frames, sink.errors);
+	}
+
+	if (sink.fd >= 0 && sink.fd != STDOUT_FILENO)
+		close(sink.fd);
+	sink.fd = -1;
+
+	free(sink.frame_buf);
+	sink.frame_buf = NULL;
+}
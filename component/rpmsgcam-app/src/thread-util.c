@@ -0,0 +1,201 @@
+/*
+ * Thread scheduling and memory locking utility.
+ *
+ * The scheduling policy, the priority and the CPU affinity of the frame
+ * processing threads are configured via a list of THREAD=POLICY[:PRIO][@CPU]
+ * entries, applied by each thread to itself when started, e.g. to run the
+ * frame acquisition at SCHED_FIFO, ahead of everything else.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#define _GNU_SOURCE		/* pthread_setaffinity_np(), SCHED_BATCH, SCHED_IDLE */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "thread-util.h"
+
+/* Max no. of configured threads */
+#define THREAD_SCHED_MAX		8
+#define THREAD_NAME_LEN			8
+
+/* Stack size prefaulted after locking the memory */
+#define THREAD_PREFAULT_STACK	(64 * 1024)
+
+struct thread_sched {
+	char name[THREAD_NAME_LEN];
+	const char *policy_name;
+	int policy;
+	int prio;
+	int cpu;							/* CPU index or -1 for any */
+};
+
+static struct {
+	const char *name;
+	int policy;
+} sched_policies[] = {
+	{ "other", SCHED_OTHER },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR },
+	{ "batch", SCHED_BATCH },
+	{ "idle", SCHED_IDLE },
+};
+
+static struct thread_sched thread_scheds[THREAD_SCHED_MAX];
+static int thread_sched_cnt;
+
+/*
+ * Parses a single THREAD=POLICY[:PRIO][@CPU] entry.
+ * Returns 0 on success or -1 on error.
+ */
+static int parse_sched_entry(char *entry, struct thread_sched *ts)
+{
+	char *policy, *prio, *cpu;
+	unsigned int i;
+
+	policy = strchr(entry, '=');
+	if (policy == NULL || policy == entry || policy - entry >= THREAD_NAME_LEN)
+		return -1;
+	*policy++ = 0;
+
+	cpu = strchr(policy, '@');
+	if (cpu != NULL)
+		*cpu++ = 0;
+
+	prio = strchr(policy, ':');
+	if (prio != NULL)
+		*prio++ = 0;
+
+	strcpy(ts->name, entry);
+	ts->policy = -1;
+
+	for (i = 0; i < sizeof(sched_policies) / sizeof(sched_policies[0]); i++) {
+		if (strcmp(policy, sched_policies[i].name) == 0) {
+			ts->policy = sched_policies[i].policy;
+			ts->policy_name = sched_policies[i].name;
+			break;
+		}
+	}
+
+	if (ts->policy < 0)
+		return -1;
+
+	ts->prio = (prio != NULL ? strtol(prio, NULL, 10) : 0);
+	ts->cpu = (cpu != NULL ? strtol(cpu, NULL, 10) : -1);
+
+	if (ts->prio < sched_get_priority_min(ts->policy) ||
+		ts->prio > sched_get_priority_max(ts->policy))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Parses a comma separated list of THREAD=POLICY[:PRIO][@CPU] entries,
+ * where POLICY is one of other, fifo, rr, batch or idle.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int threadutil_parse_sched(const char *spec)
+{
+	char buf[256], *entry, *save;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+
+	for (entry = strtok_r(buf, ",", &save); entry != NULL;
+		 entry = strtok_r(NULL, ",", &save)) {
+		if (thread_sched_cnt == THREAD_SCHED_MAX)
+			return -1;
+
+		if (parse_sched_entry(entry, &thread_scheds[thread_sched_cnt]) != 0)
+			return -1;
+
+		thread_sched_cnt++;
+	}
+
+	return 0;
+}
+
+/*
+ * Applies the scheduling configured for the named thread to the calling
+ * thread, if any. The failures are not fatal, e.g. missing privileges, the
+ * thread just keeps running with the inherited scheduling.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int threadutil_apply_sched(const char *name)
+{
+	struct sched_param param;
+	struct thread_sched *ts;
+	cpu_set_t cpus;
+	int i, ret;
+
+	for (i = 0; i < thread_sched_cnt; i++) {
+		if (strcmp(thread_scheds[i].name, name) == 0)
+			break;
+	}
+
+	if (i == thread_sched_cnt)
+		return 0;
+
+	ts = &thread_scheds[i];
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = ts->prio;
+
+	ret = pthread_setschedparam(pthread_self(), ts->policy, &param);
+	if (ret != 0) {
+		log_warn("Failed to set %s thread scheduling: %s", name, strerror(ret));
+		return -1;
+	}
+
+	if (ts->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(ts->cpu, &cpus);
+
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (ret != 0) {
+			log_warn("Failed to set %s thread CPU affinity: %s", name, strerror(ret));
+			return -1;
+		}
+	}
+
+	log_info("Set %s thread scheduling: policy=%s, prio=%d, cpu=%d",
+			 name, ts->policy_name, ts->prio, ts->cpu);
+	return 0;
+}
+
+/*
+ * Prefaults the stack of the calling thread.
+ */
+static void prefault_stack()
+{
+	volatile unsigned char stack[THREAD_PREFAULT_STACK];
+
+	memset((unsigned char *)stack, 0, sizeof(stack));
+}
+
+/*
+ * Locks the current and the future memory mappings of the process, i.e. the
+ * frame buffers allocated afterwards are also prefaulted, avoiding the page
+ * faults while processing the frames.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+int threadutil_lock_memory()
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		log_error("Failed to lock memory: %s", strerror(errno));
+		return -1;
+	}
+
+	prefault_stack();
+	return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * BeagleCam PRU RPMsg API.
+ *
+ * Copyright (C) 2021 Cristian Ciocaltea <cristian.ciocaltea@gmail.com>
+ */
+
+#ifndef _BCAM_RPMSG_API_H
+#define _BCAM_RPMSG_API_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+/* Discard ARM messages that do not start with this byte sequence. */
+#define BCAM_ARM_MSG_MAGIC		0xbeca
+
+/* Messages (commands) sent from ARM to PRU1. */
+struct bcam_arm_msg {
+	union {
+		uint8_t magic[2];	/* Magic byte sequence */
+		struct {
+			uint8_t high;	/* Magic high byte */
+			uint8_t low;	/* Magic low byte */
+		} magic_byte;
+	};
+	uint8_t id;			/* Member of enum bcam_arm_msg_type */
+	uint8_t data[0];		/* Message data */
+} __attribute__((packed));
+
+/* Payload for BCAM_ARM_MSG_CAP_SETUP command. */
+struct bcam_cap_config {
+	uint16_t xres;			/* Image X resolution */
+	uint16_t yres;			/* Image Y resolution */
+	uint8_t bpp;			/* Camera bits per pixel */
+	uint8_t test_mode;		/* Enable test image generation */
+	uint8_t test_pclk_mhz;		/* Test image pixel clock freq (MHz) */
+	uint8_t xfer_mode;		/* Member of enum bcam_xfer_mode */
+	uint16_t roi_x;			/* ROI X offset (pixels) */
+	uint16_t roi_y;			/* ROI Y offset (lines) */
+	uint16_t roi_w;			/* ROI width (pixels), 0 for the full image */
+	uint16_t roi_h;			/* ROI height (lines), 0 for the full image */
+	uint8_t dec_x;			/* Horizontal decimation, 0 or 1 for none */
+	uint8_t dec_y;			/* Vertical decimation, 0 or 1 for none */
+	uint8_t pix_fmt;		/* Member of enum bcam_pix_fmt */
+} __attribute__((packed));
+
+/*
+ * No. of pixels or lines kept out of len, when selecting every dec-th one.
+ * The captured image size is given by the ROI size after decimation.
+ */
+#define BCAM_DEC_LEN(len, dec)		((dec) > 1 ? ((len) + (dec) - 1) / (dec) : (len))
+
+/* Messages sent from PRU1 to ARM. */
+struct bcam_pru_msg {
+	uint8_t type;				/* Member of enum bcam_pru_msg_type */
+
+	union {
+		/* BCAM_PRU_MSG_INFO type */
+		struct __attribute__((packed)) {
+			uint8_t data[0];	/* Command response */
+		} info_hdr;
+
+		/* BCAM_PRU_MSG_LOG type */
+		struct __attribute__((packed)) {
+			uint8_t level;		/* Member of enum bcam_pru_log_level */
+			uint8_t data[0];	/* Message string */
+		} log_hdr;
+
+		/* BCAM_PRU_MSG_CAP type */
+		struct __attribute__((packed)) {
+			uint8_t frm;		/* Member of enum bcam_frm_sect */
+			uint16_t seq;		/* Data sequence no. */
+			uint8_t data[0];	/* Captured image data */
+		} cap_hdr;
+
+		/* BCAM_PRU_MSG_FRM_RDY type */
+		struct __attribute__((packed)) {
+			uint8_t slot;		/* DDR frame ring slot index */
+			uint16_t seq;		/* Frame sequence no. */
+			uint32_t len;		/* Frame size in bytes */
+		} frm_hdr;
+
+		/* BCAM_PRU_MSG_TRACE type */
+		struct __attribute__((packed)) {
+			uint16_t lost;		/* Events overwritten since the previous message */
+			uint16_t pending;	/* Events left in the trace ring */
+			uint8_t data[0];	/* Array of struct bcam_trace_evt */
+		} trace_hdr;
+	};
+} __attribute__((packed));
+
+/*
+ * Trailer appended to the image data of the BCAM_FRM_END section, when the
+ * frames are sent via BCAM_PRU_MSG_CAP messages. It is never split across
+ * messages, i.e. it always occupies the last bytes of the frame end section.
+ */
+struct bcam_frm_trailer {
+	uint32_t csum;			/* Frame data checksum, see bcam_frm_csum() */
+	uint16_t frm_seq;		/* Frame sequence no. */
+	uint16_t frm_dropped;		/* Frames discarded by PRU since the previous one */
+	uint32_t cap_time;		/* PRU timer ticks from the frame start to the trailer */
+} __attribute__((packed));
+
+/* PRU timer ticks per usec, see struct bcam_frm_trailer */
+#define BCAM_PRU_TICKS_PER_USEC		200
+
+/*
+ * Updates the frame data checksum with len bytes, starting from 0 for each
+ * frame. This is a Fletcher-32 like sum computed modulo 2^16, to avoid the
+ * divisions on PRU, which is still sensitive to the order of the bytes.
+ */
+static inline uint32_t bcam_frm_csum(uint32_t csum, const uint8_t *data, uint32_t len)
+{
+	uint16_t a = csum & 0xffff, b = csum >> 16;
+
+	while (len-- > 0) {
+		a += *data++;
+		b += a;
+	}
+
+	return ((uint32_t)b << 16) | a;
+}
+
+/*
+ * PRU1 trace event, recorded in the trace ring kept in the PRU shared RAM
+ * and sent to ARM on request only, see BCAM_ARM_MSG_GET_TRACE. The meaning
+ * of the arguments depends on the event ID.
+ */
+struct bcam_trace_evt {
+	uint32_t ts;			/* PRU timer ticks, see BCAM_PRU_TICKS_PER_USEC */
+	uint8_t id;			/* Member of enum bcam_trace_evt_id */
+	uint8_t reserved;
+	uint16_t arg0;
+	uint32_t arg1;
+} __attribute__((packed));
+
+/*
+ * DDR frame ring, allocated by the host for the resource table carveout
+ * named BCAM_FRM_RING_NAME.
+ *
+ * The header is followed by the frame slots, starting at BCAM_FRM_RING_HDR_SIZE
+ * offset, i.e. slot N is located at BCAM_FRM_RING_HDR_SIZE + N * slot_size.
+ * The layout is set by ARM, while PRU1 writes the captured frames to the
+ * slots that are not busy, marks them busy and sends BCAM_PRU_MSG_FRM_RDY
+ * notifications. ARM clears the busy flag once it is done with a frame.
+ */
+#define BCAM_FRM_RING_NAME		"bcam-frm-ring"
+#define BCAM_FRM_RING_SIZE		0x280000
+#define BCAM_FRM_RING_HDR_SIZE		0x1000
+#define BCAM_FRM_RING_SLOTS_MAX		16
+
+struct bcam_frm_ring_hdr {
+	uint32_t slot_cnt;		/* No. of slots, 0 disables the ring */
+	uint32_t slot_size;		/* Offset between slots */
+	uint8_t slot_busy[BCAM_FRM_RING_SLOTS_MAX]; /* Slot contains a frame */
+};
+
+/* IDs for messages (commands) sent from ARM to PRU1. */
+enum bcam_arm_msg_type {
+	BCAM_ARM_MSG_GET_PRUFW_VER = 0,		/* Get PRU firmware version */
+	BCAM_ARM_MSG_GET_CAP_STATUS,		/* Get camera capture status */
+	BCAM_ARM_MSG_CAP_SETUP,			/* Setup camera capture */
+	BCAM_ARM_MSG_CAP_START,			/* Start camera data capture */
+	BCAM_ARM_MSG_CAP_STOP,			/* Stop camera data capture */
+	BCAM_ARM_MSG_GET_TRACE,			/* Get the oldest PRU trace events */
+};
+
+/* IDs for messages sent from PRU1 to ARM. */
+enum bcam_pru_msg_type {
+	BCAM_PRU_MSG_NONE = 0,		/* Null data */
+	BCAM_PRU_MSG_INFO,		/* BCAM_ARM_MSG_GET_* requested info */
+	BCAM_PRU_MSG_LOG,		/* Log entry */
+	BCAM_PRU_MSG_CAP,		/* Capture data */
+	BCAM_PRU_MSG_FRM_RDY,		/* Frame available in the DDR frame ring */
+	BCAM_PRU_MSG_TRACE,		/* BCAM_ARM_MSG_GET_TRACE requested events */
+};
+
+/* IDs for the PRU1 trace events, see struct bcam_trace_evt. */
+enum bcam_trace_evt_id {
+	BCAM_TRACE_NONE = 0,
+	BCAM_TRACE_FRM_START,		/* arg0: frame seq */
+	BCAM_TRACE_FRM_END,		/* arg0: send status, arg1: frame size */
+	BCAM_TRACE_FRM_INCOMPLETE,	/* arg0: line seq, arg1: frame bytes received */
+	BCAM_TRACE_SEQ_GAP,		/* arg0: expected line seq, arg1: line seq */
+	BCAM_TRACE_LINE_OVERRUN,	/* arg0: line seq, line(s) skipped by PRU0 */
+	BCAM_TRACE_LINE_ERR,		/* arg0: line seq, arg1: line size */
+	BCAM_TRACE_PRU0_TMOUT,		/* arg0: expected line seq */
+	BCAM_TRACE_VRING_BUSY,		/* arg0: cap msg seq, no vring buffer available */
+	BCAM_TRACE_SEND_ERR,		/* arg0: frame section, arg1: send status */
+	BCAM_TRACE_SLOTS_BUSY,		/* arg0: frame seq, all DDR ring slots busy */
+};
+
+/* Capture data transfer modes. */
+enum bcam_xfer_mode {
+	BCAM_XFER_RPMSG = 0,		/* Frame data via BCAM_PRU_MSG_CAP */
+	BCAM_XFER_DDR,			/* Frame data via the DDR frame ring */
+};
+
+/*
+ * Captured image pixel formats.
+ *
+ * The camera always outputs 16 bits per pixel, while the 8-bit formats are
+ * obtained by PRU0 before the lines are sent to ARM, halving the transfer
+ * size. BCAM_PIX_FMT_Y8 requires the camera to output YUV422 in YUYV order,
+ * i.e. PRU0 keeps just the Y byte of each pixel, while BCAM_PIX_FMT_RGB332
+ * is packed from the RGB565 camera output.
+ */
+enum bcam_pix_fmt {
+	BCAM_PIX_FMT_RGB565 = 0,	/* 16-bit RGB565, little endian */
+	BCAM_PIX_FMT_Y8,		/* 8-bit luma (grayscale) */
+	BCAM_PIX_FMT_RGB332,		/* 8-bit RRRGGGBB */
+};
+
+/* Bits per pixel of the captured image for the given enum bcam_pix_fmt. */
+#define BCAM_PIX_FMT_BPP(fmt)		((fmt) == BCAM_PIX_FMT_RGB565 ? 16 : 8)
+
+/* Camera capture status. */
+enum bcam_cap_status {
+	BCAM_CAP_STOPPED = 0,
+	BCAM_CAP_STARTED,
+	BCAM_CAP_PAUSED,
+};
+
+/* Log levels. */
+enum bcam_pru_log_level {
+	BCAM_PRU_LOG_FATAL = 0,
+	BCAM_PRU_LOG_ERROR,
+	BCAM_PRU_LOG_WARN,
+	BCAM_PRU_LOG_INFO,
+	BCAM_PRU_LOG_DEBUG,
+};
+
+/* Frame section. */
+enum bcam_frm_sect {
+	BCAM_FRM_NONE = 0,		/* Null frame */
+	BCAM_FRM_START,			/* Frame start */
+	BCAM_FRM_BODY,			/* Frame body */
+	BCAM_FRM_END,			/* Frame end */
+	BCAM_FRM_INVALID,		/* Frame invalid, should be discarded */
+};
+
+#endif /* _BCAM_RPMSG_API_H */
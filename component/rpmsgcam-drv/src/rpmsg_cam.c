@@ -12,10 +12,21 @@
  */
 
 #include <linux/cdev.h>
+#include <linux/dma-mapping.h>
 #include <linux/kernel.h>
 #include <linux/kfifo.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/remoteproc.h>
 #include <linux/rpmsg.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+
+#include "bcam-rpmsg-api.h"
+#include "rpmsgcam-drv-api.h"
 
 #define PRU_MAX_DEVICES			8
 
@@ -24,9 +35,113 @@
 /* Size of the buffer header (see struct rpmsg_hdr in virtio_rpmsg_bus.c) */
 #define RPMSG_HEADER_SIZE		16
 
-#define MAX_FIFO_MSG			32
+/* Min no. of messages in the kernel fifo */
+#define MIN_FIFO_MSG			32
 #define FIFO_MSG_SIZE			RPMSG_BUF_SIZE
 
+/* Size of the BCAM_PRU_MSG_FRM_RDY message */
+#define FRM_RDY_MSG_SIZE		offsetofend(struct bcam_pru_msg, frm_hdr)
+
+/* Size of the BCAM_PRU_MSG_LOG message header */
+#define LOG_MSG_HDR_SIZE		offsetof(struct bcam_pru_msg, log_hdr.data)
+
+/* Size of the BCAM_PRU_MSG_CAP message header */
+#define CAP_MSG_HDR_SIZE		offsetof(struct bcam_pru_msg, cap_hdr.data)
+/* Max size of the image data in a BCAM_PRU_MSG_CAP message */
+#define CAP_MSG_DATA_SIZE		(RPMSG_BUF_SIZE - RPMSG_HEADER_SIZE - \
+					 CAP_MSG_HDR_SIZE)
+
+static unsigned int fifo_msgs;
+module_param(fifo_msgs, uint, 0644);
+MODULE_PARM_DESC(fifo_msgs,
+		 "No. of messages in the kernel fifo, rounded up to a power of 2 (default: 0, i.e. enough for a frame as configured via BCAM_ARM_MSG_CAP_SETUP)");
+
+static unsigned int fifo_max_msgs = 2048;
+module_param(fifo_max_msgs, uint, 0644);
+MODULE_PARM_DESC(fifo_max_msgs,
+		 "Max no. of messages in the kernel fifo, rounded down to a power of 2 (default: 2048)");
+
+static bool autostart;
+module_param(autostart, bool, 0444);
+MODULE_PARM_DESC(autostart,
+		 "Start the RGB565 capture when the channel appears, holding the first frames in the frame ring (default: 0)");
+
+static unsigned int autostart_xres = 160;
+module_param(autostart_xres, uint, 0444);
+MODULE_PARM_DESC(autostart_xres, "Autostart capture X resolution (default: 160)");
+
+static unsigned int autostart_yres = 120;
+module_param(autostart_yres, uint, 0444);
+MODULE_PARM_DESC(autostart_yres, "Autostart capture Y resolution (default: 120)");
+
+static unsigned int autostart_test_mode;
+module_param(autostart_test_mode, uint, 0444);
+MODULE_PARM_DESC(autostart_test_mode,
+		 "Autostart capture of the PRU generated test images (default: 0)");
+
+static unsigned int autostart_pclk_mhz = 1;
+module_param(autostart_pclk_mhz, uint, 0444);
+MODULE_PARM_DESC(autostart_pclk_mhz,
+		 "Autostart test images pixel clock freq in MHz (default: 1)");
+
+/*
+ * No. of frame ring slots used by the autostarted capture, as requested by
+ * rpmsgcam-app, since the ring is handed over without being reallocated.
+ */
+#define AUTOSTART_RING_SLOTS		RPMSGCAM_RING_SLOTS_MAX
+
+/* Max no. of commands sent by the driver itself, waiting for PRU replies */
+#define CMD_PENDING_MAX			4
+
+/* Max time to wait for PRU to reply to the commands sent by the driver */
+#define CMD_REPLY_TMOUT_MSEC		100
+
+/* States of a frame ring slot */
+enum rpmsgcam_slot_state {
+	RPMSGCAM_SLOT_FREE = 0,		/* Available for reassembling a frame */
+	RPMSGCAM_SLOT_FILLING,		/* Frame reassembly in progress */
+	RPMSGCAM_SLOT_DONE,		/* Completed frame, waiting for DQBUF */
+	RPMSGCAM_SLOT_USER,		/* Owned by user space until QBUF */
+};
+
+/**
+ * struct rpmsgcam_ring - Frame ring shared with user space via mmap
+ * @mem: vmalloc_user() area storing the frame slots or the slots area of
+ *       the DDR frame ring carveout
+ * @hdr: DDR frame ring header shared with PRU, NULL if @mem is vmalloc-ed
+ * @frame_size: expected size of a frame
+ * @slot_size: page aligned offset between two consecutive slots
+ * @slot_cnt: number of slots in @mem
+ * @state: state of each slot, member of enum rpmsgcam_slot_state
+ * @seq: sequence number of the frame stored in each slot
+ * @done: FIFO of slot indexes containing completed frames
+ * @done_rd: read index in @done
+ * @done_cnt: number of entries in @done
+ * @fill_idx: slot used for the frame being reassembled, -1 if none
+ * @fill_len: number of bytes received for the frame being reassembled
+ * @fill_seq: expected sequence number of the next frame section
+ * @frame_cnt: counter for the completed frames
+ *
+ * All fields, except @mem allocation, are protected by the ring_lock spinlock
+ * of the owning struct rpmsgcam_priv.
+ */
+struct rpmsgcam_ring {
+	void *mem;
+	struct bcam_frm_ring_hdr *hdr;
+	u32 frame_size;
+	u32 slot_size;
+	u32 slot_cnt;
+	u8 state[RPMSGCAM_RING_SLOTS_MAX];
+	u32 seq[RPMSGCAM_RING_SLOTS_MAX];
+	u8 done[RPMSGCAM_RING_SLOTS_MAX];
+	u32 done_rd;
+	u32 done_cnt;
+	int fill_idx;
+	u32 fill_len;
+	u16 fill_seq;
+	u32 frame_cnt;
+};
+
 /**
  * struct rpmsgcam_priv - Structure that contains the per-device data
  * @rpdev: rpmsg channel device that is associated with this rpmsg_pru device
@@ -35,16 +150,51 @@
  * @locked: boolean used to determine whether or not the device file is in use
  * @devt: dev_t structure for the rpmsg_pru device
  * @msg_fifo: kernel fifo used to buffer the messages between userspace and PRU
+ * @fifo_mem: storage of @msg_fifo
  * @msg_len: array storing the lengths of each message in the kernel fifo
  * @msg_idx_rd: kernel fifo read index
  * @msg_idx_wr: kernel fifo write index
+ * @fifo_msgs: max no. of messages in the kernel fifo, i.e. @msg_len size
+ * @fifo_lock: spinlock protecting the kernel fifo writer, rpmsgcam_cb(),
+ *             against the fifo resize
+ * @fifo_mutex: serializes the kernel fifo readers and resize
+ * @frame_size: frame size as configured via BCAM_ARM_MSG_CAP_SETUP
+ * @stats: message and frame counters, updated by rpmsgcam_cb()
+ * @frm_carveout: remoteproc carveout for the DDR frame ring, if available
+ * @frm_carveout_dev: device used to allocate @frm_carveout
  * @wait_list: wait queue used to implement the poll operation of the character
  *             device
+ * @ring: frame ring used to reassemble the captured frames
+ * @ring_lock: spinlock protecting @ring state against rpmsgcam_cb()
+ * @ring_mutex: serializes the frame ring (re)allocation and mmap operations
+ * @ring_maps: number of user space mappings of the frame ring
+ * @autostarted: capture started at probe time, until user space takes over,
+ *               protected by @ring_mutex
+ * @cmd_lock: spinlock protecting @cmd_pending against rpmsgcam_cb()
+ * @cmd_pending: ids of the commands sent by the driver itself, in order, whose
+ *               PRU replies are not passed to user space
+ * @cmd_pending_cnt: number of entries in @cmd_pending
  *
  * Each rpmsg_pru device provides an interface, using an rpmsg channel (rpdev),
  * between a user space character device (cdev) and a PRU core. A kernel fifo
  * (msg_fifo) is used to buffer the messages in the kernel that are
  * being passed between the character device and the PRU.
+ *
+ * When the frame ring is enabled, the capture messages bypass the kernel fifo
+ * and their content is copied directly into the ring slots, which user space
+ * accesses without any additional copy.
+ *
+ * If the PRU firmware provides the DDR frame ring carveout, the frames can be
+ * written directly by PRU in the ring slots, while the driver only handles
+ * the frame ready notifications.
+ *
+ * Otherwise the kernel fifo is sized to hold a complete frame, so that a
+ * descheduled reader does not cause messages to be dropped.
+ *
+ * When requested via the autostart module parameter, the capture is started
+ * as soon as the channel appears, while the first frames are held in the frame
+ * ring, which is handed over to the first user space setup asking for the same
+ * frame size.
  */
 struct rpmsgcam_priv {
 	struct rpmsg_device *rpdev;
@@ -53,10 +203,26 @@ struct rpmsgcam_priv {
 	bool locked;
 	dev_t devt;
 	struct kfifo msg_fifo;
-	u32 msg_len[MAX_FIFO_MSG];
+	void *fifo_mem;
+	u32 *msg_len;
 	int msg_idx_rd;
 	int msg_idx_wr;
+	u32 fifo_msgs;
+	spinlock_t fifo_lock;
+	struct mutex fifo_mutex;
+	u32 frame_size;
+	struct rpmsgcam_stats stats;
+	struct rproc_mem_entry *frm_carveout;
+	struct device *frm_carveout_dev;
 	wait_queue_head_t wait_list;
+	struct rpmsgcam_ring ring;
+	spinlock_t ring_lock;
+	struct mutex ring_mutex;
+	atomic_t ring_maps;
+	bool autostarted;
+	spinlock_t cmd_lock;
+	u8 cmd_pending[CMD_PENDING_MAX];
+	u32 cmd_pending_cnt;
 };
 
 static struct class *rpmsgcam_class;
@@ -64,6 +230,732 @@ static dev_t rpmsgcam_privt;
 static DEFINE_MUTEX(rpmsgcam_lock);
 static DEFINE_IDR(rpmsgcam_minors);
 
+/*
+ * Returns the no. of messages in the kernel fifo.
+ * Must be called with fifo_lock or fifo_mutex held.
+ */
+static u32 rpmsgcam_fifo_cnt(struct rpmsgcam_priv *priv)
+{
+	if (!priv->fifo_msgs)
+		return 0;
+
+	return (priv->msg_idx_wr - priv->msg_idx_rd + priv->fifo_msgs) %
+		priv->fifo_msgs;
+}
+
+/*
+ * (Re)allocates the kernel fifo to hold the given no. of messages,
+ * preserving its content.
+ */
+static int rpmsgcam_fifo_resize(struct rpmsgcam_priv *priv, u32 msgs)
+{
+	struct kfifo fifo;
+	unsigned long flags;
+	u32 *msg_len, cnt, i;
+	void *mem;
+	u8 *tmp;
+	int ret = 0;
+
+	/* The max is rounded down, hence the fifo never exceeds the setting */
+	msgs = clamp(msgs, (u32)MIN_FIFO_MSG,
+		     (u32)rounddown_pow_of_two(max(READ_ONCE(fifo_max_msgs), (u32)MIN_FIFO_MSG)));
+	msgs = roundup_pow_of_two(msgs);
+
+	mutex_lock(&priv->fifo_mutex);
+
+	if (msgs == priv->fifo_msgs)
+		goto unlock;
+
+	mem = kvmalloc(msgs * FIFO_MSG_SIZE, GFP_KERNEL);
+	msg_len = kcalloc(msgs, sizeof(*msg_len), GFP_KERNEL);
+	tmp = kmalloc(FIFO_MSG_SIZE, GFP_KERNEL);
+	if (!mem || !msg_len || !tmp) {
+		dev_err(priv->dev, "Unable to allocate fifo for %u messages\n", msgs);
+		ret = -ENOMEM;
+		goto free;
+	}
+
+	ret = kfifo_init(&fifo, mem, msgs * FIFO_MSG_SIZE);
+	if (ret)
+		goto free;
+
+	spin_lock_irqsave(&priv->fifo_lock, flags);
+
+	cnt = rpmsgcam_fifo_cnt(priv);
+	if (cnt >= msgs) {
+		spin_unlock_irqrestore(&priv->fifo_lock, flags);
+		ret = -EBUSY;
+		goto free;
+	}
+
+	/* Move the pending messages to the new fifo */
+	for (i = 0; i < cnt; i++) {
+		msg_len[i] = kfifo_out(&priv->msg_fifo, tmp,
+				       priv->msg_len[priv->msg_idx_rd]);
+		kfifo_in(&fifo, tmp, msg_len[i]);
+		priv->msg_idx_rd = (priv->msg_idx_rd + 1) % priv->fifo_msgs;
+	}
+
+	swap(priv->fifo_mem, mem);
+	swap(priv->msg_len, msg_len);
+	priv->msg_fifo = fifo;
+	priv->msg_idx_rd = 0;
+	priv->msg_idx_wr = cnt;
+	priv->fifo_msgs = msgs;
+	priv->stats.fifo_msgs = msgs;
+
+	spin_unlock_irqrestore(&priv->fifo_lock, flags);
+
+	dev_dbg(priv->dev, "Resized fifo: %u messages\n", msgs);
+
+free:
+	kfree(tmp);
+	kfree(msg_len);
+	kvfree(mem);
+unlock:
+	mutex_unlock(&priv->fifo_mutex);
+	return ret;
+}
+
+/*
+ * Sizes the kernel fifo according to the fifo_msgs module parameter or, when
+ * not set, to the current frame size. The capture messages do not go through
+ * the kernel fifo while the frame ring is enabled, hence the min size is used.
+ */
+static int rpmsgcam_fifo_adjust(struct rpmsgcam_priv *priv)
+{
+	u32 msgs = READ_ONCE(fifo_msgs);
+
+	if (!msgs && !READ_ONCE(priv->ring.mem))
+		msgs = DIV_ROUND_UP(priv->frame_size + sizeof(struct bcam_frm_trailer),
+				    CAP_MSG_DATA_SIZE);
+
+	return rpmsgcam_fifo_resize(priv, msgs);
+}
+
+/*
+ * Waits for the kernel fifo to become non-empty and locks it for reading.
+ * On success, the caller must release fifo_mutex.
+ */
+static int rpmsgcam_fifo_lock_read(struct rpmsgcam_priv *priv, struct file *filp)
+{
+	int ret;
+
+	while (1) {
+		if (kfifo_is_empty(&priv->msg_fifo) && (filp->f_flags & O_NONBLOCK))
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(priv->wait_list,
+					       !kfifo_is_empty(&priv->msg_fifo));
+		if (ret)
+			return -EINTR;
+
+		if (mutex_lock_interruptible(&priv->fifo_mutex))
+			return -EINTR;
+
+		if (!kfifo_is_empty(&priv->msg_fifo))
+			return 0;
+
+		mutex_unlock(&priv->fifo_mutex);
+	}
+}
+
+/*
+ * Discards the remainder of a message partially read from the kernel fifo.
+ * Must be called with fifo_mutex held.
+ */
+static void rpmsgcam_fifo_skip(struct rpmsgcam_priv *priv, u32 len)
+{
+	u8 tmp[RPMSG_BUF_SIZE - RPMSG_HEADER_SIZE];
+
+	/* A message never exceeds the RPMsg payload */
+	kfifo_out(&priv->msg_fifo, tmp, min_t(u32, len, sizeof(tmp)));
+}
+
+/*
+ * Releases the frame ring memory.
+ * Must be called with ring_mutex held, while the ring is not mapped.
+ */
+static void rpmsgcam_ring_free(struct rpmsgcam_priv *priv)
+{
+	unsigned long flags;
+	void *mem;
+
+	spin_lock_irqsave(&priv->ring_lock, flags);
+	mem = priv->ring.mem;
+
+	/* Stop PRU from using the DDR frame ring */
+	if (priv->ring.hdr) {
+		WRITE_ONCE(priv->ring.hdr->slot_cnt, 0);
+		mem = NULL;
+	}
+
+	memset(&priv->ring, 0, sizeof(priv->ring));
+	priv->ring.fill_idx = -1;
+	spin_unlock_irqrestore(&priv->ring_lock, flags);
+
+	vfree(mem);
+}
+
+/*
+ * Looks up the DDR frame ring carveout allocated by remoteproc.
+ */
+static void rpmsgcam_find_carveout(struct rpmsgcam_priv *priv)
+{
+	struct rproc *rproc = rproc_get_by_child(&priv->rpdev->dev);
+	struct rproc_mem_entry *mem;
+
+	if (!rproc)
+		return;
+
+	mutex_lock(&rproc->lock);
+
+	list_for_each_entry(mem, &rproc->carveouts, node) {
+		if (!strcmp(mem->name, BCAM_FRM_RING_NAME) && mem->va &&
+		    mem->len >= BCAM_FRM_RING_SIZE) {
+			priv->frm_carveout = mem;
+			priv->frm_carveout_dev = rproc->dev.parent;
+			dev_dbg(priv->dev, "Found DDR frame ring: %zu bytes at %pad\n",
+				mem->len, &mem->dma);
+			break;
+		}
+	}
+
+	mutex_unlock(&rproc->lock);
+}
+
+/*
+ * Sets up the DDR frame ring for the given configuration.
+ * Must be called with ring_mutex held, while the ring is not allocated.
+ *
+ * Returns 0 on success or -ENOSPC if the carveout is too small.
+ */
+static int rpmsgcam_ring_setup_ddr(struct rpmsgcam_priv *priv,
+				   struct rpmsgcam_ring_config *cfg)
+{
+	struct bcam_frm_ring_hdr *hdr = priv->frm_carveout->va;
+	unsigned long flags;
+	u32 slot_size, slot_cnt;
+
+	slot_size = PAGE_ALIGN(cfg->frame_size);
+	slot_cnt = min_t(u32, cfg->slot_cnt,
+			 (BCAM_FRM_RING_SIZE - BCAM_FRM_RING_HDR_SIZE) / slot_size);
+	if (slot_cnt < 2)
+		return -ENOSPC;
+
+	WRITE_ONCE(hdr->slot_cnt, 0);
+	memset(hdr->slot_busy, 0, sizeof(hdr->slot_busy));
+	WRITE_ONCE(hdr->slot_size, slot_size);
+
+	spin_lock_irqsave(&priv->ring_lock, flags);
+	priv->ring.mem = (u8 *)hdr + BCAM_FRM_RING_HDR_SIZE;
+	priv->ring.hdr = hdr;
+	priv->ring.frame_size = cfg->frame_size;
+	priv->ring.slot_size = slot_size;
+	priv->ring.slot_cnt = slot_cnt;
+	spin_unlock_irqrestore(&priv->ring_lock, flags);
+
+	/* Enable PRU access to the ring */
+	wmb();
+	WRITE_ONCE(hdr->slot_cnt, slot_cnt);
+
+	cfg->slot_cnt = slot_cnt;
+	cfg->slot_size = slot_size;
+
+	dev_dbg(priv->dev, "Configured DDR frame ring: %u x %u bytes\n",
+		slot_cnt, slot_size);
+
+	return 0;
+}
+
+/* PRU replies to the commands sent by the driver, see rpmsgcam_send_cmd() */
+static const char * const rpmsgcam_cmd_replies[] = {
+	[BCAM_ARM_MSG_CAP_SETUP] = "Capture configured",
+	[BCAM_ARM_MSG_CAP_START] = "Capture initiated",
+	[BCAM_ARM_MSG_CAP_STOP] = "Capture stopped",
+};
+
+/*
+ * Sends a command to PRU, on behalf of the driver. The PRU log message
+ * replying to the command is dropped by rpmsgcam_cb(), hence user space
+ * gets only the replies to its own commands.
+ * Must be called with ring_mutex held.
+ */
+static int rpmsgcam_send_cmd(struct rpmsgcam_priv *priv, u8 id,
+			     const void *data, size_t len)
+{
+	u8 buf[sizeof(struct bcam_arm_msg) + sizeof(struct bcam_cap_config)];
+	struct bcam_arm_msg *msg = (struct bcam_arm_msg *)buf;
+	unsigned long flags;
+	int ret = 0;
+
+	if (len > sizeof(buf) - sizeof(*msg) ||
+	    id >= ARRAY_SIZE(rpmsgcam_cmd_replies) || !rpmsgcam_cmd_replies[id])
+		return -EINVAL;
+
+	msg->magic_byte.high = BCAM_ARM_MSG_MAGIC >> 8;
+	msg->magic_byte.low = BCAM_ARM_MSG_MAGIC & 0xff;
+	msg->id = id;
+	if (len)
+		memcpy(msg->data, data, len);
+
+	/* The reply might be received before rpmsg_send() returns */
+	spin_lock_irqsave(&priv->cmd_lock, flags);
+	if (priv->cmd_pending_cnt < CMD_PENDING_MAX)
+		priv->cmd_pending[priv->cmd_pending_cnt++] = id;
+	else
+		ret = -EBUSY;
+	spin_unlock_irqrestore(&priv->cmd_lock, flags);
+
+	if (ret)
+		return ret;
+
+	ret = rpmsg_send(priv->rpdev->ept, buf, sizeof(*msg) + len);
+	if (ret) {
+		/* Still the last one, only the replied commands are removed */
+		spin_lock_irqsave(&priv->cmd_lock, flags);
+		priv->cmd_pending_cnt--;
+		spin_unlock_irqrestore(&priv->cmd_lock, flags);
+		dev_err(priv->dev, "rpmsg_send failed: %d\n", ret);
+	}
+
+	return ret;
+}
+
+/*
+ * Checks if a PRU log message is the reply to a pending driver command.
+ * Since PRU replies in order, the commands sent before the matching one have
+ * failed, their error messages being passed to user space, and they are no
+ * longer pending either.
+ *
+ * Returns true if the message is a driver command reply.
+ */
+static bool rpmsgcam_cmd_reply(struct rpmsgcam_priv *priv,
+			       const struct bcam_pru_msg *msg, int len)
+{
+	const char *text = (const char *)msg->log_hdr.data;
+	size_t text_len = strnlen(text, len - LOG_MSG_HDR_SIZE);
+	const char *reply;
+	unsigned long flags;
+	bool found = false;
+	u32 i;
+
+	if (msg->log_hdr.level != BCAM_PRU_LOG_INFO)
+		return false;
+
+	spin_lock_irqsave(&priv->cmd_lock, flags);
+
+	for (i = 0; i < priv->cmd_pending_cnt && !found; i++) {
+		reply = rpmsgcam_cmd_replies[priv->cmd_pending[i]];
+		found = strlen(reply) == text_len && !memcmp(reply, text, text_len);
+	}
+
+	if (found) {
+		priv->cmd_pending_cnt -= i;
+		memmove(priv->cmd_pending, priv->cmd_pending + i, priv->cmd_pending_cnt);
+	}
+
+	spin_unlock_irqrestore(&priv->cmd_lock, flags);
+
+	return found;
+}
+
+/*
+ * Waits for PRU to reply to the pending driver commands. On timeout, they are
+ * no longer pending, hence the replies to the user space commands cannot be
+ * mistaken for the late ones.
+ *
+ * Returns false on timeout.
+ */
+static bool rpmsgcam_cmd_wait(struct rpmsgcam_priv *priv)
+{
+	unsigned long flags;
+
+	if (wait_event_timeout(priv->wait_list, !READ_ONCE(priv->cmd_pending_cnt),
+			       msecs_to_jiffies(CMD_REPLY_TMOUT_MSEC)))
+		return true;
+
+	spin_lock_irqsave(&priv->cmd_lock, flags);
+	priv->cmd_pending_cnt = 0;
+	spin_unlock_irqrestore(&priv->cmd_lock, flags);
+
+	return false;
+}
+
+/*
+ * Stops the autostarted capture, waiting for PRU to reply, i.e. to no longer
+ * write in the frame ring.
+ * Must be called with ring_mutex held.
+ */
+static void rpmsgcam_autostart_stop(struct rpmsgcam_priv *priv)
+{
+	priv->autostarted = false;
+
+	if (rpmsgcam_send_cmd(priv, BCAM_ARM_MSG_CAP_STOP, NULL, 0))
+		return;
+
+	if (!rpmsgcam_cmd_wait(priv))
+		dev_warn(priv->dev, "Timeout stopping the autostarted capture\n");
+}
+
+/*
+ * Checks if the frame ring of the autostarted capture fits the given
+ * configuration, in which case it is kept, including the completed frames.
+ * Must be called with ring_mutex held.
+ *
+ * Returns true if the ring is kept and cfg has been updated accordingly.
+ */
+static bool rpmsgcam_ring_reuse(struct rpmsgcam_priv *priv,
+				struct rpmsgcam_ring_config *cfg)
+{
+	struct rpmsgcam_ring *ring = &priv->ring;
+
+	if (!priv->autostarted || !ring->mem || ring->frame_size != cfg->frame_size)
+		return false;
+
+	/* The vmalloc-ed ring is also the fallback of a DDR ring request */
+	if (ring->hdr && !(cfg->flags & RPMSGCAM_RING_F_DDR))
+		return false;
+
+	cfg->slot_cnt = ring->slot_cnt;
+	cfg->slot_size = ring->slot_size;
+	cfg->flags = ring->hdr ? RPMSGCAM_RING_F_DDR : 0;
+
+	dev_dbg(priv->dev, "Reusing autostart frame ring: %u frames completed\n",
+		READ_ONCE(ring->done_cnt));
+
+	return true;
+}
+
+/*
+ * (Re)allocates the frame ring according to the given, already validated,
+ * configuration, see rpmsgcam_ring_setup().
+ * Must be called with ring_mutex held.
+ */
+static int rpmsgcam_ring_alloc(struct rpmsgcam_priv *priv,
+			       struct rpmsgcam_ring_config *cfg)
+{
+	unsigned long flags;
+	u32 slot_size;
+	void *mem;
+
+	if (atomic_read(&priv->ring_maps) > 0) {
+		dev_err(priv->dev, "Frame ring is still mapped\n");
+		return -EBUSY;
+	}
+
+	/* Hand over the frames held for the autostarted capture */
+	if (rpmsgcam_ring_reuse(priv, cfg))
+		return 0;
+
+	/* Otherwise PRU must stop writing in the ring before reallocating it */
+	if (priv->autostarted)
+		rpmsgcam_autostart_stop(priv);
+
+	rpmsgcam_ring_free(priv);
+
+	if (cfg->frame_size == 0) {
+		cfg->slot_cnt = 0;
+		cfg->slot_size = 0;
+		cfg->flags = 0;
+		return 0;
+	}
+
+	/* Fall back to the vmalloc-ed ring if the DDR ring cannot be used */
+	if (cfg->flags & RPMSGCAM_RING_F_DDR) {
+		if (priv->frm_carveout && !rpmsgcam_ring_setup_ddr(priv, cfg))
+			return 0;
+
+		cfg->flags &= ~RPMSGCAM_RING_F_DDR;
+	}
+
+	slot_size = PAGE_ALIGN(cfg->frame_size);
+	mem = vmalloc_user(slot_size * cfg->slot_cnt);
+	if (!mem) {
+		dev_err(priv->dev, "Unable to allocate the frame ring\n");
+		return -ENOMEM;
+	}
+
+	spin_lock_irqsave(&priv->ring_lock, flags);
+	priv->ring.mem = mem;
+	priv->ring.frame_size = cfg->frame_size;
+	priv->ring.slot_size = slot_size;
+	priv->ring.slot_cnt = cfg->slot_cnt;
+	spin_unlock_irqrestore(&priv->ring_lock, flags);
+
+	cfg->slot_size = slot_size;
+
+	dev_dbg(priv->dev, "Allocated frame ring: %u x %u bytes\n",
+		cfg->slot_cnt, slot_size);
+
+	return 0;
+}
+
+/*
+ * (Re)allocates the frame ring according to the given configuration.
+ * On success, the ring content is discarded, unless handed over from the
+ * autostarted capture, and cfg->slot_size is updated.
+ */
+static int rpmsgcam_ring_setup(struct rpmsgcam_priv *priv,
+			       struct rpmsgcam_ring_config *cfg)
+{
+	int ret;
+
+	if (cfg->frame_size > 0 && (cfg->frame_size > SZ_16M || cfg->slot_cnt < 2 ||
+				    cfg->slot_cnt > RPMSGCAM_RING_SLOTS_MAX))
+		return -EINVAL;
+
+	if (cfg->flags & ~RPMSGCAM_RING_F_DDR)
+		return -EINVAL;
+
+	mutex_lock(&priv->ring_mutex);
+	ret = rpmsgcam_ring_alloc(priv, cfg);
+	mutex_unlock(&priv->ring_mutex);
+
+	return ret;
+}
+
+/*
+ * Drops the frame being reassembled, if any.
+ * Must be called with ring_lock held.
+ */
+static void rpmsgcam_ring_abort_frame(struct rpmsgcam_ring *ring)
+{
+	if (ring->fill_idx < 0)
+		return;
+
+	ring->state[ring->fill_idx] = RPMSGCAM_SLOT_FREE;
+	ring->fill_idx = -1;
+}
+
+/*
+ * Copies the content of a capture message into the frame ring.
+ * Must be called with ring_lock held.
+ *
+ * Returns true if the message completed a frame.
+ */
+static bool rpmsgcam_ring_put(struct rpmsgcam_priv *priv,
+			      struct bcam_pru_msg *msg, u32 len)
+{
+	struct rpmsgcam_ring *ring = &priv->ring;
+	int i;
+
+	len -= CAP_MSG_HDR_SIZE;
+
+	switch (msg->cap_hdr.frm) {
+	case BCAM_FRM_NONE:
+		return false;
+
+	case BCAM_FRM_START:
+		/* Frame end not received */
+		if (ring->fill_idx >= 0) {
+			priv->stats.frames_broken++;
+			rpmsgcam_ring_abort_frame(ring);
+		}
+
+		for (i = 0; i < ring->slot_cnt; i++)
+			if (ring->state[i] == RPMSGCAM_SLOT_FREE)
+				break;
+
+		if (i == ring->slot_cnt) {
+			dev_dbg(priv->dev, "Frame ring full, dropping frame\n");
+			priv->stats.frames_dropped++;
+			return false;
+		}
+
+		ring->state[i] = RPMSGCAM_SLOT_FILLING;
+		ring->fill_idx = i;
+		ring->fill_len = 0;
+		ring->fill_seq = 0;
+		break;
+
+	case BCAM_FRM_BODY:
+	case BCAM_FRM_END:
+		/* Frame start not received, wait for the next frame */
+		if (ring->fill_idx < 0)
+			return false;
+		break;
+
+	default:
+		dev_dbg(priv->dev, "Invalid frame section, dropping frame\n");
+		if (msg->cap_hdr.frm == BCAM_FRM_INVALID)
+			priv->stats.frames_invalid++;
+		else
+			priv->stats.frames_broken++;
+		rpmsgcam_ring_abort_frame(ring);
+		return false;
+	}
+
+	/* The frame trailer is not stored in the ring */
+	if (msg->cap_hdr.frm == BCAM_FRM_END) {
+		if (len < sizeof(struct bcam_frm_trailer)) {
+			dev_dbg(priv->dev, "Frame trailer missing, dropping frame\n");
+			priv->stats.frames_broken++;
+			rpmsgcam_ring_abort_frame(ring);
+			return false;
+		}
+
+		len -= sizeof(struct bcam_frm_trailer);
+	}
+
+	if (msg->cap_hdr.seq != ring->fill_seq ||
+	    ring->fill_len + len > ring->frame_size) {
+		dev_dbg(priv->dev, "Unexpected frame section (seq=%u, len=%u), dropping frame\n",
+			msg->cap_hdr.seq, len);
+		priv->stats.frames_broken++;
+		rpmsgcam_ring_abort_frame(ring);
+		return false;
+	}
+
+	memcpy((u8 *)ring->mem + ring->fill_idx * ring->slot_size + ring->fill_len,
+	       msg->cap_hdr.data, len);
+	ring->fill_len += len;
+	ring->fill_seq++;
+
+	if (msg->cap_hdr.frm != BCAM_FRM_END)
+		return false;
+
+	if (ring->fill_len != ring->frame_size) {
+		dev_dbg(priv->dev, "Incomplete frame (%u of %u bytes), dropping frame\n",
+			ring->fill_len, ring->frame_size);
+		priv->stats.frames_broken++;
+		rpmsgcam_ring_abort_frame(ring);
+		return false;
+	}
+
+	ring->state[ring->fill_idx] = RPMSGCAM_SLOT_DONE;
+	ring->seq[ring->fill_idx] = ring->frame_cnt++;
+	ring->done[(ring->done_rd + ring->done_cnt) % RPMSGCAM_RING_SLOTS_MAX] = ring->fill_idx;
+	ring->done_cnt++;
+	ring->fill_idx = -1;
+
+	priv->stats.frames_completed++;
+
+	return true;
+}
+
+/*
+ * Queues a frame written by PRU in the DDR frame ring.
+ * Must be called with ring_lock held.
+ *
+ * Returns true if the frame has been queued.
+ */
+static bool rpmsgcam_ring_frm_rdy(struct rpmsgcam_priv *priv,
+				  struct bcam_pru_msg *msg)
+{
+	struct rpmsgcam_ring *ring = &priv->ring;
+	u8 slot = msg->frm_hdr.slot;
+
+	if (slot >= ring->slot_cnt || ring->state[slot] != RPMSGCAM_SLOT_FREE) {
+		dev_dbg(priv->dev, "Unexpected frame ready (slot=%u)\n", slot);
+		priv->stats.frames_broken++;
+		return false;
+	}
+
+	if (msg->frm_hdr.len != ring->frame_size) {
+		dev_dbg(priv->dev, "Unexpected frame size (%u of %u bytes), dropping frame\n",
+			msg->frm_hdr.len, ring->frame_size);
+		priv->stats.frames_broken++;
+		WRITE_ONCE(ring->hdr->slot_busy[slot], 0);
+		return false;
+	}
+
+	ring->state[slot] = RPMSGCAM_SLOT_DONE;
+	ring->seq[slot] = ring->frame_cnt++;
+	ring->done[(ring->done_rd + ring->done_cnt) % RPMSGCAM_RING_SLOTS_MAX] = slot;
+	ring->done_cnt++;
+
+	priv->stats.frames_completed++;
+
+	return true;
+}
+
+/*
+ * Hands over to user space the oldest completed frame.
+ */
+static long rpmsgcam_ring_dqbuf(struct rpmsgcam_priv *priv, struct file *filp,
+				struct rpmsgcam_frame_desc __user *udesc)
+{
+	struct rpmsgcam_ring *ring = &priv->ring;
+	struct rpmsgcam_frame_desc desc = { 0 };
+	unsigned long flags;
+	int ret;
+
+	while (1) {
+		spin_lock_irqsave(&priv->ring_lock, flags);
+
+		if (!ring->mem) {
+			spin_unlock_irqrestore(&priv->ring_lock, flags);
+			return -EINVAL;
+		}
+
+		if (ring->done_cnt > 0)
+			break;
+
+		spin_unlock_irqrestore(&priv->ring_lock, flags);
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(priv->wait_list,
+					       READ_ONCE(ring->done_cnt) > 0);
+		if (ret)
+			return -EINTR;
+	}
+
+	desc.index = ring->done[ring->done_rd];
+	desc.seq = ring->seq[desc.index];
+	desc.len = ring->frame_size;
+
+	ring->done_rd = (ring->done_rd + 1) % RPMSGCAM_RING_SLOTS_MAX;
+	ring->done_cnt--;
+	ring->state[desc.index] = RPMSGCAM_SLOT_USER;
+
+	spin_unlock_irqrestore(&priv->ring_lock, flags);
+
+	if (copy_to_user(udesc, &desc, sizeof(desc))) {
+		spin_lock_irqsave(&priv->ring_lock, flags);
+		if (ring->state[desc.index] == RPMSGCAM_SLOT_USER)
+			ring->state[desc.index] = RPMSGCAM_SLOT_FREE;
+		spin_unlock_irqrestore(&priv->ring_lock, flags);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/*
+ * Gives back to the frame ring a slot previously obtained via DQBUF.
+ */
+static long rpmsgcam_ring_qbuf(struct rpmsgcam_priv *priv,
+			       struct rpmsgcam_frame_desc __user *udesc)
+{
+	struct rpmsgcam_ring *ring = &priv->ring;
+	struct rpmsgcam_frame_desc desc;
+	unsigned long flags;
+	int ret = 0;
+
+	if (copy_from_user(&desc, udesc, sizeof(desc)))
+		return -EFAULT;
+
+	spin_lock_irqsave(&priv->ring_lock, flags);
+
+	if (!ring->mem || desc.index >= ring->slot_cnt ||
+	    ring->state[desc.index] != RPMSGCAM_SLOT_USER) {
+		ret = -EINVAL;
+	} else {
+		ring->state[desc.index] = RPMSGCAM_SLOT_FREE;
+
+		/* Let PRU reuse the DDR frame ring slot */
+		if (ring->hdr)
+			WRITE_ONCE(ring->hdr->slot_busy[desc.index], 0);
+	}
+
+	spin_unlock_irqrestore(&priv->ring_lock, flags);
+
+	return ret;
+}
+
 static int rpmsgcam_open(struct inode *inode, struct file *filp)
 {
 	struct rpmsgcam_priv *priv;
@@ -90,6 +982,12 @@ static int rpmsgcam_release(struct inode *inode, struct file *filp)
 	struct rpmsgcam_priv *priv;
 
 	priv = container_of(inode->i_cdev, struct rpmsgcam_priv, cdev);
+
+	/* All the mappings are gone when the last file reference is dropped */
+	mutex_lock(&priv->ring_mutex);
+	rpmsgcam_ring_free(priv);
+	mutex_unlock(&priv->ring_mutex);
+
 	mutex_lock(&rpmsgcam_lock);
 	priv->locked = false;
 	mutex_unlock(&rpmsgcam_lock);
@@ -109,21 +1007,202 @@ static ssize_t rpmsgcam_read(struct file *filp, char __user *buf,
 
 	priv = filp->private_data;
 
-	if (kfifo_is_empty(&priv->msg_fifo) && (filp->f_flags & O_NONBLOCK))
-		return -EAGAIN;
-
-	ret = wait_event_interruptible(priv->wait_list,
-				       !kfifo_is_empty(&priv->msg_fifo));
+	ret = rpmsgcam_fifo_lock_read(priv, filp);
 	if (ret)
-		return -EINTR;
+		return ret;
 
 	ret = kfifo_to_user(&priv->msg_fifo, buf,
 			    priv->msg_len[priv->msg_idx_rd], &length);
-	priv->msg_idx_rd = (priv->msg_idx_rd + 1) % MAX_FIFO_MSG;
+	if (ret)
+		rpmsgcam_fifo_skip(priv, priv->msg_len[priv->msg_idx_rd] - length);
+	priv->msg_idx_rd = (priv->msg_idx_rd + 1) % priv->fifo_msgs;
+
+	mutex_unlock(&priv->fifo_mutex);
 
 	return ret ? ret : length;
 }
 
+/*
+ * Makes multiple messages from PRU available to user space in a single call.
+ */
+static long rpmsgcam_recv_msgs(struct rpmsgcam_priv *priv, struct file *filp,
+			       struct rpmsgcam_msg_batch __user *ubatch)
+{
+	struct rpmsgcam_msg_batch batch;
+	u32 __user *lens;
+	u8 __user *buf;
+	u32 length, copied, off = 0;
+	int ret;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.max_cnt == 0)
+		return -EINVAL;
+
+	buf = u64_to_user_ptr(batch.buf);
+	lens = u64_to_user_ptr(batch.lens);
+
+	ret = rpmsgcam_fifo_lock_read(priv, filp);
+	if (ret)
+		return ret;
+
+	for (batch.cnt = 0; batch.cnt < batch.max_cnt &&
+			    !kfifo_is_empty(&priv->msg_fifo); batch.cnt++) {
+		length = priv->msg_len[priv->msg_idx_rd];
+		if (off + length > batch.buf_len)
+			break;
+
+		ret = kfifo_to_user(&priv->msg_fifo, buf + off, length, &copied);
+		if (!ret && put_user(length, lens + batch.cnt))
+			ret = -EFAULT;
+
+		/* Drop just the faulting message, keeping the fifo in sync */
+		if (ret)
+			rpmsgcam_fifo_skip(priv, length - copied);
+
+		priv->msg_idx_rd = (priv->msg_idx_rd + 1) % priv->fifo_msgs;
+
+		if (ret)
+			break;
+
+		off += length;
+	}
+
+	/* Report the messages already dequeued, even if a copy failed later */
+	if (batch.cnt > 0)
+		ret = put_user(batch.cnt, &ubatch->cnt);
+	else if (!ret)
+		/* Not even the first message fits in the user buffer */
+		ret = -ENOBUFS;
+
+	mutex_unlock(&priv->fifo_mutex);
+	return ret;
+}
+
+/*
+ * Keeps track of the frame size configured via BCAM_ARM_MSG_CAP_SETUP,
+ * which is used to size the kernel fifo.
+ *
+ * Returns the command id or -EINVAL if data is not a valid command.
+ */
+static int rpmsgcam_parse_cmd(struct rpmsgcam_priv *priv, const void *data,
+			      size_t count)
+{
+	const struct bcam_arm_msg *msg = data;
+	const struct bcam_cap_config *cfg;
+	u32 roi_w, roi_h;
+
+	if (count < sizeof(*msg) ||
+	    msg->magic_byte.high != (BCAM_ARM_MSG_MAGIC >> 8) ||
+	    msg->magic_byte.low != (BCAM_ARM_MSG_MAGIC & 0xff))
+		return -EINVAL;
+
+	if (msg->id != BCAM_ARM_MSG_CAP_SETUP || count < sizeof(*msg) + sizeof(*cfg))
+		return msg->id;
+
+	cfg = (const struct bcam_cap_config *)msg->data;
+	roi_w = cfg->roi_w ? cfg->roi_w : cfg->xres;
+	roi_h = cfg->roi_h ? cfg->roi_h : cfg->yres;
+	priv->frame_size = BCAM_DEC_LEN(roi_w, cfg->dec_x) *
+			   BCAM_DEC_LEN(roi_h, cfg->dec_y) *
+			   BCAM_PIX_FMT_BPP(cfg->pix_fmt) / 8;
+
+	/* Not fatal, the current fifo is kept */
+	rpmsgcam_fifo_adjust(priv);
+
+	return msg->id;
+}
+
+/*
+ * Starts the capture configured via the autostart module parameters. The
+ * frames are received in the frame ring, preferably in the DDR one, until
+ * user space takes over.
+ */
+static int rpmsgcam_autostart(struct rpmsgcam_priv *priv)
+{
+	struct bcam_cap_config cap_cfg = { 0 };
+	struct rpmsgcam_ring_config ring_cfg = { 0 };
+	int ret;
+
+	if (!autostart_xres || autostart_xres > U16_MAX ||
+	    !autostart_yres || autostart_yres > U16_MAX ||
+	    autostart_pclk_mhz > U8_MAX)
+		return -EINVAL;
+
+	cap_cfg.xres = autostart_xres;
+	cap_cfg.yres = autostart_yres;
+	cap_cfg.pix_fmt = BCAM_PIX_FMT_RGB565;
+	cap_cfg.bpp = BCAM_PIX_FMT_BPP(cap_cfg.pix_fmt);
+	cap_cfg.test_mode = !!autostart_test_mode;
+	cap_cfg.test_pclk_mhz = autostart_pclk_mhz;
+
+	priv->frame_size = cap_cfg.xres * cap_cfg.yres * cap_cfg.bpp / 8;
+
+	ring_cfg.frame_size = priv->frame_size;
+	ring_cfg.slot_cnt = AUTOSTART_RING_SLOTS;
+	ring_cfg.flags = RPMSGCAM_RING_F_DDR;
+
+	/* User space cannot set up the ring before the capture is started */
+	mutex_lock(&priv->ring_mutex);
+
+	ret = rpmsgcam_ring_alloc(priv, &ring_cfg);
+	if (ret)
+		goto unlock;
+
+	/* Not fatal, the current fifo is kept */
+	rpmsgcam_fifo_adjust(priv);
+
+	if (ring_cfg.flags & RPMSGCAM_RING_F_DDR)
+		cap_cfg.xfer_mode = BCAM_XFER_DDR;
+
+	ret = rpmsgcam_send_cmd(priv, BCAM_ARM_MSG_CAP_SETUP, &cap_cfg, sizeof(cap_cfg));
+	if (!ret)
+		ret = rpmsgcam_send_cmd(priv, BCAM_ARM_MSG_CAP_START, NULL, 0);
+	if (ret)
+		rpmsgcam_ring_free(priv);
+	else
+		priv->autostarted = true;
+
+unlock:
+	mutex_unlock(&priv->ring_mutex);
+
+	if (ret)
+		return ret;
+
+	dev_info(priv->dev, "Autostarted %ux%u capture (%s frame ring)\n",
+		 autostart_xres, autostart_yres,
+		 cap_cfg.xfer_mode == BCAM_XFER_DDR ? "DDR" : "driver");
+
+	return 0;
+}
+
+/*
+ * Ends the autostarted capture when user space sends its own capture
+ * command. PRU accepts a new capture configuration only while stopped.
+ */
+static void rpmsgcam_autostart_end(struct rpmsgcam_priv *priv, int cmd_id)
+{
+	if (cmd_id < BCAM_ARM_MSG_CAP_SETUP || cmd_id > BCAM_ARM_MSG_CAP_STOP)
+		return;
+
+	mutex_lock(&priv->ring_mutex);
+
+	if (!priv->autostarted)
+		goto unlock;
+
+	if (cmd_id == BCAM_ARM_MSG_CAP_SETUP) {
+		rpmsgcam_autostart_stop(priv);
+	} else {
+		priv->autostarted = false;
+		/* Keep the replies to the user space commands paired */
+		rpmsgcam_cmd_wait(priv);
+	}
+
+unlock:
+	mutex_unlock(&priv->ring_mutex);
+}
+
 /*
  * Sends data from user space to PRU.
  */
@@ -146,6 +1225,8 @@ static ssize_t rpmsgcam_write(struct file *filp, const char __user *buf,
 		return -EFAULT;
 	}
 
+	rpmsgcam_autostart_end(priv, rpmsgcam_parse_cmd(priv, rpmsgcam_buf, count));
+
 	ret = rpmsg_send(priv->rpdev->ept, (void *)rpmsgcam_buf, count);
 	if (ret)
 		dev_err(priv->dev, "rpmsg_send failed: %d\n", ret);
@@ -168,9 +1249,125 @@ static unsigned int rpmsgcam_poll(struct file *filp,
 	if (!kfifo_is_empty(&priv->msg_fifo))
 		mask |= POLLIN | POLLRDNORM;
 
+	/* Completed frames in the frame ring */
+	if (READ_ONCE(priv->ring.done_cnt) > 0)
+		mask |= POLLPRI;
+
 	return mask;
 }
 
+static long rpmsgcam_ioctl(struct file *filp, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct rpmsgcam_ring_config cfg;
+	struct rpmsgcam_stats stats;
+	struct rpmsgcam_priv *priv;
+	void __user *argp = (void __user *)arg;
+	int ret;
+
+	priv = filp->private_data;
+
+	switch (cmd) {
+	case RPMSGCAM_IOC_SETUP_RING:
+		if (copy_from_user(&cfg, argp, sizeof(cfg)))
+			return -EFAULT;
+
+		ret = rpmsgcam_ring_setup(priv, &cfg);
+		if (ret)
+			return ret;
+
+		/* Not fatal, the current fifo is kept */
+		rpmsgcam_fifo_adjust(priv);
+
+		return copy_to_user(argp, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+
+	case RPMSGCAM_IOC_DQBUF:
+		return rpmsgcam_ring_dqbuf(priv, filp, argp);
+
+	case RPMSGCAM_IOC_QBUF:
+		return rpmsgcam_ring_qbuf(priv, argp);
+
+	case RPMSGCAM_IOC_RECV_MSGS:
+		return rpmsgcam_recv_msgs(priv, filp, argp);
+
+	case RPMSGCAM_IOC_GET_STATS:
+		memcpy(&stats, &priv->stats, sizeof(stats));
+		return copy_to_user(argp, &stats, sizeof(stats)) ? -EFAULT : 0;
+	}
+
+	return -ENOTTY;
+}
+
+static void rpmsgcam_vm_open(struct vm_area_struct *vma)
+{
+	struct rpmsgcam_priv *priv = vma->vm_private_data;
+
+	atomic_inc(&priv->ring_maps);
+}
+
+static void rpmsgcam_vm_close(struct vm_area_struct *vma)
+{
+	struct rpmsgcam_priv *priv = vma->vm_private_data;
+
+	atomic_dec(&priv->ring_maps);
+}
+
+static const struct vm_operations_struct rpmsgcam_vm_ops = {
+	.open		= rpmsgcam_vm_open,
+	.close		= rpmsgcam_vm_close,
+};
+
+/*
+ * Maps the frame ring to user space.
+ */
+static int rpmsgcam_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct rpmsgcam_priv *priv;
+	unsigned long ring_pages;
+	int ret;
+
+	priv = filp->private_data;
+
+	mutex_lock(&priv->ring_mutex);
+
+	if (!priv->ring.mem) {
+		dev_err(priv->dev, "Frame ring not allocated\n");
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	/* Only the ring slots can be mapped, not the rest of the carveout */
+	ring_pages = (priv->ring.slot_cnt * priv->ring.slot_size) >> PAGE_SHIFT;
+	if (vma->vm_pgoff >= ring_pages ||
+	    vma_pages(vma) > ring_pages - vma->vm_pgoff) {
+		dev_err(priv->dev, "Mapping exceeds the frame ring\n");
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	if (priv->ring.hdr) {
+		/* Skip the DDR frame ring header */
+		vma->vm_pgoff += BCAM_FRM_RING_HDR_SIZE >> PAGE_SHIFT;
+		ret = dma_mmap_coherent(priv->frm_carveout_dev, vma,
+					priv->frm_carveout->va,
+					priv->frm_carveout->dma,
+					BCAM_FRM_RING_HDR_SIZE +
+					priv->ring.slot_cnt * priv->ring.slot_size);
+	} else {
+		ret = remap_vmalloc_range(vma, priv->ring.mem, vma->vm_pgoff);
+	}
+	if (ret)
+		goto unlock;
+
+	vma->vm_ops = &rpmsgcam_vm_ops;
+	vma->vm_private_data = priv;
+	rpmsgcam_vm_open(vma);
+
+unlock:
+	mutex_unlock(&priv->ring_mutex);
+	return ret;
+}
+
 static const struct file_operations rpmsgcam_fops = {
 	.owner		= THIS_MODULE,
 	.open		= rpmsgcam_open,
@@ -178,30 +1375,117 @@ static const struct file_operations rpmsgcam_fops = {
 	.read		= rpmsgcam_read,
 	.write		= rpmsgcam_write,
 	.poll		= rpmsgcam_poll,
+	.unlocked_ioctl	= rpmsgcam_ioctl,
+	.mmap		= rpmsgcam_mmap,
+};
+
+#define RPMSGCAM_STATS_ATTR(_name)					\
+static ssize_t _name##_show(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct rpmsgcam_priv *priv = dev_get_drvdata(dev);		\
+									\
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->stats._name));	\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+RPMSGCAM_STATS_ATTR(msgs_received);
+RPMSGCAM_STATS_ATTR(fifo_overflows);
+RPMSGCAM_STATS_ATTR(fifo_msgs);
+RPMSGCAM_STATS_ATTR(fifo_peak);
+RPMSGCAM_STATS_ATTR(frames_completed);
+RPMSGCAM_STATS_ATTR(frames_dropped);
+RPMSGCAM_STATS_ATTR(frames_broken);
+RPMSGCAM_STATS_ATTR(frames_invalid);
+
+static struct attribute *rpmsgcam_attrs[] = {
+	&dev_attr_msgs_received.attr,
+	&dev_attr_fifo_overflows.attr,
+	&dev_attr_fifo_msgs.attr,
+	&dev_attr_fifo_peak.attr,
+	&dev_attr_frames_completed.attr,
+	&dev_attr_frames_dropped.attr,
+	&dev_attr_frames_broken.attr,
+	&dev_attr_frames_invalid.attr,
+	NULL,
 };
+ATTRIBUTE_GROUPS(rpmsgcam);
 
 static int rpmsgcam_cb(struct rpmsg_device *rpdev,
 		       void *data, int len, void *cbpriv, u32 src)
 {
 	struct rpmsgcam_priv *priv = dev_get_drvdata(&rpdev->dev);
-	u32 length;
+	struct bcam_pru_msg *msg = data;
+	bool ring_used = false, frame_rdy = false;
+	unsigned long flags;
+	u32 length, cnt;
+	int ret = 0;
 
 	dev_dbg(&rpdev->dev, "incoming msg (len: %d, src: 0x%x)\n", len, src);
 	print_hex_dump_debug("rpmsgcam data: ", DUMP_PREFIX_NONE, 16, 1, data, len, true);
 
-	if (kfifo_avail(&priv->msg_fifo) < len) {
-		dev_err(&rpdev->dev, "Not enough space on the FIFO\n");
-		return -ENOSPC;
+	priv->stats.msgs_received++;
+
+	/* Capture data goes to the frame ring, if enabled */
+	if (len >= CAP_MSG_HDR_SIZE && msg->type == BCAM_PRU_MSG_CAP) {
+		spin_lock_irqsave(&priv->ring_lock, flags);
+		if (priv->ring.mem && !priv->ring.hdr) {
+			ring_used = true;
+			frame_rdy = rpmsgcam_ring_put(priv, msg, len);
+		}
+		spin_unlock_irqrestore(&priv->ring_lock, flags);
+
+		if (frame_rdy)
+			wake_up_interruptible(&priv->wait_list);
+
+		if (ring_used)
+			return 0;
+	} else if (len >= FRM_RDY_MSG_SIZE && msg->type == BCAM_PRU_MSG_FRM_RDY) {
+		spin_lock_irqsave(&priv->ring_lock, flags);
+		if (priv->ring.hdr) {
+			ring_used = true;
+			frame_rdy = rpmsgcam_ring_frm_rdy(priv, msg);
+		}
+		spin_unlock_irqrestore(&priv->ring_lock, flags);
+
+		if (frame_rdy)
+			wake_up_interruptible(&priv->wait_list);
+
+		if (ring_used)
+			return 0;
+	} else if (len >= LOG_MSG_HDR_SIZE && msg->type == BCAM_PRU_MSG_LOG &&
+		   rpmsgcam_cmd_reply(priv, msg, len)) {
+		/* Reply to a driver command, keep the user space ones paired */
+		dev_dbg(&rpdev->dev, "PRU reply: %.*s\n",
+			len - (int)LOG_MSG_HDR_SIZE, msg->log_hdr.data);
+		wake_up(&priv->wait_list);
+		return 0;
 	}
 
-	if ((priv->msg_idx_wr + 1) % MAX_FIFO_MSG == priv->msg_idx_rd) {
-		dev_err(&rpdev->dev, "Message length table is full\n");
-		return -ENOSPC;
+	spin_lock_irqsave(&priv->fifo_lock, flags);
+
+	if (kfifo_avail(&priv->msg_fifo) < len ||
+	    (priv->msg_idx_wr + 1) % priv->fifo_msgs == priv->msg_idx_rd) {
+		priv->stats.fifo_overflows++;
+		ret = -ENOSPC;
+		goto unlock;
 	}
 
 	length = kfifo_in(&priv->msg_fifo, data, len);
 	priv->msg_len[priv->msg_idx_wr] = length;
-	priv->msg_idx_wr = (priv->msg_idx_wr + 1) % MAX_FIFO_MSG;
+	priv->msg_idx_wr = (priv->msg_idx_wr + 1) % priv->fifo_msgs;
+
+	cnt = rpmsgcam_fifo_cnt(priv);
+	if (cnt > priv->stats.fifo_peak)
+		priv->stats.fifo_peak = cnt;
+
+unlock:
+	spin_unlock_irqrestore(&priv->fifo_lock, flags);
+
+	if (ret) {
+		dev_err_ratelimited(&rpdev->dev, "Not enough space on the FIFO, message dropped\n");
+		return ret;
+	}
 
 	wake_up_interruptible(&priv->wait_list);
 
@@ -243,8 +1527,9 @@ static int rpmsgcam_probe(struct rpmsg_device *rpdev)
 		goto fail_add_cdev;
 	}
 
-	priv->dev = device_create(rpmsgcam_class, &rpdev->dev, priv->devt,
-				  NULL, "rpmsgcam%d", rpdev->dst);
+	priv->dev = device_create_with_groups(rpmsgcam_class, &rpdev->dev,
+					      priv->devt, priv, rpmsgcam_groups,
+					      "rpmsgcam%d", rpdev->dst);
 	if (IS_ERR(priv->dev)) {
 		dev_err(&rpdev->dev, "Unable to create the rpmsgcam device\n");
 		ret = PTR_ERR(priv->dev);
@@ -253,8 +1538,10 @@ static int rpmsgcam_probe(struct rpmsg_device *rpdev)
 
 	priv->rpdev = rpdev;
 
-	ret = kfifo_alloc(&priv->msg_fifo, MAX_FIFO_MSG * FIFO_MSG_SIZE,
-			  GFP_KERNEL);
+	spin_lock_init(&priv->fifo_lock);
+	mutex_init(&priv->fifo_mutex);
+
+	ret = rpmsgcam_fifo_adjust(priv);
 	if (ret) {
 		dev_err(&rpdev->dev, "Unable to allocate fifo for the rpmsgcam device\n");
 		goto fail_alloc_fifo;
@@ -262,18 +1549,23 @@ static int rpmsgcam_probe(struct rpmsg_device *rpdev)
 
 	init_waitqueue_head(&priv->wait_list);
 
+	spin_lock_init(&priv->ring_lock);
+	mutex_init(&priv->ring_mutex);
+	priv->ring.fill_idx = -1;
+
+	spin_lock_init(&priv->cmd_lock);
+
+	rpmsgcam_find_carveout(priv);
+
 	dev_set_drvdata(&rpdev->dev, priv);
 
 	dev_info(&rpdev->dev, "new rpmsg_pru device: /dev/rpmsgcam%d", rpdev->dst);
 
-	/* TODO: module param to autostart camera capture */
-	if (0) {
-		uint8_t start_cmd[4] = { 0xbe, 0xca, 0x2, 0x0 };
-		ret = rpmsg_send(rpdev->ept, start_cmd, sizeof(start_cmd));
-		if (ret) {
-			dev_err(&rpdev->dev, "rpmsg_send failed: %d\n", ret);
-			return ret;
-		}
+	/* Not fatal, user space can still start the capture */
+	if (autostart) {
+		ret = rpmsgcam_autostart(priv);
+		if (ret)
+			dev_warn(&rpdev->dev, "Failed to autostart capture: %d\n", ret);
 	}
 
 	return 0;
@@ -296,7 +1588,12 @@ static void rpmsgcam_remove(struct rpmsg_device *rpdev)
 
 	priv = dev_get_drvdata(&rpdev->dev);
 
-	kfifo_free(&priv->msg_fifo);
+	mutex_lock(&priv->ring_mutex);
+	rpmsgcam_ring_free(priv);
+	mutex_unlock(&priv->ring_mutex);
+
+	kvfree(priv->fifo_mem);
+	kfree(priv->msg_len);
 	device_destroy(rpmsgcam_class, priv->devt);
 	cdev_del(&priv->cdev);
 	mutex_lock(&rpmsgcam_lock);